@@ -0,0 +1,436 @@
+/*
+ * lsp_bench - benchmarks for the hot paths of lsp
+ *
+ * Copyright (C) 2023-2024, Dirk Gouders
+ *
+ * This file is part of lsp.
+ *
+ * lsp is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * lsp is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * lsp. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * All functions of lsp are static, so we include its source and provide our
+ * own main().
+ *
+ * The benchmarks run on generated corpora of a given size (default 64M,
+ * e.g. "lsp_bench 4G" for a multi-GB log):
+ *
+ *   log	plain log lines
+ *   man	manual page output with overstrike sequences
+ *   sgr	output colored with SGR sequences
+ *   csv	long lines of comma separated values
+ *
+ * Each corpus ends with a line containing LSP_BENCH_NEEDLE and starts with
+ * one containing LSP_BENCH_FIRST, so searches for them have to look at all
+ * the data.
+ *
+ * curses output goes to /dev/null, no terminal is needed.
+ */
+#define LSP_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../lsp.c"
+
+#include <time.h>
+
+#define LSP_BENCH_FIRST "lsp-bench-first"
+#define LSP_BENCH_NEEDLE "lsp-bench-needle"
+
+enum { LSP_BENCH_LOOKUPS = 1000000 };	/* lsp_file_pos2line() calls */
+enum { LSP_BENCH_PAGES = 5000 };	/* max. pages to display */
+
+/* Where results go; stdout belongs to curses. */
+static FILE *lsp_bench_out;
+
+/* Simple generator to get the same corpora on every run. */
+static unsigned long lsp_bench_seed = 1;
+
+static unsigned long lsp_bench_rand()
+{
+	lsp_bench_seed = lsp_bench_seed * 6364136223846793005UL +
+		1442695040888963407UL;
+
+	return lsp_bench_seed >> 33;
+}
+
+static double lsp_bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *lsp_bench_words[] = {
+	"request", "lsp", "buffer", "search", "window", "manual", "page",
+	"reference", "status", "connection", "timeout", "worker", "index"
+};
+
+static const char *lsp_bench_word()
+{
+	size_t n = sizeof(lsp_bench_words) / sizeof(lsp_bench_words[0]);
+
+	return lsp_bench_words[lsp_bench_rand() % n];
+}
+
+/*
+ * Write a word in bold or underlined like man(1) without colors does.
+ */
+static void lsp_bench_overstrike(FILE *fp, const char *word, bool bold)
+{
+	for (; *word; word++)
+		if (bold)
+			fprintf(fp, "%c\b%c", *word, *word);
+		else
+			fprintf(fp, "_\b%c", *word);
+}
+
+/*
+ * Corpus generators: write one chunk of lines to fp.
+ */
+static void lsp_bench_gen_log(FILE *fp)
+{
+	fprintf(fp, "2024-05-%02lu 12:%02lu:%02lu.%06lu host%lu %s[%lu]: "
+		"%s %s took %lu ms\n",
+		lsp_bench_rand() % 28 + 1, lsp_bench_rand() % 60,
+		lsp_bench_rand() % 60, lsp_bench_rand() % 1000000,
+		lsp_bench_rand() % 16, lsp_bench_word(),
+		lsp_bench_rand() % 32768, lsp_bench_word(),
+		lsp_bench_word(), lsp_bench_rand() % 5000);
+}
+
+static void lsp_bench_gen_man(FILE *fp)
+{
+	int i, j;
+
+	lsp_bench_overstrike(fp, "SECTION", true);
+	fputc('\n', fp);
+
+	for (i = 0; i < 4; i++) {
+		fputs("   ", fp);
+		lsp_bench_overstrike(fp, lsp_bench_word(), true);
+		fputc('\n', fp);
+
+		for (j = 0; j < 6; j++) {
+			fprintf(fp, "       %s ", lsp_bench_word());
+			lsp_bench_overstrike(fp, lsp_bench_word(), false);
+			fprintf(fp, " %s %s(%lu) ", lsp_bench_word(),
+				lsp_bench_word(), lsp_bench_rand() % 8 + 1);
+			lsp_bench_overstrike(fp, lsp_bench_word(), true);
+			fprintf(fp, " %s %s.\n", lsp_bench_word(), lsp_bench_word());
+		}
+		fputc('\n', fp);
+	}
+}
+
+static void lsp_bench_gen_sgr(FILE *fp)
+{
+	fprintf(fp, "\033[1;32m%02lu:%02lu:%02lu\033[0m "
+		"\033[38;5;%lum%s\033[0m \033[1m%s\033[22m %s "
+		"\033[48;5;%lum%s\033[0m %s\n",
+		lsp_bench_rand() % 24, lsp_bench_rand() % 60,
+		lsp_bench_rand() % 60, lsp_bench_rand() % 256,
+		lsp_bench_word(), lsp_bench_word(), lsp_bench_word(),
+		lsp_bench_rand() % 256, lsp_bench_word(), lsp_bench_word());
+}
+
+static void lsp_bench_gen_csv(FILE *fp)
+{
+	int i;
+	int fields = 200 + lsp_bench_rand() % 400;
+
+	fprintf(fp, "%lu", lsp_bench_rand());
+
+	for (i = 1; i < fields; i++)
+		if (i % 3)
+			fprintf(fp, ",%lu", lsp_bench_rand() % 100000);
+		else
+			fprintf(fp, ",%s", lsp_bench_word());
+
+	fputc('\n', fp);
+}
+
+struct lsp_bench_corpus_t {
+	const char *name;
+	void (*gen)(FILE *);
+};
+
+static struct lsp_bench_corpus_t lsp_bench_corpora[] = {
+	{ "log", lsp_bench_gen_log },
+	{ "man", lsp_bench_gen_man },
+	{ "sgr", lsp_bench_gen_sgr },
+	{ "csv", lsp_bench_gen_csv },
+};
+
+/*
+ * Create a temporary file with the given corpus of about size bytes.
+ *
+ * The caller has to unlink() and free() the returned name.
+ */
+static char *lsp_bench_corpus_create(struct lsp_bench_corpus_t *corpus,
+				     size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	char *name;
+	int fd;
+	FILE *fp;
+
+	if (dir == NULL)
+		dir = "/tmp";
+
+	name = lsp_malloc(strlen(dir) + strlen("/lsp_bench_XXXXXX") + 1);
+	sprintf(name, "%s/lsp_bench_XXXXXX", dir);
+
+	fd = mkstemp(name);
+	if (fd == -1)
+		lsp_error("%s: %s: %s", __func__, name, strerror(errno));
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL)
+		lsp_error("%s: %s: %s", __func__, name, strerror(errno));
+
+	fprintf(fp, "%s\n", LSP_BENCH_FIRST);
+
+	while ((size_t)ftello(fp) < size)
+		corpus->gen(fp);
+
+	fprintf(fp, "%s\n", LSP_BENCH_NEEDLE);
+
+	if (fclose(fp) != 0)
+		lsp_error("%s: %s: %s", __func__, name, strerror(errno));
+
+	return name;
+}
+
+static void lsp_bench_report(const char *corpus, const char *what,
+			     double amount, const char *unit, double secs)
+{
+	fprintf(lsp_bench_out, "%-4s %-18s %12.1f %-10s (%.3f s)\n",
+		corpus, what, amount / secs, unit, secs);
+}
+
+static void lsp_bench_report_bytes(const char *corpus, const char *what,
+				   off_t bytes, double secs)
+{
+	lsp_bench_report(corpus, what, bytes / (1024.0 * 1024.0), "MB/s", secs);
+}
+
+/*
+ * Open the file and read all of it.
+ */
+static void lsp_bench_ingest(const char *corpus, char *name)
+{
+	double t = lsp_bench_now();
+
+	lsp_file_add(name, true);
+	lsp_file_init();
+
+	while (!LSP_EOF)
+		lsp_file_add_block();
+
+	lsp_bench_report_bytes(corpus, "ingest", cf->size,
+			       lsp_bench_now() - t);
+}
+
+/*
+ * Build and normalize every line of the file.
+ */
+static void lsp_bench_lines(const char *corpus)
+{
+	struct lsp_line_t *line;
+	double t = lsp_bench_now();
+
+	lsp_file_set_pos(0);
+
+	while ((line = lsp_get_line_from_here()) != NULL)
+		lsp_line_dtor(line);
+
+	lsp_bench_report_bytes(corpus, "lines", cf->size, lsp_bench_now() - t);
+}
+
+static void lsp_bench_search_compile(const char *pattern)
+{
+	strcpy(lsp_search_string, pattern);
+
+	if (lsp_search_compile_regex(LSP_SEARCH_MODE) != NULL)
+		lsp_error("%s: cannot compile \"%s\"", __func__, pattern);
+
+	cf->regex_p = lsp_search_regex;
+	lsp_mode_set(LSP_SEARCH_MODE);
+}
+
+/*
+ * Search forward from the start of the file for something in its last line.
+ */
+static void lsp_bench_search_fw(const char *corpus, const char *what,
+				const char *pattern)
+{
+	regmatch_t match;
+	double t;
+
+	lsp_bench_search_compile(pattern);
+
+	t = lsp_bench_now();
+
+	lsp_file_set_pos(0);
+	match = lsp_file_search_next();
+
+	t = lsp_bench_now() - t;
+
+	if (lsp_is_no_match(match))
+		lsp_error("%s: \"%s\" not found", __func__, pattern);
+
+	lsp_bench_report_bytes(corpus, what, cf->size, t);
+}
+
+/*
+ * Search backward from the end of the file for its first line.
+ */
+static void lsp_bench_search_bw(const char *corpus)
+{
+	struct lsp_line_t *line;
+	regmatch_t match;
+	double t;
+
+	lsp_bench_search_compile(LSP_BENCH_FIRST);
+
+	t = lsp_bench_now();
+
+	lsp_file_set_pos(cf->size);
+	line = lsp_file_get_prev_line();
+	match = lsp_line_get_last_match(&line);
+	lsp_line_dtor(line);
+
+	t = lsp_bench_now() - t;
+
+	if (lsp_is_no_match(match))
+		lsp_error("%s: \"%s\" not found", __func__, LSP_BENCH_FIRST);
+
+	lsp_bench_report_bytes(corpus, "search bw", cf->size, t);
+}
+
+/*
+ * Classify all lines for the TOC.
+ */
+static void lsp_bench_toc(const char *corpus)
+{
+	double t = lsp_bench_now();
+
+	lsp_toc_ctor();
+
+	while (lsp_toc_classify())
+		;
+
+	lsp_bench_report_bytes(corpus, "toc", cf->size, lsp_bench_now() - t);
+
+	lsp_toc_dtor(cf);
+}
+
+/*
+ * Look up line numbers of random positions.
+ */
+static void lsp_bench_pos2line(const char *corpus)
+{
+	size_t sum = 0;
+	size_t i;
+	double t = lsp_bench_now();
+
+	for (i = 0; i < LSP_BENCH_LOOKUPS; i++)
+		sum += lsp_file_pos2line(lsp_bench_rand() % cf->size);
+
+	t = lsp_bench_now() - t;
+
+	/* Use the result. */
+	if (sum == 0)
+		lsp_error("%s: no lines?", __func__);
+
+	lsp_bench_report(corpus, "pos2line", LSP_BENCH_LOOKUPS / 1e6,
+			 "M calls/s", t);
+}
+
+/*
+ * Page through the file with full redraws.
+ */
+static void lsp_bench_display(const char *corpus)
+{
+	size_t pages = 0;
+	double t = lsp_bench_now();
+
+	lsp_file_set_pos(0);
+
+	while (pages < LSP_BENCH_PAGES && lsp_pos < cf->size) {
+		lsp_display_page();
+		pages++;
+	}
+
+	lsp_bench_report(corpus, "display", pages, "pages/s",
+			 lsp_bench_now() - t);
+}
+
+static void lsp_bench_corpus(struct lsp_bench_corpus_t *corpus, size_t size)
+{
+	char *name = lsp_bench_corpus_create(corpus, size);
+
+	lsp_bench_ingest(corpus->name, name);
+	lsp_bench_lines(corpus->name);
+	lsp_bench_search_fw(corpus->name, "search fw", LSP_BENCH_NEEDLE);
+	lsp_bench_search_fw(corpus->name, "search fw regex",
+			    "bench-[nN]ee+dle$");
+	lsp_bench_search_bw(corpus->name);
+	lsp_bench_toc(corpus->name);
+	lsp_bench_pos2line(corpus->name);
+	lsp_bench_display(corpus->name);
+
+	lsp_file_kill();
+
+	unlink(name);
+	free(name);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = 64 * 1024 * 1024;
+	size_t i;
+	int fd;
+
+	if (argc > 1)
+		size = lsp_parse_size(argv[1]);
+
+	/* Keep results apart from what curses writes. */
+	lsp_bench_out = fdopen(dup(STDOUT_FILENO), "w");
+	if (lsp_bench_out == NULL)
+		lsp_error("%s: %s", __func__, strerror(errno));
+	setlinebuf(lsp_bench_out);
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd == -1)
+		lsp_error("%s: /dev/null: %s", __func__, strerror(errno));
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+
+	lsp_init();
+
+	/* A common window size, the terminal can't tell us. */
+	setenv("TERM", "xterm-256color", 1);
+	setenv("LINES", "50", 1);
+	setenv("COLUMNS", "160", 1);
+
+	if (lsp_init_screen() == -1)
+		lsp_error("%s: cannot initialize curses", __func__);
+
+	for (i = 0; i < sizeof(lsp_bench_corpora) / sizeof(lsp_bench_corpora[0]); i++)
+		lsp_bench_corpus(&lsp_bench_corpora[i], size);
+
+	lsp_finish();
+}
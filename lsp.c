@@ -41,6 +41,10 @@
  *   further processing data from those blocks is read by
  *   lsp_file_getch().
  *
+ *   Regular files of known size are mapped into memory instead.  They
+ *   then consist of one single block of the file's size and reading
+ *   just means recording the lines of the next chunk of the mapping.
+ *
  *   Paging then happens by processing file's data line-by-line
  *   (struct lsp_line_t).  Searches can occur on those lines, final
  *   output then happens char-by-char so that we can act on control
@@ -50,7 +54,10 @@
  * -----
  *   When data blocks are read each block is inspected for newline
  *   characters and for each line its start position in the file is
- *   stored in an array cf->lines.
+ *   recorded in cf->lines.  To keep this small for huge files, the
+ *   positions are delta-encoded in chunks of LSP_LINES_CHUNK lines,
+ *   each with the absolute position of its first line; see
+ *   lsp_lines_get() and lsp_lines_find().
  *
  *   Lines in cf->lines are indexed zero-based but for the outside
  *   world we start counting lines from 1 which means that a file with
@@ -86,11 +93,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <limits.h>
 #include <string.h>
 #include <curses.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -102,11 +112,18 @@
 #endif
 #include <locale.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <getopt.h>
 #include <assert.h>
 #include <langinfo.h>
-#include <search.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "lsp.h"
 
@@ -169,6 +186,17 @@ static void *lsp_realloc(void *ptr, size_t size)
 	return ret_ptr;
 }
 
+/*
+ * regexec(3) that gets counted in lsp_stats.
+ */
+static int lsp_regexec(const regex_t *preg, const char *string, size_t nmatch,
+		       regmatch_t *pmatch, int eflags)
+{
+	lsp_stats.regexec++;
+
+	return regexec(preg, string, nmatch, pmatch, eflags);
+}
+
 /*
  * Try to detect if file_t is a manual page.
  * Return a string xyz(n) if so, NULL otherwise.
@@ -223,7 +251,7 @@ static char *lsp_detect_manpage(bool use_env)
 	pmatch[0].rm_so = 0;
 	pmatch[0].rm_eo = line->nlen;
 
-	ret = regexec(&preg, line->normalized, 1, pmatch, REG_STARTEND);
+	ret = lsp_regexec(&preg, line->normalized, 1, pmatch, REG_STARTEND);
 
 	regfree(&preg);
 
@@ -259,8 +287,8 @@ static char *lsp_detect_manpage(bool use_env)
  */
 static void lsp_file_align_buffer()
 {
-	struct data_t *here = cf->data;
 	off_t i = lsp_pos - 1;
+	size_t n;
 
 	if (cf->unaligned == 0)
 		return;
@@ -268,32 +296,20 @@ static void lsp_file_align_buffer()
 	if (i == (off_t)-1)
 		i = 0;
 
-	/* Search for the buffer that contains lsp_pos - 1. */
-	while (1) {
-		if ((i >= cf->data->seek) &&
-		    (i < (cf->data->seek + cf->blksize)))
-			break;
+	/* All buffers but the last one are full, so the buffer that contains
+	   lsp_pos - 1 can be looked up directly. */
+	n = i / cf->blksize;
 
-		if (i < cf->data->seek)
-			cf->data = cf->data->prev;
-		else
-			cf->data = cf->data->next;
+	if (n >= cf->blocks_count)
+		n = cf->blocks_count - 1;
 
-		if (here == cf->data)
-			lsp_error("%s: Endless loop while aligning buffers.",
-				  __func__);
-	}
+	cf->data = cf->blocks[n];
 
-	cf->unaligned = 0;
-}
+	if (i < cf->data->seek)
+		lsp_error("%s: problem with buffer index! i = %ld, seek = %ld",
+			  __func__, i, cf->data->seek);
 
-/*
- * Unget the last received byte of current file.
- */
-static void lsp_file_ungetch()
-{
-	if (lsp_pos > 0)
-		lsp_file_set_pos(lsp_pos - 1);
+	cf->unaligned = 0;
 }
 
 /*
@@ -301,8 +317,15 @@ static void lsp_file_ungetch()
  */
 static void lsp_goto_bol()
 {
-	while (lsp_pos > 0 && lsp_file_peek_bw() != '\n')
-		lsp_file_ungetch();
+	/* The start of a line right after the data we read so far is not
+	   recorded, yet. */
+	if (lsp_pos >= cf->seek) {
+		if (lsp_pos > 0 && lsp_file_peek_bw() == '\n')
+			return;
+	}
+
+	if (lsp_pos > 0)
+		lsp_file_set_pos(lsp_lines_get(lsp_lines_find(lsp_pos)));
 }
 
 /*
@@ -319,6 +342,47 @@ static size_t lsp_skip_to_payload(const char *str, size_t len)
 	return i;
 }
 
+/*
+ * Return the offset of the first byte in the given data that might need
+ * special treatment when normalizing: backspace, escape or non-ASCII.
+ *
+ * If there is no such byte, return len.
+ */
+static size_t lsp_find_special(const char *ptr, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i bsp = _mm_set1_epi8('\b');
+	const __m128i esc = _mm_set1_epi8('\x1b');
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(ptr + i));
+		/* Non-ASCII bytes have their high bit set. */
+		int mask = _mm_movemask_epi8(v) |
+			_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, bsp),
+							_mm_cmpeq_epi8(v, esc)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(ptr + i));
+		uint8x16_t m = vorrq_u8(vcgeq_u8(v, vdupq_n_u8(0x80)),
+					vorrq_u8(vceqq_u8(v, vdupq_n_u8('\b')),
+						 vceqq_u8(v, vdupq_n_u8('\x1b'))));
+		/* Find the exact byte below. */
+		if (vmaxvq_u8(m))
+			break;
+	}
+#endif
+	for (; i < len; i++)
+		if (ptr[i] == '\b' || ptr[i] == '\x1b' || ptr[i] & 0x80)
+			break;
+
+	return i;
+}
+
 /*
  * Return length needed to skip leading backspace sequences in given data at ptr
  * of given length len.
@@ -435,6 +499,74 @@ static int lsp_sgr_extract_enns(const char *seq, long *enns, size_t size)
 	return i;
 }
 
+/*
+ * Get the slot of the SGR memo for a sequence of length len that follows the
+ * given attribute and color pair (FNV-1a).
+ */
+static struct lsp_sgr_memo_t *lsp_sgr_memo_slot(const char *seq, size_t len,
+						attr_t attr, short pair)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)seq[i];
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= attr;
+	hash *= 1099511628211ULL;
+	hash ^= (unsigned short)pair;
+	hash *= 1099511628211ULL;
+
+	return &lsp_sgr_memo[(hash ^ hash >> 32) % LSP_SGR_MEMO_SIZE];
+}
+
+/*
+ * Decode SGR sequence to attribute and/or color pair.
+ * Sequences we already decoded with the same attribute and pair are taken
+ * from the SGR memo.
+ *
+ * Return the length of the processed SGR sequence.
+ */
+static size_t lsp_decode_sgr(const char *seq, attr_t *attr, short *pair)
+{
+	struct lsp_sgr_memo_t *slot;
+	size_t sgr_len;
+
+	sgr_len = lsp_get_sgr_len(seq);
+
+	if (sgr_len == (size_t)-1 || sgr_len == 3 || sgr_len > LSP_SGR_MEMO_LEN)
+		return lsp_decode_sgr_uncached(seq, attr, pair);
+
+	slot = lsp_sgr_memo_slot(seq, sgr_len, *attr, *pair);
+
+	if (slot->len == sgr_len && slot->attr_in == *attr &&
+	    slot->pair_in == *pair && memcmp(slot->seq, seq, sgr_len) == 0) {
+		*attr = slot->attr;
+		*pair = slot->pair;
+		return sgr_len;
+	}
+
+	slot->len = 0;
+	slot->attr_in = *attr;
+	slot->pair_in = *pair;
+
+	if (lsp_decode_sgr_uncached(seq, attr, pair) == (size_t)-1)
+		return (size_t)-1;
+
+	/* Don't remember the failover when we ran out of color pairs. */
+	if (lsp_next_pair == COLOR_PAIRS)
+		return sgr_len;
+
+	memcpy(slot->seq, seq, sgr_len);
+	slot->len = sgr_len;
+	slot->attr = *attr;
+	slot->pair = *pair;
+
+	return sgr_len;
+}
+
 /*
  * Decode SGR sequence to attribute and/or color pair.
  *
@@ -442,7 +574,7 @@ static int lsp_sgr_extract_enns(const char *seq, long *enns, size_t size)
  *
  * Note: only a subset of SGR parameters is implemented!
  */
-static size_t lsp_decode_sgr(const char *seq, attr_t *attr, short *pair)
+static size_t lsp_decode_sgr_uncached(const char *seq, attr_t *attr, short *pair)
 {
 	long enns[32];		/* Array for n-values in SGR sequence. */
 	size_t enn_count;
@@ -695,12 +827,23 @@ static short lsp_get_color_pair(short fg, short bg)
 {
 	short pair_fg;
 	short pair_bg;
+	short *entry = NULL;
+
+	if (fg >= -1 && fg < LSP_PAIR_COLORS && bg >= -1 && bg < LSP_PAIR_COLORS) {
+		entry = &lsp_pairs[fg + 1][bg + 1];
+
+		if (*entry)
+			return *entry - 1;
+	}
 
 	for (short pair = 0; pair < lsp_next_pair; pair++) {
 		pair_content(pair, &pair_fg, &pair_bg);
 
-		if (pair_fg == fg && pair_bg == bg)
+		if (pair_fg == fg && pair_bg == bg) {
+			if (entry)
+				*entry = pair + 1;
 			return pair;
+		}
 	}
 
 	if (lsp_next_pair == COLOR_PAIRS) {
@@ -711,6 +854,9 @@ static short lsp_get_color_pair(short fg, short bg)
 	/* No matching pair yet -> create a new one. */
 	init_pair(lsp_next_pair, fg, bg);
 
+	if (entry)
+		*entry = lsp_next_pair + 1;
+
 	return lsp_next_pair++;
 }
 
@@ -756,73 +902,78 @@ static bool lsp_is_at_bol()
  */
 static void lsp_toc_ctor()
 {
-	if (cf->toc) {
+	if (cf->toc_entries) {
 		/* TOC already exists. */
-		if (cf->toc_first)
-			lsp_toc_rewind(cf->toc_first->pos);
+		if (cf->toc_first != LSP_TOC_NONE)
+			lsp_toc_rewind(LSP_TOC(cf->toc_first).pos);
 		else
 			lsp_toc_rewind(0);
 
 		return;
 	}
 
-	off_t pos_save = lsp_pos;
+	cf->toc_entries = lsp_malloc(LSP_TOC_INITIAL_SIZE * sizeof(struct toc_node_t));
+	cf->toc_size = LSP_TOC_INITIAL_SIZE;
+	cf->toc_count = 0;
+	cf->toc_seek = 0;
 
-	lsp_file_set_pos(0);
-
-	struct lsp_line_t *line = lsp_get_this_line();
+	/* All other entries get classified when they are needed. */
+	lsp_toc_rewind(0);
+}
 
-	while (line) {
-		/*
-		 * Level 0: all lines with other than space as the
-		 * first character.
-		 *
-		 * Also, ignore some additional characters to do something
-		 * sensible with C code: limit mainly to funcion headers.
-		 */
-		if (line->nlen > 0 &&
-		    line->normalized[0] != ' ' &&
-		    line->normalized[0] != '\t' &&
-		    line->normalized[0] != '{' &&
-		    line->normalized[0] != '}' &&
-		    line->normalized[0] != '\n')
-			lsp_file_toc_add(line, 0);
-
-		/* Level 1: all lines that start with three spaces. */
-		if (line->nlen > 3 &&
-		    LSP_STRN_EQ(line->normalized, "   ", 3) &&
-		    line->normalized[3] != ' ')
-			lsp_file_toc_add(line, 1);
-
-		/* Level 2: all lines starting with seven spaces and
-		   their following line with indentation of
-		   at least eleven spaces. */
-		if (line->nlen > 11 &&
-		    LSP_STRN_EQ(line->normalized, "       ", 7) &&
-		    line->normalized[7] != ' ') {
+/*
+ * Classify the next line that is not yet part of the TOC and add it to the
+ * TOC if it qualifies.
+ *
+ * Return false if there are no more lines.
+ */
+static bool lsp_toc_classify()
+{
+	struct lsp_line_t *line = lsp_get_line_at_pos(cf->toc_seek);
 
-			lsp_line_dtor(line);
-			line = lsp_get_this_line();
+	if (!line)
+		return false;
 
-			if (LSP_STRN_EQ(line->normalized, "           ", 11)) {
-				lsp_line_dtor(line);
-				lsp_file_set_prev_line();
-				line = lsp_file_get_prev_line();
-				lsp_file_toc_add(line, 2);
-			} else {
-				lsp_file_set_prev_line();
-			}
-		}
+	cf->toc_seek = line->pos + line->len;
 
-		lsp_line_dtor(line);
-		line = lsp_get_this_line();
+	/*
+	 * Level 0: all lines with other than space as the
+	 * first character.
+	 *
+	 * Also, ignore some additional characters to do something
+	 * sensible with C code: limit mainly to funcion headers.
+	 */
+	if (line->nlen > 0 &&
+	    line->normalized[0] != ' ' &&
+	    line->normalized[0] != '\t' &&
+	    line->normalized[0] != '{' &&
+	    line->normalized[0] != '}' &&
+	    line->normalized[0] != '\n')
+		lsp_file_toc_add(line, 0);
+
+	/* Level 1: all lines that start with three spaces. */
+	if (line->nlen > 3 &&
+	    LSP_STRN_EQ(line->normalized, "   ", 3) &&
+	    line->normalized[3] != ' ')
+		lsp_file_toc_add(line, 1);
+
+	/* Level 2: all lines starting with seven spaces and
+	   their following line with indentation of
+	   at least eleven spaces. */
+	if (line->nlen > 11 &&
+	    LSP_STRN_EQ(line->normalized, "       ", 7) &&
+	    line->normalized[7] != ' ') {
+		struct lsp_line_t *next = lsp_get_line_at_pos(cf->toc_seek);
+
+		if (next && LSP_STRN_EQ(next->normalized, "           ", 11))
+			lsp_file_toc_add(line, 2);
+
+		lsp_line_dtor(next);
 	}
 
 	lsp_line_dtor(line);
 
-	lsp_file_set_pos(pos_save);
-
-	lsp_toc_rewind(0);
+	return true;
 }
 
 /*
@@ -836,31 +987,121 @@ static void lsp_toc_ctor()
  */
 static void lsp_file_toc_add(const struct lsp_line_t *line, int level)
 {
-	struct toc_node_t *toc_new_p;
-
 	lsp_debug("%s: adding toc line level %d: \"%.*s\"",
 		  __func__, level, line->nlen, line->normalized);
 
-	if (!cf->toc) {
-		cf->toc = lsp_calloc(1, sizeof(struct toc_node_t));
-		cf->toc->pos = line->pos;
-		cf->toc->level = level;
-		return;
-	}
-
 	/* Ensure lines are added in strictly ascending order. */
-	if (line->pos <= cf->toc->pos)
+	if (cf->toc_count && line->pos <= LSP_TOC(cf->toc_count - 1).pos)
 		lsp_error("%s: TOC must be created top down (%ld after %ld).",
-			  __func__, line->pos, cf->toc->pos);
+			  __func__, line->pos, LSP_TOC(cf->toc_count - 1).pos);
+
+	/* Adjust size of TOC array. */
+	if (cf->toc_count == cf->toc_size) {
+		cf->toc_entries = lsp_realloc(cf->toc_entries,
+					      2 * cf->toc_size * sizeof(struct toc_node_t));
+		cf->toc_size *= 2;
+	}
+
+	LSP_TOC(cf->toc_count).pos = line->pos;
+	LSP_TOC(cf->toc_count).level = level;
+
+	/* The entry is visible at its own level and all higher ones. */
+	for (; level < LSP_TOC_LEVELS; level++) {
+		struct toc_level_t *view = &cf->toc_levels[level];
+
+		if (view->count == view->size) {
+			view->size = view->size ? 2 * view->size : LSP_TOC_INITIAL_SIZE;
+			view->entries = lsp_realloc(view->entries,
+						    view->size * sizeof(size_t));
+		}
+
+		view->entries[view->count++] = cf->toc_count;
+	}
+
+	cf->toc_count++;
+}
+
+/*
+ * Return the TOC entry following entry toc or LSP_TOC_NONE if there is none.
+ */
+static size_t lsp_toc_next(size_t toc)
+{
+	while (toc + 1 >= cf->toc_count)
+		if (!lsp_toc_classify())
+			return LSP_TOC_NONE;
+
+	return toc + 1;
+}
 
-	toc_new_p = lsp_calloc(1, sizeof(struct toc_node_t));
+/*
+ * Return the number of entries visible in the current level that come
+ * before TOC entry toc (binary search in the level's entries).
+ */
+static size_t lsp_toc_rank(size_t toc)
+{
+	struct toc_level_t *view = &cf->toc_levels[cf->current_toc_level];
+	size_t low = 0;
+	size_t high = view->count;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (view->entries[mid] < toc)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Return the TOC entry that is number rank of the entries visible in the
+ * current level or LSP_TOC_NONE if there is none.
+ */
+static size_t lsp_toc_visible(size_t rank)
+{
+	struct toc_level_t *view = &cf->toc_levels[cf->current_toc_level];
+
+	while (rank >= view->count)
+		if (!lsp_toc_classify())
+			return LSP_TOC_NONE;
+
+	return view->entries[rank];
+}
 
-	toc_new_p->pos = line->pos;
-	toc_new_p->level = level;
-	toc_new_p->prev = cf->toc;
+/*
+ * Return the first TOC entry at or after pos (binary search).
+ *
+ * Return LSP_TOC_NONE if it doesn't exist.
+ */
+static size_t lsp_toc_find(off_t pos)
+{
+	size_t low = 0;
+	size_t high;
+
+	/* All lines up to pos must be classified. */
+	while (cf->toc_seek <= pos)
+		if (!lsp_toc_classify())
+			break;
+
+	high = cf->toc_count;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
 
-	cf->toc->next = toc_new_p;
-	cf->toc = toc_new_p;
+		if (LSP_TOC(mid).pos < pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	/* Entries beyond pos might not yet be classified. */
+	while (low == cf->toc_count)
+		if (!lsp_toc_classify())
+			return LSP_TOC_NONE;
+
+	return low;
 }
 
 /*
@@ -868,24 +1109,23 @@ static void lsp_file_toc_add(const struct lsp_line_t *line, int level)
  */
 static void lsp_toc_dtor(struct file_t *file)
 {
-	struct toc_node_t *toc_p;
+	int level;
 
-	if (!file->toc)
-		return;
-
-	/* Rewind TOC to first entry. */
-	while (file->toc->prev)
-		file->toc = file->toc->prev;
+	free(file->toc_entries);
 
-	/* free() all TOC entries. */
-	while (file->toc) {
-		toc_p = file->toc->next;
-		free(file->toc);
-		file->toc = toc_p;
+	for (level = 0; level < LSP_TOC_LEVELS; level++) {
+		free(file->toc_levels[level].entries);
+		file->toc_levels[level].entries = NULL;
+		file->toc_levels[level].count = 0;
+		file->toc_levels[level].size = 0;
 	}
 
-	file->toc_first = NULL;
-	file->toc_last = NULL;
+	file->toc_entries = NULL;
+	file->toc_count = 0;
+	file->toc_size = 0;
+	file->toc = 0;
+	file->toc_first = LSP_TOC_NONE;
+	file->toc_last = LSP_TOC_NONE;
 }
 
 /*
@@ -897,35 +1137,26 @@ static void lsp_toc_dtor(struct file_t *file)
  */
 static void lsp_toc_rewind(off_t pos)
 {
-	if (!cf->toc)
+	if (!cf->toc_entries)
 		return;
 
 	if (pos == (off_t)-1) {
 		/* Go to end */
-		while (cf->toc->next)
-			cf->toc = cf->toc->next;
+		while (lsp_toc_classify())
+			;
+		if (cf->toc_count == 0)
+			return;
+		cf->toc = cf->toc_count - 1;
 		lsp_toc_bw(lsp_maxy - 2);
 	} else {
-		if (!lsp_pos_is_toc(pos))
-			lsp_error("%s: called with invalid TOC position %ld",
-				  __func__, pos);
-
-		/* Go to pos */
-		while (cf->toc->pos != pos) {
-			if (cf->toc->pos < pos) {
-				/* pos is right from current entry. */
-				if (cf->toc->next)
-					cf->toc = cf->toc->next;
-				else
-					break;
-			} else {
-				/* pos is left from current entry. */
-				if (cf->toc->prev)
-					cf->toc = cf->toc->prev;
-				else
-					break;
-			}
-		}
+		/* Go to pos, 0 is the start of the TOC even if not an entry. */
+		size_t toc = lsp_toc_find(pos);
+
+		if (toc == LSP_TOC_NONE)
+			return;
+
+		/* Until the next display, the page starts here. */
+		cf->toc = cf->toc_first = toc;
 	}
 }
 
@@ -934,23 +1165,17 @@ static void lsp_toc_rewind(off_t pos)
  */
 static off_t lsp_toc_get_offset_at_cursor()
 {
-	struct toc_node_t *current_toc = cf->toc;
-	size_t count = 0;
-	off_t ret_pos;
+	struct toc_level_t *view = &cf->toc_levels[cf->current_toc_level];
+	size_t toc = lsp_toc_visible(lsp_toc_rank(cf->toc_first) + cf->toc_cursor);
 
-	lsp_toc_rewind(cf->toc_first->pos);
-
-	while (count != cf->toc_cursor) {
-		cf->toc = cf->toc->next;
-		if (cf->toc->level <= cf->current_toc_level)
-			count++;
+	/* Cursor beyond last entry: use the last one. */
+	if (toc == LSP_TOC_NONE) {
+		if (view->count == 0)
+			return cf->page_first;
+		toc = view->entries[view->count - 1];
 	}
 
-	ret_pos = cf->toc->pos;
-
-	cf->toc = current_toc;
-
-	return ret_pos;
+	return LSP_TOC(toc).pos;
 }
 
 /*
@@ -958,11 +1183,11 @@ static off_t lsp_toc_get_offset_at_cursor()
  */
 static void lsp_toc_bw(size_t n)
 {
-	while (cf->toc->prev && n) {
-		cf->toc = cf->toc->prev;
-		if (cf->toc->level <= cf->current_toc_level)
-			n--;
-	}
+	size_t rank = lsp_toc_rank(cf->toc);
+	size_t toc = lsp_toc_visible(rank > n ? rank - n : 0);
+
+	if (toc != LSP_TOC_NONE && toc < cf->toc)
+		cf->toc = toc;
 
 	cf->toc_first = cf->toc;
 }
@@ -972,11 +1197,21 @@ static void lsp_toc_bw(size_t n)
  */
 static void lsp_toc_fw(size_t n)
 {
-	while (cf->toc->next && n) {
-		cf->toc = cf->toc->next;
-		if (cf->toc->level <= cf->current_toc_level)
-			n--;
-	}
+	size_t rank = lsp_toc_rank(cf->toc);
+	size_t toc;
+
+	/* The current entry doesn't count if it is not visible. */
+	if (n && lsp_toc_visible(rank) != cf->toc)
+		n--;
+
+	toc = lsp_toc_visible(rank + n);
+
+	/* Stop at the last visible entry. */
+	if (toc == LSP_TOC_NONE && rank + n > 0)
+		toc = lsp_toc_visible(cf->toc_levels[cf->current_toc_level].count - 1);
+
+	if (toc != LSP_TOC_NONE && toc > cf->toc)
+		cf->toc = toc;
 
 	cf->toc_first = cf->toc;
 }
@@ -1006,7 +1241,7 @@ static struct lsp_line_t *lsp_file_get_prev_line()
 	if (lsp_mode_is_toc()) {
 		if (lsp_toc_move_to_prev())
 			return NULL;
-		lsp_file_set_pos(cf->toc->pos);
+		lsp_file_set_pos(LSP_TOC(cf->toc).pos);
 	} else
 		lsp_file_set_prev_line();
 
@@ -1018,27 +1253,12 @@ static struct lsp_line_t *lsp_file_get_prev_line()
  */
 static void lsp_file_set_prev_line()
 {
-	int ch;
-
 	/* First go to beginning of this line */
 	lsp_goto_bol();
 
-	do {
-		lsp_file_ungetch();
-		ch = lsp_file_peek_bw();
-	} while (ch != '\n' && ch != -1);
-
-}
-
-/*
- * Peek forward to the next byte that getch() would give us.
- */
-static int lsp_file_peek_fw()
-{
-       int ch = lsp_file_getch();
-       if (ch != -1)
-               lsp_file_ungetch();
-       return ch;
+	/* The previous line contains the byte in front of it. */
+	if (lsp_pos > 0)
+		lsp_file_set_pos(lsp_lines_get(lsp_lines_find(lsp_pos - 1)));
 }
 
 /*
@@ -1103,30 +1323,90 @@ static struct lsp_line_t *lsp_line_ctor()
 {
 	struct lsp_line_t *line = lsp_malloc(sizeof(*line));
 
+	line->transient = false;
+	lsp_line_init(line);
+
+	return line;
+}
+
+/*
+ * Constructor for a line whose memory comes from lsp_lines_arena.
+ *
+ * Such lines must not be added to the line cache and are gone when the arena
+ * gets released to a mark taken before.
+ */
+static struct lsp_line_t *lsp_line_ctor_transient()
+{
+	struct lsp_line_t *line = lsp_arena_alloc(&lsp_lines_arena,
+						  sizeof(*line));
+
+	line->transient = true;
+	lsp_line_init(line);
+
+	return line;
+}
+
+/*
+ * Initialize a freshly allocated line structure.
+ */
+static void lsp_line_init(struct lsp_line_t *line)
+{
+	lsp_stats.lines++;
+
 	line->pos = line->len = line->nlen = 0;
 
 	line->raw = NULL;
 	line->current = NULL;
 	line->normalized = NULL;
+	line->nmap = NULL;
+	line->n_nmap = 0;
 
 	line->n_wlines = 1;
-	line->wlines = lsp_malloc(sizeof(line->wlines[0]));
+	line->wlines_size = 1;
+	line->wlines = lsp_line_realloc(line, NULL, 0, sizeof(line->wlines[0]));
 	line->wlines[0] = 0;	/* The beginning of a line also is the
 				 * beginning of a wline. */
+	line->wlines_cols = 0;
 
-	return line;
+	line->refs = 1;
+	line->lnum = 0;
+	line->hnext = line->lru_prev = line->lru_next = NULL;
+}
+
+/*
+ * Resize memory of the given line from old_len to len bytes -- on the heap or
+ * in lsp_lines_arena for transient lines.
+ */
+static void *lsp_line_realloc(struct lsp_line_t *line, void *ptr,
+			      size_t old_len, size_t len)
+{
+	if (line->transient)
+		return lsp_arena_realloc(&lsp_lines_arena, ptr, old_len, len);
+
+	return lsp_realloc(ptr, len);
 }
 
 /*
  * Destructor for line structure.
+ *
+ * Lines can be shared with the line cache, so we just drop one reference and
+ * free the line when the last one is gone.
  */
 static void lsp_line_dtor(struct lsp_line_t *line)
 {
 	if (!line)
 		return;
 
+	if (--line->refs > 0)
+		return;
+
+	/* The arena takes care of transient lines. */
+	if (line->transient)
+		return;
+
 	free(line->raw);
 	free(line->normalized);
+	free(line->nmap);
 	free(line->wlines);
 	free(line);
 }
@@ -1139,23 +1419,22 @@ static void lsp_line_dtor(struct lsp_line_t *line)
  */
 static int lsp_toc_move_to_prev()
 {
-	int ret_val = -1;
-	struct toc_node_t *old_toc = cf->toc;
+	size_t toc = lsp_toc_find(lsp_pos);
 
 	/* Move back in TOC to the entry with pos < current file pos and
-	   matching level.
-	   The worst that can happen is that we reach the first TOC entry. */
-	while (cf->toc &&
-	       (cf->toc->pos >= lsp_pos || cf->toc->level > cf->current_toc_level))
-		cf->toc = cf->toc->prev;
-
-	if (cf->toc)
-		ret_val = 0;
-	else
-		/* No entry found; restore old TOC position. */
-		cf->toc = old_toc;
+	   matching level. */
+	if (toc == LSP_TOC_NONE)
+		toc = cf->toc_count;
 
-	return ret_val;
+	size_t rank = lsp_toc_rank(toc);
+
+	/* No entry found; keep old TOC position. */
+	if (rank == 0)
+		return -1;
+
+	cf->toc = lsp_toc_visible(rank - 1);
+
+	return 0;
 }
 
 /*
@@ -1166,22 +1445,18 @@ static int lsp_toc_move_to_prev()
  */
 static int lsp_toc_move_to_next()
 {
-	struct toc_node_t *old_toc = cf->toc;
+	/* Start at the first entry with pos >= current file pos. */
+	size_t toc = lsp_toc_find(lsp_pos);
 
-	/* Move back in TOC to the entry with pos <= current file pos.
-	   The worst that can happen is that we reach the first TOC entry. */
-	while (cf->toc->pos > lsp_pos && cf->toc->prev)
-		cf->toc = cf->toc->prev;
+	/* Find the first one that is visible. */
+	if (toc != LSP_TOC_NONE)
+		toc = lsp_toc_visible(lsp_toc_rank(toc));
 
-	/* Move forward until we find a proper entry or the end. */
-	while (cf->toc->pos < lsp_pos || cf->toc->level > cf->current_toc_level)
-		if (!cf->toc->next) {
-			/* Restore old TOC entry and return failure. */
-			cf->toc = old_toc;
-			return -1;
-		} else {
-			cf->toc = cf->toc->next;
-		}
+	/* Keep old TOC entry and return failure. */
+	if (toc == LSP_TOC_NONE)
+		return -1;
+
+	cf->toc = toc;
 
 	return 0;
 }
@@ -1191,10 +1466,7 @@ static int lsp_toc_move_to_next()
  */
 static bool lsp_pos_is_toc(off_t pos)
 {
-	if (lsp_pos_to_toc(pos))
-		return true;
-
-	return false;
+	return lsp_pos_to_toc(pos) != LSP_TOC_NONE;
 }
 
 /*
@@ -1202,39 +1474,26 @@ static bool lsp_pos_is_toc(off_t pos)
  *
  * Return NULL if it doesn't exist.
  */
-static struct toc_node_t *lsp_pos_to_toc(off_t pos)
+static size_t lsp_pos_to_toc(off_t pos)
 {
-	struct toc_node_t *ret = NULL;
-
-	/* Safe current TOC entry and file position. */
-	struct toc_node_t *old_toc = cf->toc;
 	off_t old_pos = lsp_pos;
 
-	/* Position file to the given position. */
+	/* Go to the beginning of the line of the given position and try to
+	   find that position in the TOC entries. */
 	lsp_file_set_pos(pos);
-
-	/* Go to the beginning of the current line and try to find that position
-	   in the TOC entries. */
 	lsp_goto_bol();
+	pos = lsp_pos;
+	lsp_file_set_pos(old_pos);
 
-	/* Search for TOC entry starting at current position. */
-	if (cf->toc->pos > pos)
-		while (cf->toc->pos > lsp_pos && cf->toc->prev)
-			cf->toc = cf->toc->prev;
-	else
-		while (cf->toc->pos < lsp_pos && cf->toc->next)
-			cf->toc = cf->toc->next;
+	size_t toc = lsp_toc_find(pos);
 
 	/* Check if TOC entry matches correct position and current TOC level. */
-	if (cf->toc->pos == lsp_pos &&
-	    cf->toc->level <= cf->current_toc_level)
-		ret = cf->toc;
+	if (toc != LSP_TOC_NONE &&
+	    LSP_TOC(toc).pos == pos &&
+	    LSP_TOC(toc).level <= cf->current_toc_level)
+		return toc;
 
-	/* Restore original file position and TOC entry. */
-	lsp_file_set_pos(old_pos);
-	cf->toc = old_toc;
-
-	return ret;
+	return LSP_TOC_NONE;
 }
 
 /*
@@ -1253,21 +1512,37 @@ static struct lsp_line_t *lsp_get_this_line() {
 }
 
 /*
- * If not already there or if the existing one has a different width:
+ * Return the column the cursor would be in after writing the given character
+ * at the given column of a window line.
  *
- * Create a hidden window that we use to fill its top line
- * to come to know where in a "physical" line lines in the window start.
+ * This mimics what wadd_wch() does with the characters we output: control
+ * characters are shown as ^X, wide characters take two columns and other
+ * non-printable ones one.  A result of lsp_maxx or above means the window
+ * line is full.
  */
-static void lsp_init_hwin()
+static int lsp_wc_column(wchar_t wc, int col)
 {
-	if (lsp_hwin == NULL || lsp_hwin_cols != lsp_maxx) {
-		if (lsp_hwin != NULL)
-			delwin(lsp_hwin);
-		lsp_hwin = newwin(2, lsp_maxx, 0, 0);
-		lsp_hwin_cols = lsp_maxx;
+	int width;
+
+	switch (wc) {
+	case L'\b':
+		return col > 0 ? col - 1 : 0;
+	case L'\r':
+		return 0;
+	case L'\n':
+		return lsp_maxx;
 	}
 
-	wmove(lsp_hwin, 0, 0);
+	/* Control characters (and invalid bytes) are shown as ^X. */
+	if (wc == (wchar_t)WEOF || (wc >= 0 && wc < 0x20) || wc == 0x7f)
+		return col + 2;
+
+	width = wcwidth(wc);
+
+	if (width < 0)
+		width = 1;
+
+	return col + width;
 }
 
 /*
@@ -1280,14 +1555,11 @@ static void lsp_init_hwin()
 static void lsp_line_add_wlines(struct lsp_line_t *line)
 {
 	wchar_t ch[2] = { L'\0', L'\0' };
-	/* Complex char for cursesw routines. */
-	cchar_t cchar_ch[2];
-
-	int row = 0;
-	int col = 0;
 
 	size_t i = 0;		/* current byte in the line */
+	size_t start;		/* first byte of the current character */
 	int current_col = 0;    /* current column in one window line */
+	int col;
 	size_t wli = 0;		/* wline index */
 	char new_wline = 0;	/* to identify parts containing just a newline */
 
@@ -1297,14 +1569,25 @@ static void lsp_line_add_wlines(struct lsp_line_t *line)
 	size_t tab_count = 0;
 	size_t cr_count = 0;
 
-	lsp_init_hwin();	/* Initialize hidden window. */
+	/* Lines can be shared, compute window lines only once per width. */
+	if (line->wlines_cols == lsp_maxx)
+		return;
+
+	line->wlines_cols = lsp_maxx;
+	line->n_wlines = 1;
 
 	while (i < line->len) {
 		if (current_col >= lsp_maxx) {
 			/* Add another window line. */
 			wli += 1;
 			line->n_wlines += 1;
-			line->wlines = lsp_realloc(line->wlines, line->n_wlines * sizeof(line->wlines[0]));
+			if (line->n_wlines > line->wlines_size) {
+				size_t old_len = line->wlines_size * sizeof(line->wlines[0]);
+
+				line->wlines_size *= 2;
+				line->wlines = lsp_line_realloc(line, line->wlines, old_len,
+								line->wlines_size * sizeof(line->wlines[0]));
+			}
 			line->wlines[wli] = i;
 			current_col = 0;
 
@@ -1324,25 +1607,40 @@ static void lsp_line_add_wlines(struct lsp_line_t *line)
 
 		new_wline = 0;
 
-		/* Expand TABs by inserting spaces into the line. */
-		if (line->raw[i] == '\t') {
-			/* -1, because the \t itself also counts. */
-			tab_count = lsp_expand_tab(current_col) - 1;
-			line->raw[i] = ' ';
+		/* Fast path: plain ASCII takes one column per byte. */
+		if (!tab_count && !cr_count) {
+			start = i;
+
+			while (current_col < lsp_maxx && i + 1 < line->len &&
+			       line->raw[i] >= 0x20 && line->raw[i] < 0x7f &&
+			       line->raw[i + 1] != '\b') {
+				i++;
+				current_col++;
+			}
+
+			if (i != start)
+				continue;
 		}
 
+		/* Expand TABs by inserting spaces into the line. */
+		if (!tab_count && !cr_count && line->raw[i] == '\t')
+			tab_count = lsp_expand_tab(current_col);
+
 		/* Replace carriage return with ^M. */
-		if (line->raw[i] == '\r' && !lsp_keep_cr) {
+		if (!tab_count && !cr_count &&
+		    line->raw[i] == '\r' && !lsp_keep_cr)
 			cr_count = 2;
 
-		}
+		start = i;
 
 		if (tab_count) {
 			ch[0] = ' ';
-			tab_count--;
+			/* The \t itself is done with the last space. */
+			if (--tab_count == 0)
+				i++;
 		} else if (cr_count) {
 			/* For CR we insert first a '^' and second a 'M'. */
-			ch[0] = line->raw[i] = cr_count == 2 ? '^' : 'M';
+			ch[0] = cr_count == 2 ? '^' : 'M';
 			/* Only one char caused this replacement. */
 			if (cr_count-- == 1)
 				i++;
@@ -1351,23 +1649,19 @@ static void lsp_line_add_wlines(struct lsp_line_t *line)
 			i += lsp_mbtowc(ch, line->raw + i, line->len - i);
 
 		/*
-		 * Output the char to hidden window and after that check the new
-		 * column.  If it exceeds the window width the line was
-		 * filled and the next character starts a new window line.
+		 * Check the column after this character.  If it reaches the
+		 * window width the line was filled and the next character
+		 * starts a new window line.  A wide character that doesn't
+		 * fit anymore starts the next window line itself.
 		 */
-		setcchar(cchar_ch, ch, A_NORMAL, LSP_DEFAULT_PAIR, NULL);
-		wadd_wch(lsp_hwin, cchar_ch);
-		getyx(lsp_hwin, row, col);
-
-		current_col = col;
-
-		if (col >= lsp_maxx || row > 0) {
-			assert(col <= 1);
-			col = 0;
-			row = 0;
-			wmove(lsp_hwin, row, col);
-			current_col = lsp_maxx;
+		col = lsp_wc_column(ch[0], current_col);
+
+		if (col > lsp_maxx && current_col > 0 && wcwidth(ch[0]) > 1) {
+			i = start;
+			col = lsp_maxx;
 		}
+
+		current_col = col < lsp_maxx ? col : lsp_maxx;
 	}
 
 	return;
@@ -1381,102 +1675,315 @@ static int lsp_expand_tab(size_t x_pos)
 	return lsp_tab_width - (x_pos % lsp_tab_width);
 }
 
+/*
+ * Return index of the line that contains the given position.
+ *
+ * Only positions of data already read are meaningful.
+ */
+static size_t lsp_lines_find(off_t pos)
+{
+	size_t lo = 0;
+	size_t hi = (cf->lines_count + LSP_LINES_CHUNK - 1) / LSP_LINES_CHUNK;
+
+	if (cf->lines_count == 0)
+		return 0;
+
+	/* Find the last chunk starting at or before pos. */
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cf->lines[mid].first <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	struct lsp_lines_chunk_t *chunk = &cf->lines[lo];
+	size_t line = lo * LSP_LINES_CHUNK;
+	size_t end = line + LSP_LINES_CHUNK;
+	const unsigned char *p = chunk->deltas;
+	off_t start = chunk->first;
+
+	if (end > cf->lines_count)
+		end = cf->lines_count;
+
+	if (chunk->last <= pos)
+		return end - 1;
+
+	/* Then the last line inside of it. */
+	while (line + 1 < end) {
+		off_t next = start + lsp_lines_decode(&p);
+
+		if (next > pos)
+			break;
+
+		start = next;
+		line++;
+	}
+
+	return line;
+}
+
+/*
+ * Unlink line from the LRU list of the current file's line cache.
+ */
+static void lsp_line_cache_unlink(struct lsp_line_t *line)
+{
+	if (line->lru_prev)
+		line->lru_prev->lru_next = line->lru_next;
+	else
+		cf->lcache_mru = line->lru_next;
+
+	if (line->lru_next)
+		line->lru_next->lru_prev = line->lru_prev;
+	else
+		cf->lcache_lru = line->lru_prev;
+
+	line->lru_prev = line->lru_next = NULL;
+}
+
+/*
+ * Put line at the most recently used end of the LRU list.
+ */
+static void lsp_line_cache_push(struct lsp_line_t *line)
+{
+	line->lru_prev = NULL;
+	line->lru_next = cf->lcache_mru;
+
+	if (cf->lcache_mru)
+		cf->lcache_mru->lru_prev = line;
+	else
+		cf->lcache_lru = line;
+
+	cf->lcache_mru = line;
+}
+
+/*
+ * Look up line number lnum starting at pos in the line cache of the current
+ * file.
+ *
+ * Return a new reference to the cached line or NULL.
+ */
+static struct lsp_line_t *lsp_line_cache_get(size_t lnum, off_t pos)
+{
+	struct lsp_line_t *line;
+
+	if (cf->lcache == NULL)
+		return NULL;
+
+	for (line = cf->lcache[lnum % LSP_LINE_CACHE_BUCKETS];
+	     line != NULL; line = line->hnext)
+		if (line->lnum == lnum && line->pos == pos)
+			break;
+
+	if (line == NULL)
+		return NULL;
+
+	/* Move to the front of the LRU list. */
+	if (cf->lcache_mru != line) {
+		lsp_line_cache_unlink(line);
+		lsp_line_cache_push(line);
+	}
+
+	line->refs++;
+	line->current = line->raw;
+
+	return line;
+}
+
+/*
+ * Remove the least recently used line from the cache of the current file.
+ */
+static void lsp_line_cache_evict()
+{
+	struct lsp_line_t *line = cf->lcache_lru;
+	struct lsp_line_t **pp = &cf->lcache[line->lnum % LSP_LINE_CACHE_BUCKETS];
+
+	while (*pp != line)
+		pp = &(*pp)->hnext;
+	*pp = line->hnext;
+
+	lsp_line_cache_unlink(line);
+	cf->lcache_count--;
+
+	lsp_line_dtor(line);
+}
+
+/*
+ * Put the given line with line number lnum into the cache of the current file.
+ *
+ * The cache takes its own reference.
+ */
+static void lsp_line_cache_add(struct lsp_line_t *line, size_t lnum)
+{
+	size_t bucket = lnum % LSP_LINE_CACHE_BUCKETS;
+
+	if (cf->lcache == NULL)
+		cf->lcache = lsp_calloc(LSP_LINE_CACHE_BUCKETS, sizeof(line));
+
+	if (cf->lcache_count == LSP_LINE_CACHE_SIZE)
+		lsp_line_cache_evict();
+
+	line->lnum = lnum;
+	line->refs++;
+	line->hnext = cf->lcache[bucket];
+	cf->lcache[bucket] = line;
+	lsp_line_cache_push(line);
+	cf->lcache_count++;
+}
+
+/*
+ * Drop all lines from the cache of the given file.
+ */
+static void lsp_line_cache_dtor(struct file_t *file)
+{
+	struct lsp_line_t *line = file->lcache_mru;
+
+	while (line) {
+		struct lsp_line_t *next = line->lru_next;
+
+		line->hnext = line->lru_prev = line->lru_next = NULL;
+		lsp_line_dtor(line);
+		line = next;
+	}
+
+	free(file->lcache);
+	file->lcache = NULL;
+	file->lcache_mru = file->lcache_lru = NULL;
+	file->lcache_count = 0;
+}
+
 /*
  * Return the line from the current position inside the file.
  * i.e. the current position could be different from the beginning of a line.
  */
 static struct lsp_line_t *lsp_get_line_from_here()
 {
-	off_t pos = 0;
-	size_t size = 0;
+	size_t len = 0;
 	char *str = NULL;
 	struct lsp_line_t *line = NULL;
+	size_t lnum;
 
 	/* Return NULL if we reached EOF. */
 	if (cf->size != LSP_FSIZE_UNKNOWN &&
 	    (lsp_pos == (off_t)-1 || lsp_pos == cf->size))
 		return NULL;
 
-	pos = lsp_pos;
+	/* Complete lines are cached by their line number. */
+	lnum = lsp_lines_find(lsp_pos);
+
+	if (cf->lines_count && lsp_lines_get(lnum) == lsp_pos) {
+		line = lsp_line_cache_get(lnum, lsp_pos);
+
+		if (line) {
+			lsp_file_set_pos(line->pos + line->len);
+
+			if (cf->size == LSP_FSIZE_UNKNOWN && lsp_pos == cf->seek)
+				lsp_file_ingest(0);
+
+			return line;
+		}
+	} else
+		lnum = (size_t)-1;
 
 	/* Don't return a line for a trailing newline in the file. */
-	int ch = lsp_file_getch();
-	if (ch == -1)
+	if (lsp_file_getch() == -1)
 		return NULL;
 
 	line = lsp_line_ctor();
-	line->pos = pos;
+	line->pos = lsp_pos - 1;
 
-	pos = 0;
-	size = 128;
-	str = lsp_malloc(size);
+	/*
+	 * Copy the line span by span: lsp_file_getch() makes sure the data
+	 * is available and aligns the buffer to the byte it just served,
+	 * we then take everything up to the next newline or the end of that
+	 * buffer in one go.
+	 */
+	do {
+		const char *start = (char *)cf->data->buffer +
+			(lsp_pos - 1 - cf->data->seek);
+		off_t end = cf->data->seek + cf->blksize;
+		size_t span;
+		char *nl;
 
-	while (ch != -1) {
-		if (pos + 1 >= size) {
-			str = lsp_realloc(str, size * 2);
-			size *= 2;
-		}
+		if (end > cf->seek)
+			end = cf->seek;
 
-		str[pos++] = ch;
+		span = end - (lsp_pos - 1);
+		nl = memchr(start, '\n', span);
 
-		if (ch == '\n')
-			break;
+		if (nl != NULL)
+			span = nl - start + 1;
 
-		ch = lsp_file_getch();
-	}
+		str = lsp_realloc(str, len + span + 1);
+		memcpy(str + len, start, span);
+		len += span;
+		cf->getch_pos += span - 1;
 
-	/* Reallocate to correct size */
-	str = lsp_realloc(str, pos + 1);
+		if (nl != NULL)
+			break;
+	} while (lsp_file_getch() != -1);
 
-	line->len = pos;
+	line->len = len;
 	line->raw = str;
 	line->current = line->raw;
-	line->normalized = lsp_normalize(str, pos, &line->nlen);
+	line->normalized = lsp_normalize(str, len, &line->nlen,
+					 &line->nmap, &line->n_nmap, NULL);
+
+	if (lnum != (size_t)-1 && str[len - 1] == '\n')
+		lsp_line_cache_add(line, lnum);
 
 	/*
-	 * Finally, if the file size is still unknown, peek forward one byte to
-	 * probably trigger EOF if this was the last line in the file.
+	 * Finally, if the file size is still unknown and this line ends our
+	 * data, look for more input to probably trigger EOF if this was the
+	 * last line in the file.  We don't wait for slow input here.
 	 *
 	 * This fixes problems when we display files whose last lines happen to
 	 * be the last one on a page.
 	 */
-	if (cf->size == LSP_FSIZE_UNKNOWN)
-		lsp_file_peek_fw();
+	if (cf->size == LSP_FSIZE_UNKNOWN && lsp_pos == cf->seek)
+		lsp_file_ingest(0);
 
 	return line;
 }
 
 /*
- * Do a pseudo-normalization until the normalized data would have
- * the given length.
+ * Translate the length of normalized data of the given line into the length
+ * of raw data that was processed to produce it.
  *
- * Return the length, to which the raw data raw of lenth raw_len was
- * processed to achieve this.
+ * The map that lsp_normalize() recorded for the line tells us where both
+ * diverge; inbetween its entries both advance byte by byte.
  */
-static size_t lsp_normalize_count(const char *raw, size_t raw_len, size_t length)
+static size_t lsp_line_n2raw(const struct lsp_line_t *line, size_t length)
 {
-	size_t nlen;
-	uint ch_len;
-	size_t i;
+	size_t lo = 0;
+	size_t hi = line->n_nmap;
+	size_t n;
 
 	if (!length)
 		return 0;
 
-	if (length > raw_len)
-		lsp_error("%s: length %ld > raw_len %ld raw: \"%.*s\"",
-			  __func__, length, raw_len, raw_len, raw);
+	if (length > line->nlen)
+		lsp_error("%s: length %ld > nlen %ld raw: \"%.*s\"",
+			  __func__, length, line->nlen, line->len, line->raw);
 
-	/* Process the data ignoring <char>\b sequences and SGR sequences. */
-	for (i = 0, nlen = 0; nlen < length; i += ch_len) {
-		/* Ignore possible control sequences */
-		i += lsp_skip_to_payload(raw + i, raw_len - i);
+	/* We want the raw offset right after the last normalized byte. */
+	n = length - 1;
 
-		/* Get length of possible multibyte char. */
-		ch_len = lsp_mblen(raw + i, raw_len - i);
-		nlen += ch_len;
+	/* Find the last map entry at or before n. */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (line->nmap[mid].noff <= n)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	return i;
+	if (lo == 0)
+		return n + 1;
+
+	return line->nmap[lo - 1].roff + (n - line->nmap[lo - 1].noff) + 1;
 }
 
 /*
@@ -1491,28 +1998,92 @@ static size_t lsp_normalize_count(const char *raw, size_t raw_len, size_t length
  *
  * SGR sequences are also recognized and ignored.
  *
+ * If map is not NULL, we also store there where the ignored parts are: each
+ * entry is the offset of a payload character in normalized and in raw data
+ * that follows ignored data.  The number of entries goes to map_len.
+ *
+ * If arena is not NULL, the memory of normalized and map comes from it.
+ *
  * Note: this function returns data that is _not_ null-terminated, i.e. no
  *       string.  This would be meaningless, because the normalized data itself
  *       can contain null-characters.
  */
-static char *lsp_normalize(const char *raw, size_t raw_len, size_t *n_length)
+static char *lsp_normalize(const char *raw, size_t raw_len, size_t *n_length,
+			   struct lsp_nmap_t **map, size_t *map_len,
+			   struct lsp_arena_t **arena)
 {
 	char *normalized;
 	uint ch_len;
 	size_t nlen;
 	size_t i;
+	size_t map_size = 0;
+
+	lsp_stats.normalized++;
+	lsp_stats.normalized_bytes += raw_len;
+
+	if (map != NULL) {
+		*map = NULL;
+		*map_len = 0;
+	}
+
+	/* Without backspaces and escape sequences there is nothing to ignore. */
+	if (memchr(raw, '\b', raw_len) == NULL &&
+	    memchr(raw, '\x1b', raw_len) == NULL) {
+		normalized = arena ? lsp_arena_alloc(arena, raw_len) :
+			lsp_malloc(raw_len);
+		memcpy(normalized, raw, raw_len);
+
+		if (n_length != NULL)
+			*n_length = raw_len;
+		return normalized;
+	}
 
 	/* We should be allocating too much memory, because the worst we do is
 	   to ignore characters from the raw data.
 	   We correct the allocated size below. */
-	normalized = lsp_malloc(raw_len);
+	normalized = arena ? lsp_arena_alloc(arena, raw_len) :
+		lsp_malloc(raw_len);
 
 	/* Copy the data ignoring c\b sequences */
 	for (i = 0, nlen = 0; i < raw_len; i += ch_len) {
+		/* Block-copy plain ASCII up to the next byte that needs
+		   attention -- or the char in front of a backspace. */
+		size_t run = lsp_find_special(raw + i, raw_len - i);
+
+		if (i + run < raw_len && raw[i + run] == '\b' && run > 0)
+			run--;
+
+		memcpy(normalized + nlen, raw + i, run);
+		nlen += run;
+		i += run;
+
+		if (i == raw_len)
+			break;
+
 		assert(nlen < raw_len);
 
 		/* Ignore possible control sequences */
-		i += lsp_skip_to_payload(raw + i, raw_len - i);
+		size_t skip = lsp_skip_to_payload(raw + i, raw_len - i);
+
+		i += skip;
+
+		/* Record where raw and normalized data diverge. */
+		if (skip && map != NULL) {
+			if (*map_len == map_size) {
+				size_t old_size = map_size * sizeof(**map);
+
+				map_size = map_size ? map_size * 2 : 16;
+
+				if (arena)
+					*map = lsp_arena_realloc(arena, *map, old_size,
+								 map_size * sizeof(**map));
+				else
+					*map = lsp_realloc(*map, map_size * sizeof(**map));
+			}
+			(*map)[*map_len].noff = nlen;
+			(*map)[*map_len].roff = i;
+			(*map_len)++;
+		}
 
 		/* Get length of possible multibyte char. */
 		ch_len = lsp_mblen(raw + i, raw_len - i);
@@ -1523,7 +2094,7 @@ static char *lsp_normalize(const char *raw, size_t raw_len, size_t *n_length)
 	}
 
 	/* Adjust the allocated memory to the correct size */
-	if (raw_len > nlen)
+	if (raw_len > nlen && arena == NULL)
 		normalized = lsp_realloc(normalized, nlen);
 
 	/* ...or error out if our heuristics failed. */
@@ -1540,17 +2111,19 @@ static char *lsp_normalize(const char *raw, size_t raw_len, size_t *n_length)
  * Do a normalization and return the result as a string.
  */
 static char *lsp_normalize2str(const char *raw, size_t raw_len) {
+	struct lsp_arena_mark_t mark = lsp_arena_mark(&lsp_lines_arena);
 	size_t norm_len;
 	char *norm;
 	char *str;
 
 	/* Normalize the data up to the given length. */
-	norm = lsp_normalize(raw, raw_len, &norm_len);
+	norm = lsp_normalize(raw, raw_len, &norm_len, NULL, NULL,
+			     &lsp_lines_arena);
 
 	/* Tranform it to a string. */
 	str = lsp_mdup2str(norm, norm_len);
 
-	free(norm);
+	lsp_arena_release(&lsp_lines_arena, mark);
 	return str;
 }
 
@@ -1571,6 +2144,45 @@ static void lsp_file_close()
 		close(cf->fd);
 		cf->fd = -1;
 	}
+
+	lsp_file_reap(cf);
+}
+
+/*
+ * Wait for the child process that fed the input of a file.
+ *
+ * Its input fd has been closed already, so the child either finished or
+ * sees a hangup.
+ */
+static void lsp_file_reap(struct file_t *file)
+{
+	pid_t pid = file->pid;
+
+	if (pid <= 0)
+		return;
+
+	file->pid = 0;
+
+	while (1) {
+		int wstatus;
+
+		pid_t ret_pid = waitpid(pid, &wstatus, 0);
+
+		if (ret_pid == -1)
+			lsp_error("waitpid(%jd): %s", (intmax_t)pid, strerror(errno));
+
+		if (WIFEXITED(wstatus)) {
+			lsp_debug("%s: child %jd exited: %d",
+				  __func__, (intmax_t)pid, WEXITSTATUS(wstatus));
+			break;
+		} else if (WIFSIGNALED(wstatus)) {
+			lsp_debug("%s: child %jd terminated by signal: %d (%s)",
+				  __func__, (intmax_t)pid, WTERMSIG(wstatus), strsignal(WTERMSIG(wstatus)));
+			break;
+		}
+		lsp_debug("%s: %jd: still waiting for child %jd to exit...",
+			  __func__, (intmax_t)ret_pid, (intmax_t)pid);
+	}
 }
 
 /*
@@ -1626,6 +2238,7 @@ static ssize_t lsp_file_add_line(const char *line)
 		cf->data->prev = cf->data->next = cf->data;
 		cf->data->buffer = NULL;
 		cf->data->seek = 0;
+		lsp_file_blocks_add(cf->data);
 	}
 
 	if (cf->size == LSP_FSIZE_UNKNOWN)
@@ -1656,14 +2269,32 @@ static size_t lsp_buffer_free_size()
 	 * Also, the calculation below only works with the correct (last) data
 	 * buffer at hand.
 	 */
-	while (cf->data->seek < cf->data->next->seek) {
-		cf->data = cf->data->next;
+	if (cf->data != cf->blocks[cf->blocks_count - 1]) {
+		cf->data = cf->blocks[cf->blocks_count - 1];
 		cf->unaligned = 1;
 	}
 
 	return (cf->blksize - (cf->seek - cf->data->seek));
 }
 
+/*
+ * Record a new data buffer of the current file in its index of buffers.
+ *
+ * Buffers are created in ascending order of their seek, so the n-th entry
+ * holds the data starting at n * blksize.
+ */
+static void lsp_file_blocks_add(struct data_t *data)
+{
+	if (cf->blocks_count == cf->blocks_size) {
+		cf->blocks_size = cf->blocks_size ?
+			cf->blocks_size * 2 : LSP_BLOCKS_INITIAL_SIZE;
+		cf->blocks = lsp_realloc(cf->blocks,
+					 cf->blocks_size * sizeof(data));
+	}
+
+	cf->blocks[cf->blocks_count++] = data;
+}
+
 /*
  * Constructer for new data buffer for current file.
  */
@@ -1671,6 +2302,8 @@ static void lsp_file_data_ctor(size_t size_to_read)
 {
 	struct data_t *new_data = lsp_malloc(sizeof(struct data_t));
 
+	lsp_stats.blocks++;
+
 	new_data->seek = cf->seek; /* Position this data block was read from */
 	new_data->buffer = lsp_malloc(size_to_read);
 
@@ -1686,1619 +2319,4028 @@ static void lsp_file_data_ctor(size_t size_to_read)
 		cf->data = new_data;
 		cf->unaligned = 1;
 	}
+
+	lsp_file_blocks_add(new_data);
 }
 
 /*
- * Perform an actual read(2) with error handling.
+ * Duplicate input to the file given with -o.
+ *
+ * The data goes to the writer process through a non-blocking pipe.  What
+ * doesn't fit into the pipe right now we keep and hand over later.  Only if
+ * that would exceed LSP_OFILE_PENDING_MAX we wait for the writer.
  */
-static ssize_t lsp_file_do_read(unsigned char *buffer_p, size_t size_to_read)
+static void lsp_ofile_write(const unsigned char *buffer_p, size_t len)
 {
-	ssize_t nread = read(cf->fd, buffer_p, size_to_read);
+	if (lsp_ofile <= 0)
+		return;
 
-	if (nread == -1) {
-		lsp_debug("%s: input file %s: %s",
-			  __func__, cf->name, strerror(errno));
+	/* Keep the order: older data first. */
+	lsp_ofile_flush(0);
 
-		/* When we read from ptmxfd given by forktty()
-		   we get EIO at the end of data.
-		   So, simulate normal EOF by setting nread = 0. */
-		if (errno == EIO)
-			nread = 0;
-		return nread;
-	}
+	if (lsp_ofile_pending.len == 0) {
+		size_t n = lsp_ofile_write_some(buffer_p, len);
 
-	/* Duplicate input to file given with -o */
-	if (lsp_ofile > 0) {
-		ssize_t n = 0;
+		buffer_p += n;
+		len -= n;
+	}
 
-		while (n < nread) {
-			ssize_t i;
-			i = write(lsp_ofile, buffer_p + n, nread - n);
+	while (len && lsp_ofile_pending.len + len > LSP_OFILE_PENDING_MAX) {
+		lsp_ofile_wait();
 
-			if (i == -1)
-				lsp_error("%s: write(2): %s", __func__, strerror(errno));
+		if (lsp_ofile_pending.len == 0) {
+			size_t n = lsp_ofile_write_some(buffer_p, len);
 
-			n += i;
+			buffer_p += n;
+			len -= n;
 		}
 	}
 
-	if (nread < size_to_read)
-		lsp_debug("%s, pos %ld: read %ld bytes instead of %ld.",
-			  __func__, cf->seek, nread, size_to_read);
+	if (len == 0)
+		return;
 
-	return nread;
+	/* Drop what was handed over already before we append. */
+	if (lsp_ofile_pending.done) {
+		memmove(lsp_ofile_pending.data,
+			lsp_ofile_pending.data + lsp_ofile_pending.done,
+			lsp_ofile_pending.len);
+		lsp_ofile_pending.done = 0;
+	}
+
+	if (lsp_ofile_pending.size < lsp_ofile_pending.len + len) {
+		while (lsp_ofile_pending.size < lsp_ofile_pending.len + len)
+			lsp_ofile_pending.size = lsp_ofile_pending.size ?
+				2 * lsp_ofile_pending.size : LSP_OFILE_PIPE_SIZE;
+
+		lsp_ofile_pending.data = lsp_realloc(lsp_ofile_pending.data,
+						     lsp_ofile_pending.size);
+	}
+
+	memcpy(lsp_ofile_pending.data + lsp_ofile_pending.len, buffer_p, len);
+	lsp_ofile_pending.len += len;
 }
 
 /*
- * Add a block of data to the current file
+ * Write as much of the given data to the pipe to the writer process as it
+ * takes without blocking.
+ *
+ * Return the number of bytes written.
  */
-static ssize_t lsp_file_read_block(size_t size_to_read)
+static size_t lsp_ofile_write_some(const unsigned char *buffer_p, size_t len)
 {
-	if (lsp_buffer_free_size()) {
-		/* Current buffer is not filled up.
-		   Use it to read more data into memory. */
-		if (size_to_read > lsp_buffer_free_size())
-			size_to_read = lsp_buffer_free_size();
-	} else {
-		lsp_file_data_ctor(size_to_read);
-	}
+	size_t n = 0;
 
-	/* Fill the buffer */
-	ssize_t nread = 0;
-	unsigned char *buffer_p = cf->data->buffer + (cf->blksize - lsp_buffer_free_size());
+	while (n < len) {
+		ssize_t i = write(lsp_ofile, buffer_p + n, len - n);
 
-	/*
-	 * Check if we need to consume a byte that was read from a preprocessor
-	 * pipe.  Store that byte as the first one and emulate that we already
-	 * read one byte.
-	 */
-	if (cf->seek == 0 && cf->flags & LSP_PRE_READ) {
-		buffer_p[0] = (char)cf->pre_read;
-		buffer_p += 1;
-		size_to_read -= 1;
-		nread = 1;
+		if (i == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			lsp_error("%s: write(2): %s", __func__, strerror(errno));
+		}
+
+		n += i;
 	}
 
-	ssize_t ret = lsp_file_do_read(buffer_p, size_to_read);
+	return n;
+}
 
-	if (ret == -1)
-		return -1;
+/*
+ * Hand data for the file given with -o that is still pending over to the
+ * writer process.
+ *
+ * We wait up to timeout milliseconds (see poll(2)) for the pipe to take more
+ * data but stop as soon as a key was pressed.
+ */
+static void lsp_ofile_flush(int timeout)
+{
+	struct pollfd fds[2];
 
-	nread += ret;
+	if (lsp_ofile_pending.len == 0)
+		return;
 
-	cf->seek += nread;
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = lsp_ofile;
+	fds[1].events = POLLOUT;
 
-	if (nread == 0) {
-		lsp_debug("%s: EOF detected for %s at %ld", __func__, cf->name, cf->seek);
-
-		 /* We notice if a file is of unknown size and we read
-		    all data from it. */
-		if (cf->size == LSP_FSIZE_UNKNOWN) {
-			cf->size = cf->seek;
-
-			/* Empty files have 0 lines. */
-			if (cf->size == 0)
-				cf->lines_count = 0;
-		}
-		lsp_file_close();
-		return 0;
+	if (poll(fds, 2, timeout) == -1) {
+		if (errno == EINTR)
+			return;
+		lsp_error("%s: poll(2): %s", __func__, strerror(errno));
 	}
 
-	size_t read_offset = buffer_p - cf->data->buffer;
-
-	/* When this is a new buffer and if a previous buffer exists and ends
-	   with newline this buffer is the start of a new line. */
-	if (read_offset == 0 && cf->seek - nread != 0) {
-		if (cf->data->prev->buffer[cf->blksize - 1] == '\n')
-			lsp_lines_add(cf->data->seek);
-	}
+	if (fds[1].revents == 0)
+		return;
 
-	if (read_offset > 0) {
-		if (buffer_p[-1] == '\n')
-			lsp_lines_add(cf->data->seek + read_offset);
-	}
+	size_t n = lsp_ofile_write_some(lsp_ofile_pending.data +
+					lsp_ofile_pending.done,
+					lsp_ofile_pending.len);
 
-	/* Inspect all of the read data to keep record of lines */
-	for (int i = 0; (i + 1) < nread; i++)
-		if (buffer_p[i] == '\n')
-			/* We record the beginning of a line,
-			   not the end => +1 */
-			lsp_lines_add(cf->data->seek + read_offset + i + 1);
+	lsp_ofile_pending.done += n;
+	lsp_ofile_pending.len -= n;
 
-	return nread;
+	if (lsp_ofile_pending.len == 0)
+		lsp_ofile_pending.done = 0;
 }
 
 /*
- * For the current file: add the offset of the beginning of a line to the
- * array of offsets of lines.
- * Offsets must come in in increasing order!
- *
- * fixme: this means, we don't support holes among the buffers...
+ * Wait until the writer process takes more data and hand over as much of the
+ * pending data as it takes.
  */
-static void lsp_lines_add(off_t next_line)
+static void lsp_ofile_wait()
 {
-	/* The first line is already known. */
-	if (next_line == 0)
-		return;
+	struct pollfd fds = { .fd = lsp_ofile, .events = POLLOUT };
 
-	/* Adjust size of lines array. */
-	if (cf->lines_count + 1 == cf->lines_size) {
-		cf->lines = lsp_realloc(cf->lines,
-				    (cf->lines_size * 2) * sizeof(next_line));
-		cf->lines_size *= 2;
+	if (poll(&fds, 1, -1) == -1) {
+		if (errno == EINTR)
+			return;
+		lsp_error("%s: poll(2): %s", __func__, strerror(errno));
 	}
 
-	if (next_line < cf->lines[cf->lines_count - 1])
-		lsp_error("%s: line offsets not increasing: line %ld@%ld vs. line %ld@%ld.",
-			  __func__, cf->lines_count, cf->lines[cf->lines_count - 1],
-			  cf->lines_count + 1, next_line);
+	size_t n = lsp_ofile_write_some(lsp_ofile_pending.data +
+					lsp_ofile_pending.done,
+					lsp_ofile_pending.len);
+
+	lsp_ofile_pending.done += n;
+	lsp_ofile_pending.len -= n;
 
-	cf->lines[cf->lines_count++] = next_line;
+	if (lsp_ofile_pending.len == 0)
+		lsp_ofile_pending.done = 0;
 }
 
 /*
- * Read all remaining data from current input fd.
+ * Tell if reading more input in the background could make us wait for the
+ * writer of the -o file.
  */
-static void lsp_file_read_all()
+static bool lsp_ofile_full()
 {
-	while (!LSP_EOF)
-		lsp_file_add_block();
-
+	return lsp_ofile_pending.len + LSP_INGEST_SIZE > LSP_OFILE_PENDING_MAX;
 }
 
 /*
- * Read the next block of data.
+ * Start the process that writes our input to the file given with -o.
  *
- * Reading actually happens in lsp_file_read_block()
- * and we just calculate the maximum size of data that should be
- * read.
+ * A slow output file (e.g. on NFS) then can't hold up reading and paging.
  */
-static void lsp_file_add_block()
+static void lsp_ofile_start()
 {
-	if (LSP_EOF)
+	int pipefd[2];
+
+	if (lsp_ofile <= 0)
 		return;
 
-	size_t size_to_read;
+	if (pipe(pipefd) == -1)
+		lsp_error("%s: pipe(): %s", __func__, strerror(errno));
 
-	if (cf->size != LSP_FSIZE_UNKNOWN)
-		size_to_read = cf->size - cf->seek;
-	else
-		/* We don't know about the file's size.
-		   Try to read a block. */
-		size_to_read = cf->blksize;
+	lsp_ofile_pid = fork();
 
-	/* Read at most blksize bytes. */
-	if (size_to_read > cf->blksize)
-		size_to_read = cf->blksize;
+	if (lsp_ofile_pid == -1)
+		lsp_error("%s: fork(): %s", __func__, strerror(errno));
 
-	lsp_file_read_block(size_to_read);
+	if (lsp_ofile_pid == 0) {
+		close(pipefd[1]);
+		lsp_ofile_writer(pipefd[0], lsp_ofile);
+	}
+
+	close(pipefd[0]);
+	close(lsp_ofile);
+	lsp_ofile = pipefd[1];
 
+	/* Other children don't need it; the writer waits for EOF. */
+	fcntl(lsp_ofile, F_SETFD, FD_CLOEXEC);
+	fcntl(lsp_ofile, F_SETFL, fcntl(lsp_ofile, F_GETFL) | O_NONBLOCK);
+#if defined(F_SETPIPE_SZ)
+	/* Best effort: a bigger pipe means less data kept in pending. */
+	fcntl(lsp_ofile, F_SETPIPE_SZ, LSP_OFILE_PIPE_SIZE);
+#endif
 }
 
 /*
- * Error out with a message.
+ * Writer process for the file given with -o: copy everything that comes in
+ * through the pipe to the file until EOF.
+ *
+ * On write errors we keep reading so that lsp itself never blocks or gets a
+ * SIGPIPE, the exit status tells about the failure.
  */
-static int lsp_error(const char *format, ...)
+static void lsp_ofile_writer(int in, int out)
 {
-	va_list ap;
-
-	if (lsp_hwin != NULL)
-		delwin(lsp_hwin);
-
-	/* Check if curses has been initialized and do cleanup */
-	if (isendwin() == FALSE)
-		endwin();
+	char buffer[LSP_OFILE_BUFFER_SIZE];
+	int status = EXIT_SUCCESS;
+	ssize_t n;
 
-	va_start(ap, format);
-#if DEBUG
-	if (lsp_logfp) {
-		va_list apd;
-		va_copy(apd, ap);
-		vfprintf(lsp_logfp, format, apd);
-		fprintf(lsp_logfp, "\n");
-		va_end(apd);
+#if defined(__linux__)
+	/* Move the data from the pipe to the file inside the kernel. */
+	while ((n = splice(in, NULL, out, NULL, LSP_OFILE_PIPE_SIZE,
+			   SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+		if (n == -1 && errno != EINTR)
+			break;
 	}
+
+	if (n == 0)
+		_exit(status);
 #endif
-	vfprintf(stderr, format, ap);
-	fprintf(stderr, "\n");
-	va_end(ap);
 
-	lsp_file_ring_dtor();
+	while ((n = read(in, buffer, sizeof(buffer))) != 0) {
+		ssize_t i;
 
-	exit(EXIT_FAILURE);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			_exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; status == EXIT_SUCCESS && i < n; ) {
+			ssize_t w = write(out, buffer + i, n - i);
+
+			if (w == -1 && errno == EINTR)
+				continue;
+
+			if (w == -1)
+				status = EXIT_FAILURE;
+			else
+				i += w;
+		}
+	}
+
+	_exit(status);
 }
 
 /*
- * Output a debug message.
+ * Hand all remaining data over to the writer process of the file given with
+ * -o and wait for it to write it.
  */
-static int lsp_debug(const char *format, ...)
+static void lsp_ofile_finish()
 {
-	int result = 0;
-#if DEBUG
-	FILE *fp = lsp_logfp;
+	int wstatus;
 
-	/* Enable early logging before lsp_logfp is setup according to
-	   a -l option: as long as lsp_logfp is unset we write to stderr. */
-	if (!fp)
-		fp = stderr;
+	if (lsp_ofile <= 0)
+		return;
 
-	va_list ap;
-	va_start(ap, format);
-	result = vfprintf(fp, format, ap);
-	fprintf(fp, "\n");
-	result += 1;
-	va_end(ap);
-#endif
-	return result;
+	/* Now we can wait. */
+	fcntl(lsp_ofile, F_SETFL, fcntl(lsp_ofile, F_GETFL) & ~O_NONBLOCK);
+
+	lsp_ofile_write_some(lsp_ofile_pending.data + lsp_ofile_pending.done,
+			     lsp_ofile_pending.len);
+
+	close(lsp_ofile);
+	lsp_ofile = 0;
+	free(lsp_ofile_pending.data);
+
+	while (waitpid(lsp_ofile_pid, &wstatus, 0) == -1)
+		if (errno != EINTR)
+			return;
+
+	if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS)
+		fprintf(stderr, "lsp: could not write all input to the "
+			"output file.\n");
 }
 
 /*
- * Destroy input file structures for clean exit.
+ * Record the beginnings of lines found in len bytes of data that start at the
+ * given offset in the file.
+ *
+ * Like lsp_file_read_block() we don't record a line that would start right
+ * after the last byte, this happens when the next data arrives.
  */
-static void lsp_file_ring_dtor()
+static void lsp_file_index_lines(const unsigned char *buffer_p, off_t offset,
+				 size_t len)
 {
-	while (cf != NULL)
-		lsp_file_kill();
+	const unsigned char *p = buffer_p;
+	const unsigned char *end = buffer_p + len;
 
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		/* We record the beginning of a line,
+		   not the end => +1 */
+		if (++p == end)
+			break;
+		lsp_lines_add(offset + (p - buffer_p));
+	}
 }
 
 /*
- * Remove current file_t from the ring.
+ * Map the current file into memory.
+ *
+ * This is done for regular files whose size we know.  The whole file then
+ * becomes one single read-only data buffer and blksize is its size.
+ *
+ * Return false if the file can't be mapped; the caller then reads it in blocks.
  */
-static void lsp_file_kill()
+static bool lsp_file_map()
 {
-	struct file_t *tmp;
+	void *map;
 
-	lsp_debug("%s: killing file \"%s\".", __func__, cf->name);
+	if (cf->size == LSP_FSIZE_UNKNOWN || cf->size == 0)
+		return false;
 
-	tmp = cf;
-	tmp->prev->next = tmp->next;
-	tmp->next->prev = tmp->prev;
-	cf = tmp->next;
+	if (cf->flags & LSP_FLAG_POPEN)
+		return false;
 
-	lsp_file_dtor(tmp);
-	/*
-	 * If it pointed to itself we just destroyed the last member
-	 * of the ring.
-	 */
-	if (cf == tmp)
-		cf = NULL;
-}
+	map = mmap(NULL, cf->size, PROT_READ, MAP_PRIVATE, cf->fd, 0);
 
-/*
- * Cleanly remove a file_t
- */
-static void lsp_file_dtor(struct file_t *file)
-{
-	free(file->name);
-	free(file->rep_name);
-	free(file->lines);
-	lsp_file_data_dtor(file->data);
+	if (map == MAP_FAILED) {
+		lsp_debug("%s: mmap(2) of %s failed: %s",
+			  __func__, cf->name, strerror(errno));
+		return false;
+	}
 
-	if (file->flags & LSP_FLAG_POPEN) {
-		if (file->fp != NULL)
-			pclose(file->fp);
-	} else if (file->fd != -1)
-		close(file->fd);
+	cf->data = lsp_malloc(sizeof(struct data_t));
+	cf->data->prev = cf->data->next = cf->data;
+	cf->data->seek = 0;
+	cf->data->buffer = map;
+	lsp_file_blocks_add(cf->data);
 
-	lsp_toc_dtor(file);
+	cf->blksize = cf->size;
+	cf->flags |= LSP_FLAG_MMAP;
 
-	free(file);
+	return true;
 }
 
 /*
- * Remove all data buffers of a file_t
+ * Map a grown file again with its new size.
+ * Lines are recorded by offsets; they stay valid.
  */
-static void lsp_file_data_dtor(struct data_t *data)
+static void lsp_file_remap(off_t size)
 {
-	struct data_t *tmp = data;
-
-	lsp_debug("%s: destroying data buffers of file", __func__);
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, cf->fd, 0);
 
-	if (data == NULL)
-		return;
+	if (map == MAP_FAILED)
+		lsp_error("%s: mmap(2) of %s failed: %s",
+			  __func__, cf->name, strerror(errno));
 
-	/* Break up the ring so that it has ends. */
-	data->prev->next = NULL;
+	munmap(cf->data->buffer, cf->blksize);
 
-	while (tmp) {
-		data = tmp;
-		tmp = data->next;
-		free(data->buffer);
-		free(data);
-	}
+	cf->data->buffer = map;
+	cf->blksize = size;
 }
 
 /*
- * Open the controlling terminal for user command input.
+ * "Read" the next size_to_read bytes of a mapped file.
+ *
+ * The data is already there, we just need to record its lines.
  */
-static void lsp_open_cterm()
+static ssize_t lsp_file_map_block(size_t size_to_read)
 {
-	const char *cterm = ctermid(NULL);
+	unsigned char *buffer_p = cf->data->buffer + cf->seek;
 
-	lsp_debug("%s: opening cterm %s for command input...", __func__, cterm);
+	lsp_ofile_write(buffer_p, size_to_read);
 
-	int in_fd = open(cterm, 0, "r");
+	if (cf->seek > 0 && buffer_p[-1] == '\n')
+		lsp_lines_add(cf->seek);
 
-	if (in_fd == -1)
-		lsp_error("%s: %s: %s", __func__, cterm, strerror(errno));
+	lsp_file_index_lines(buffer_p, cf->seek, size_to_read);
 
-	if (in_fd != STDIN_FILENO)
-		lsp_error("%s: TTY input fd (%d) != STDIN_FILENO.", __func__, in_fd);
+	cf->seek += size_to_read;
+	lsp_stats.bytes_mapped += size_to_read;
+
+	return size_to_read;
 }
 
 /*
- * Initialize stdin as the only data input.
- *
- * We first move the file descriptor away from STDIN_FILENO and then open the
- * controlling terminal as the then free-to-use STDIN_FILENO for reading
- * user commands.
+ * Perform an actual read(2) with error handling.
  */
-static void lsp_file_init_stdin()
+static ssize_t lsp_file_do_read(unsigned char *buffer_p, size_t size_to_read)
 {
-	lsp_debug("No input files given -- checking stdin...");
-
-	if (isatty(STDIN_FILENO))
-		lsp_error("STDIN is a tty; we don't support that -- yet.");
-
-	/* This should be a name an ordinary file couldn't conflict with.
-	   Let's use the the empty string. */
-	lsp_file_add("", 0);
+	bool teed = false;
 
-	cf->size = LSP_FSIZE_UNKNOWN;
-	cf->ftype |= LSP_FTYPE_STDIN;
+#if defined(__linux__)
+	/*
+	 * Duplicate pipe input for the file given with -o without copying
+	 * it: tee(2) the data into the pipe to the writer and read just that.
+	 */
+	if (lsp_ofile > 0 && lsp_ofile_pending.len == 0 &&
+	    !(cf->flags & LSP_FLAG_NO_TEE)) {
+		ssize_t n = tee(cf->fd, lsp_ofile, size_to_read,
+				SPLICE_F_NONBLOCK);
+
+		if (n > 0) {
+			size_to_read = n;
+			teed = true;
+		} else if (n == -1 && errno == EINVAL) {
+			cf->flags |= LSP_FLAG_NO_TEE;
+		}
+	}
+#endif
 
-	/* Move stdin to something > 2 and and then use the controlling terminal
-	 * as the one we use for the user to communicate with us. */
-	cf->fd = dup(STDIN_FILENO);
-	close(STDIN_FILENO);
+	ssize_t nread = read(cf->fd, buffer_p, size_to_read);
 
-	lsp_file_set_blksize();
+	if (nread == -1) {
+		lsp_debug("%s: input file %s: %s",
+			  __func__, cf->name, strerror(errno));
 
-	if (cf->fd <= 2)
-		lsp_debug("%s: file descriptor did not become > 2.", __func__);
+		/* When we read from ptmxfd given by forktty()
+		   we get EIO at the end of data.
+		   So, simulate normal EOF by setting nread = 0. */
+		if (errno == EIO)
+			nread = 0;
+		return nread;
+	}
 
-	lsp_open_cterm();
+	lsp_stats.bytes_read += nread;
 
-	lsp_file_add_block();
+	/* Duplicate input to file given with -o */
+	if (!teed)
+		lsp_ofile_write(buffer_p, nread);
 
-	char *name = lsp_detect_manpage(true);
-	if (name == NULL)
-		return;
+	if (nread < size_to_read)
+		lsp_debug("%s, pos %ld: read %ld bytes instead of %ld.",
+			  __func__, cf->seek, nread, size_to_read);
 
-	free(cf->name);
-	cf->name = name;
-	cf->ftype |= LSP_FTYPE_MANPAGE;
+	return nread;
 }
 
 /*
- * Initialization of input stream for user commands.
- *
- * This function is only for cases when we get a filename as an argument and
- * want to read commands from the given stdin.
- *
- * This is necessary, because pipelines like e.g.
- * `bzcat /usr/share/man/man1/mandoc.1.bz2 | mandoc -l` call us with the name of
- * a temporary file and give us an empty FIFO as stdin -- not the (controlling)
- * terminal device.
+ * Add a block of data to the current file
  */
-static void lsp_init_cmd_input()
+static ssize_t lsp_file_read_block(size_t size_to_read)
 {
-	int		result;
-	struct stat	statbuf;
+	if (cf->flags & LSP_FLAG_MMAP)
+		return lsp_file_map_block(size_to_read);
 
-	/* Test if STDIN_FILENO is open */
-	result = fstat(STDIN_FILENO, &statbuf);
+	if (lsp_buffer_free_size()) {
+		/* Current buffer is not filled up.
+		   Use it to read more data into memory. */
+		if (size_to_read > lsp_buffer_free_size())
+			size_to_read = lsp_buffer_free_size();
+	} else {
+		lsp_file_data_ctor(size_to_read);
+	}
 
-	if (result != 0) {
-		if (result == EBADF)
-			lsp_error("%s: STDIN_FILENO not open for reading.",
-				  __func__);
-		else
-			lsp_error("%s: STDIN_FILENO: %s", __func__, strerror(errno));
+	/* Fill the buffer */
+	ssize_t nread = 0;
+	unsigned char *buffer_p = cf->data->buffer + (cf->blksize - lsp_buffer_free_size());
+
+	/*
+	 * Check if we need to consume a byte that was read from a preprocessor
+	 * pipe.  Store that byte as the first one and emulate that we already
+	 * read one byte.
+	 */
+	if (cf->seek == 0 && cf->flags & LSP_PRE_READ) {
+		buffer_p[0] = (char)cf->pre_read;
+		buffer_p += 1;
+		size_to_read -= 1;
+		nread = 1;
 	}
 
-	if (!isatty(STDIN_FILENO)) {
-		/* No tty: try to read from stdin. */
+	ssize_t ret = lsp_file_do_read(buffer_p, size_to_read);
 
-		int	c = 'x';
-		int	result;
+	if (ret == -1)
+		return -1;
 
-		result = read(STDIN_FILENO, &c, 1);
+	nread += ret;
 
-		if (result == -1)
-			lsp_error("%s: stdin: read failed: %s", __func__, strerror(errno));
+	cf->seek += nread;
 
-		if (result == 0) {
-			/* EOF on stdin.
-			   Close it and try to find a tty to use. */
-			fclose(stdin);
-			lsp_open_cterm();
+	if (nread == 0) {
+		lsp_debug("%s: EOF detected for %s at %ld", __func__, cf->name, cf->seek);
+
+		 /* We notice if a file is of unknown size and we read
+		    all data from it. */
+		if (cf->size == LSP_FSIZE_UNKNOWN) {
+			cf->size = cf->seek;
+
+			/* Empty files have 0 lines. */
+			if (cf->size == 0)
+				cf->lines_count = 0;
 		}
+		lsp_file_close();
+		return 0;
 	}
-}
 
-static size_t lsp_fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
-{
-	size_t nread = fread(ptr, size, nmemb, stream);
+	size_t read_offset = buffer_p - cf->data->buffer;
 
-	if (ferror(stream))
-		lsp_error("%s: fread(3) failed.", __func__);
+	/* When this is a new buffer and if a previous buffer exists and ends
+	   with newline this buffer is the start of a new line. */
+	if (read_offset == 0 && cf->seek - nread != 0) {
+		if (cf->data->prev->buffer[cf->blksize - 1] == '\n')
+			lsp_lines_add(cf->data->seek);
+	}
+
+	if (read_offset > 0) {
+		if (buffer_p[-1] == '\n')
+			lsp_lines_add(cf->data->seek + read_offset);
+	}
+
+	/* Inspect all of the read data to keep record of lines */
+	lsp_file_index_lines(buffer_p, cf->data->seek + read_offset, nread);
 
 	return nread;
 }
 
 /*
- * Open input file.
- *
- * Use a preprocessor if the environment provides one.
+ * Initialize the line index of a file: it has one line starting at 0.
  */
-static int lsp_open_file(const char *name)
+static void lsp_lines_ctor(struct file_t *file)
 {
-	char buffer[512];
-
-	if (lsp_env_open == NULL) {
-		cf->fd = open(cf->name, 0, "r");
-		return 0;
-	}
-
-	size_t cmd_len = strlen(lsp_env_open) + strlen(name) + 1;
-	char *cmd = lsp_calloc(cmd_len, 1);
-	snprintf(cmd, cmd_len, lsp_env_open, name);
-
-	if (cmd[0] == '|') {
-		/*
-		 * Create a pipe the preprocessor writes the content to.
-		 */
-		FILE *fp = popen(cmd + 1, "r");
+	file->lines = lsp_malloc(LSP_LINES_INITIAL_SIZE * sizeof(file->lines[0]));
+	file->lines_size = LSP_LINES_INITIAL_SIZE;
+	file->lines_count = 1;
 
-		if (fp == NULL) {
-			lsp_error("%s: could not popen(\"%s\").", __func__, lsp_env_open);
-		}
+	/* The first line always starts at pos 0 */
+	file->lines[0].first = file->lines[0].last = 0;
+	file->lines[0].deltas = NULL;
+	file->lines[0].len = file->lines[0].size = 0;
+}
 
-		/*
-		 * Try to read from pipe.
-		 * Don't use fread(3) which causes problems when we later use read(2)!
-		 *
-		 * Use original file if the pipe has no data for us.
-		 */
-		size_t n = read(fileno(fp), buffer, 1);
+static void lsp_lines_dtor(struct file_t *file)
+{
+	size_t chunks = (file->lines_count + LSP_LINES_CHUNK - 1) / LSP_LINES_CHUNK;
 
-		if (n == 0) {
-			/*
-			 * No data in pipe.  Use original file.
-			 */
-			pclose(fp);
-			cf->fd = open(cf->name, 0, "r");
-		} else {
-			/*
-			 * There is data in the pipe.
-			 */
-			/*
-			 * We cannot unget the read byte; store it in cf for
-			 * later consumption.
-			 */
-			cf->flags |= LSP_PRE_READ;
-			cf->pre_read = buffer[0];
-			/* Remember that we need to pclose(3) this pipe. */
-			cf->flags |= LSP_FLAG_POPEN;
-			cf->fp = fp;
-			cf->fd = fileno(fp);
-		}
-	} else {
-		/*
-		 * Don't establish a pipe to the preprocessor but let it tell us
-		 * which replacement file we should read.
-		 */
-		FILE *fp = popen(cmd, "r");
+	if (chunks == 0)
+		chunks = 1;
 
-		if (fp == NULL) {
-			lsp_error("%s: could not popen(\"%s\").", __func__, lsp_env_open);
-		}
+	for (size_t i = 0; i < chunks; i++)
+		free(file->lines[i].deltas);
 
-		size_t nread = 0;
+	free(file->lines);
+	file->lines = NULL;
+	file->lines_size = 0;
+}
 
-		while (!feof(fp)) {
-			nread += lsp_fread(buffer + nread, 1, sizeof(buffer) - nread, fp);
+/*
+ * Return the approximate number of bytes of a file's line index.
+ */
+static size_t lsp_lines_mem(struct file_t *file)
+{
+	size_t chunks = (file->lines_count + LSP_LINES_CHUNK - 1) / LSP_LINES_CHUNK;
+	size_t mem = file->lines_size * sizeof(file->lines[0]);
 
-			if (nread == sizeof(buffer))
-				lsp_error("%s: replacement file name too long.", __func__);
-		}
+	for (size_t i = 0; i < chunks; i++)
+		mem += file->lines[i].size;
 
-		pclose(fp);
+	return mem;
+}
 
-		if (nread == 0) {
-			lsp_debug("%s: no replacement file for \"%s\"", __func__, cf->name);
-			cf->fd = open(cf->name, 0, "r");
-		} else {
-			cf->rep_name = lsp_mdup2str(buffer, nread);
-			lsp_debug("%s: opening replacement file \"%s\"", __func__, cf->rep_name);
-			cf->fd = open(cf->rep_name, 0, "r");
-		}
-	}
+/*
+ * Decode the distance of a line to its predecessor and advance *p behind
+ * it.
+ */
+static off_t lsp_lines_decode(const unsigned char **p)
+{
+	off_t delta = 0;
+	int shift = 0;
 
-	free(cmd);
+	do {
+		delta |= (off_t)(**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
 
-	return 0;
+	return delta;
 }
 
 /*
- * Make given file new predecessor of cf.
- * We need this for switching open files in which case we want to maintain
- * the ring of input files as a stack so that more recently active files get
- * offered at the top of the list of open files.
+ * Return the start of the line with the given (zero-based) index.
  */
-static void lsp_file_move_here(struct file_t *file_p)
+static off_t lsp_lines_get(size_t line)
 {
-	if (cf == file_p)
-		return;		/* We can't become our predecessor. */
+	struct lsp_lines_chunk_t *chunk = &cf->lines[line / LSP_LINES_CHUNK];
+	size_t n = line % LSP_LINES_CHUNK;
 
-	if (cf->prev == file_p)
-		return;		/* file_p already is our predecessor. */
+	if (line + 1 == cf->lines_count || n == LSP_LINES_CHUNK - 1)
+		return chunk->last;
 
-	/* Extract file_p from its current position in the ring. */
-	file_p->prev->next = file_p->next;
-	file_p->next->prev = file_p->prev;
+	const unsigned char *p = chunk->deltas;
+	off_t pos = chunk->first;
 
-	/* Make file_p cf's new predecessor. */
-	cf->prev->next = file_p;
-	file_p->prev = cf->prev;
-	cf->prev = file_p;
-	file_p->next = cf;
+	while (n--)
+		pos += lsp_lines_decode(&p);
+
+	return pos;
 }
 
 /*
- * Set size of current file.
+ * For the current file: add the offset of the beginning of a line to the
+ * index of offsets of lines.
+ * Offsets must come in in increasing order!
+ *
+ * fixme: this means, we don't support holes among the buffers...
  */
-static void lsp_file_set_size()
+static void lsp_lines_add(off_t next_line)
 {
-	struct stat statbuf;
-	char *path;
+	/* The first line is already known. */
+	if (next_line == 0)
+		return;
 
-	if (fstat(cf->fd, &statbuf) == -1)
-		lsp_error("fstat(%s): %s", cf->name, strerror(errno));
+	size_t n = cf->lines_count % LSP_LINES_CHUNK;
+	struct lsp_lines_chunk_t *chunk = &cf->lines[cf->lines_count / LSP_LINES_CHUNK];
 
-	if (!(S_ISREG(statbuf.st_mode) || S_ISFIFO(statbuf.st_mode)))
-		lsp_error("%s: %s: unsupported file type.",
-			  __func__, cf->name);
+	if (cf->lines_count &&
+	    next_line < lsp_lines_get(cf->lines_count - 1))
+		lsp_error("%s: line offsets not increasing: line %ld@%ld vs. line %ld@%ld.",
+			  __func__, cf->lines_count, lsp_lines_get(cf->lines_count - 1),
+			  cf->lines_count + 1, next_line);
 
-	path = realpath(cf->name, NULL);
-	if (path == NULL ) {
-		lsp_debug("%s: couldn't get realpath(3) for %s",
-			  __func__, cf->name);
-		cf->size = LSP_FSIZE_UNKNOWN;
+	if (n == 0) {
+		/* Start a new chunk. */
+		if (cf->lines_count / LSP_LINES_CHUNK == cf->lines_size) {
+			cf->lines = lsp_realloc(cf->lines,
+					    (cf->lines_size * 2) * sizeof(cf->lines[0]));
+			cf->lines_size *= 2;
+			chunk = &cf->lines[cf->lines_count / LSP_LINES_CHUNK];
+		}
+
+		chunk->first = chunk->last = next_line;
+		chunk->deltas = NULL;
+		chunk->len = chunk->size = 0;
+		cf->lines_count++;
 		return;
 	}
 
-	/*
-	 * The size reported for some files (e.g. kernel generated pseudofiles)
-	 * is not accurate.  We handle them like stdin: unknown size until
-	 * read(2) hits EOF.
-	 */
-	if (LSP_STRN_EQ(path, "/proc/", 6) ||
-	    LSP_STRN_EQ(path, "/sys/", 5)) {
-		cf->size = LSP_FSIZE_UNKNOWN;
-		goto out;
+	/* Room for the largest encoded distance. */
+	if (chunk->size - chunk->len < LSP_LINES_DELTA_MAX) {
+		chunk->size = chunk->size ? chunk->size * 2 : 2 * LSP_LINES_CHUNK;
+		chunk->deltas = lsp_realloc(chunk->deltas, chunk->size);
 	}
 
-	/* We know sizes only of regular files. */
-	if (S_ISREG(statbuf.st_mode))
-		cf->size = statbuf.st_size;
-	else
-		cf->size = LSP_FSIZE_UNKNOWN;
-
-	/* Empty files have 0 lines. */
-	if (cf->size == 0)
-		cf->lines_count = 0;
-out:
-	free(path);
-}
-
-static void lsp_mark_regular_file()
-{
-	struct stat statbuf;
+	off_t delta = next_line - chunk->last;
 
-	if (stat(cf->name, &statbuf) == -1)
-		lsp_error("fstat(%s): %s", cf->name, strerror(errno));
+	while (delta >= 0x80) {
+		chunk->deltas[chunk->len++] = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	chunk->deltas[chunk->len++] = delta;
 
-	if (S_ISREG(statbuf.st_mode))
-		cf->ftype |= LSP_FTYPE_REGULAR;
+	chunk->last = next_line;
+	cf->lines_count++;
 }
 
 /*
- * Prepare current cf for regular use.
- */
-static void lsp_file_init()
-{
+ * Read the next block of data.
+ *
+ * Reading actually happens in lsp_file_read_block()
+ * and we just calculate the maximum size of data that should be
+ * read.
+ */
+static void lsp_file_add_block()
+{
+	if (LSP_EOF)
+		return;
+
+	size_t size_to_read;
+
+	if (cf->size != LSP_FSIZE_UNKNOWN)
+		size_to_read = cf->size - cf->seek;
+	else
+		/* We don't know about the file's size.
+		   Try to read a block. */
+		size_to_read = cf->blksize;
+
+	/* Read at most blksize bytes.
+	   Mapped files are a single block, record them in chunks. */
+	if (cf->flags & LSP_FLAG_MMAP) {
+		if (size_to_read > LSP_MMAP_CHUNK)
+			size_to_read = LSP_MMAP_CHUNK;
+	} else if (size_to_read > cf->blksize)
+		size_to_read = cf->blksize;
+
+	lsp_file_read_block(size_to_read);
+
+	if (cf->ftype & LSP_FTYPE_APROPOS)
+		lsp_apropos_add_grefs();
+}
+
+/*
+ * Error out with a message.
+ */
+static int lsp_error(const char *format, ...)
+{
+	va_list ap;
+
+	/* Check if curses has been initialized and do cleanup */
+	if (isendwin() == FALSE)
+		endwin();
+
+	va_start(ap, format);
+#if DEBUG
+	if (lsp_logfp) {
+		va_list apd;
+		va_copy(apd, ap);
+		vfprintf(lsp_logfp, format, apd);
+		fprintf(lsp_logfp, "\n");
+		va_end(apd);
+	}
+#endif
+	vfprintf(stderr, format, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+
+	lsp_file_ring_dtor();
+
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Current time in seconds for lsp_stats.
+ */
+static double lsp_stats_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Account for something that started at start and is done now.
+ */
+static void lsp_stats_add(struct lsp_stats_time_t *t, double start)
+{
+	double secs = lsp_stats_now() - start;
+
+	t->count++;
+	t->total += secs;
+
+	if (secs > t->max)
+		t->max = secs;
+}
+
+static void lsp_stats_print_time(FILE *fp, const char *what,
+				 struct lsp_stats_time_t *t)
+{
+	fprintf(fp, "%-24s %10zu %10.3f %10.3f %10.3f\n", what, t->count,
+		t->total * 1000, t->count ? t->total * 1000 / t->count : 0,
+		t->max * 1000);
+}
+
+/*
+ * Write all of lsp_stats to fp.
+ */
+static void lsp_stats_print(FILE *fp)
+{
+	int key;
+
+	fprintf(fp, "%-24s %10zu\n", "bytes read", lsp_stats.bytes_read);
+	fprintf(fp, "%-24s %10zu\n", "bytes mapped", lsp_stats.bytes_mapped);
+	fprintf(fp, "%-24s %10zu\n", "data blocks", lsp_stats.blocks);
+	fprintf(fp, "%-24s %10zu\n", "lines constructed", lsp_stats.lines);
+	fprintf(fp, "%-24s %10zu\n", "lines normalized", lsp_stats.normalized);
+	fprintf(fp, "%-24s %10zu\n", "bytes normalized",
+		lsp_stats.normalized_bytes);
+	fprintf(fp, "%-24s %10zu\n", "regexec(3) calls", lsp_stats.regexec);
+
+	fprintf(fp, "\n%-24s %10s %10s %10s %10s\n",
+		"", "count", "total ms", "avg ms", "max ms");
+	lsp_stats_print_time(fp, "reference verification", &lsp_stats.verify);
+	lsp_stats_print_time(fp, "man(1) start", &lsp_stats.man);
+
+	fprintf(fp, "\n%-24s %10s %10s %10s %10s\n",
+		"command key", "count", "total ms", "avg ms", "max ms");
+
+	for (key = 0; key <= KEY_MAX; key++) {
+		const char *name = key == ' ' ? "SPACE" : keyname(key);
+
+		if (lsp_stats.keys[key].count)
+			lsp_stats_print_time(fp, name ? name : "?",
+					     &lsp_stats.keys[key]);
+	}
+}
+
+/*
+ * Output a debug message.
+ */
+static int lsp_debug(const char *format, ...)
+{
+	int result = 0;
+#if DEBUG
+	FILE *fp = lsp_logfp;
+
+	/* Enable early logging before lsp_logfp is setup according to
+	   a -l option: as long as lsp_logfp is unset we write to stderr. */
+	if (!fp)
+		fp = stderr;
+
+	va_list ap;
+	va_start(ap, format);
+	result = vfprintf(fp, format, ap);
+	fprintf(fp, "\n");
+	result += 1;
+	va_end(ap);
+#endif
+	return result;
+}
+
+/*
+ * Destroy input file structures for clean exit.
+ */
+static void lsp_file_ring_dtor()
+{
+	while (cf != NULL)
+		lsp_file_kill();
+
+}
+
+/*
+ * Remove current file_t from the ring.
+ */
+static void lsp_file_kill()
+{
+	struct file_t *tmp;
+
+	lsp_debug("%s: killing file \"%s\".", __func__, cf->name);
+
+	tmp = cf;
+	tmp->prev->next = tmp->next;
+	tmp->next->prev = tmp->prev;
+	cf = tmp->next;
+
+	lsp_file_dtor(tmp);
+	/*
+	 * If it pointed to itself we just destroyed the last member
+	 * of the ring.
+	 */
+	if (cf == tmp)
+		cf = NULL;
+}
+
+/*
+ * Cleanly remove a file_t
+ */
+static void lsp_file_dtor(struct file_t *file)
+{
+	if (lsp_page.file == file)
+		lsp_page_invalidate();
+
+	free(file->name);
+	free(file->rep_name);
+	free(file->man_pn);
+	free(file->evicted_section);
+	free(file->matches);
+	lsp_lines_dtor(file);
+	lsp_line_cache_dtor(file);
+	lsp_file_data_dtor(file);
+
+	if (file->flags & LSP_FLAG_POPEN) {
+		if (file->fp != NULL)
+			pclose(file->fp);
+	} else if (file->fd != -1)
+		close(file->fd);
+
+	lsp_file_reap(file);
+	lsp_toc_dtor(file);
+
+	while (file->renders != NULL) {
+		struct file_t *render = file->renders;
+
+		file->renders = render->next;
+		lsp_file_dtor(render);
+	}
+
+	free(file);
+}
+
+/*
+ * Remove all data buffers of a file_t
+ */
+static void lsp_file_data_dtor(struct file_t *file)
+{
+	struct data_t *data = file->data;
+	struct data_t *tmp = data;
+
+	lsp_debug("%s: destroying data buffers of file", __func__);
+
+	if (data == NULL)
+		return;
+
+	file->data = NULL;
+
+	free(file->blocks);
+	file->blocks = NULL;
+	file->blocks_count = file->blocks_size = 0;
+
+	if (file->flags & LSP_FLAG_MMAP) {
+		munmap(data->buffer, file->blksize);
+		free(data);
+		file->flags &= ~LSP_FLAG_MMAP;
+		return;
+	}
+
+	/* Break up the ring so that it has ends. */
+	data->prev->next = NULL;
+
+	while (tmp) {
+		data = tmp;
+		tmp = data->next;
+		free(data->buffer);
+		free(data);
+	}
+}
+
+/*
+ * Open the controlling terminal for user command input.
+ */
+static void lsp_open_cterm()
+{
+	const char *cterm = ctermid(NULL);
+
+	lsp_debug("%s: opening cterm %s for command input...", __func__, cterm);
+
+	int in_fd = open(cterm, 0, "r");
+
+	if (in_fd == -1)
+		lsp_error("%s: %s: %s", __func__, cterm, strerror(errno));
+
+	if (in_fd != STDIN_FILENO)
+		lsp_error("%s: TTY input fd (%d) != STDIN_FILENO.", __func__, in_fd);
+}
+
+/*
+ * Initialize stdin as the only data input.
+ *
+ * We first move the file descriptor away from STDIN_FILENO and then open the
+ * controlling terminal as the then free-to-use STDIN_FILENO for reading
+ * user commands.
+ */
+static void lsp_file_init_stdin()
+{
+	lsp_debug("No input files given -- checking stdin...");
+
+	if (isatty(STDIN_FILENO))
+		lsp_error("STDIN is a tty; we don't support that -- yet.");
+
+	/* This should be a name an ordinary file couldn't conflict with.
+	   Let's use the the empty string. */
+	lsp_file_add("", 0);
+
+	cf->size = LSP_FSIZE_UNKNOWN;
+	cf->ftype |= LSP_FTYPE_STDIN;
+
+	/* Move stdin to something > 2 and and then use the controlling terminal
+	 * as the one we use for the user to communicate with us. */
+	cf->fd = dup(STDIN_FILENO);
+	close(STDIN_FILENO);
+
+	lsp_file_set_blksize();
+
+	if (cf->fd <= 2)
+		lsp_debug("%s: file descriptor did not become > 2.", __func__);
+
+	lsp_open_cterm();
+
+	lsp_file_add_block();
+
+	char *name = lsp_detect_manpage(true);
+	if (name == NULL)
+		return;
+
+	free(cf->name);
+	cf->name = name;
+	cf->ftype |= LSP_FTYPE_MANPAGE;
+}
+
+/*
+ * Initialization of input stream for user commands.
+ *
+ * This function is only for cases when we get a filename as an argument and
+ * want to read commands from the given stdin.
+ *
+ * This is necessary, because pipelines like e.g.
+ * `bzcat /usr/share/man/man1/mandoc.1.bz2 | mandoc -l` call us with the name of
+ * a temporary file and give us an empty FIFO as stdin -- not the (controlling)
+ * terminal device.
+ */
+static void lsp_init_cmd_input()
+{
+	int		result;
+	struct stat	statbuf;
+
+	/* Test if STDIN_FILENO is open */
+	result = fstat(STDIN_FILENO, &statbuf);
+
+	if (result != 0) {
+		if (result == EBADF)
+			lsp_error("%s: STDIN_FILENO not open for reading.",
+				  __func__);
+		else
+			lsp_error("%s: STDIN_FILENO: %s", __func__, strerror(errno));
+	}
+
+	if (!isatty(STDIN_FILENO)) {
+		/* No tty: try to read from stdin. */
+
+		int	c = 'x';
+		int	result;
+
+		result = read(STDIN_FILENO, &c, 1);
+
+		if (result == -1)
+			lsp_error("%s: stdin: read failed: %s", __func__, strerror(errno));
+
+		if (result == 0) {
+			/* EOF on stdin.
+			   Close it and try to find a tty to use. */
+			fclose(stdin);
+			lsp_open_cterm();
+		}
+	}
+}
+
+static size_t lsp_fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+	size_t nread = fread(ptr, size, nmemb, stream);
+
+	if (ferror(stream))
+		lsp_error("%s: fread(3) failed.", __func__);
+
+	return nread;
+}
+
+/*
+ * Open input file.
+ *
+ * Use a preprocessor if the environment provides one.
+ */
+static int lsp_open_file(const char *name)
+{
+	char buffer[512];
+
+	if (lsp_env_open == NULL) {
+		cf->fd = open(cf->name, 0, "r");
+		return 0;
+	}
+
+	size_t cmd_len = strlen(lsp_env_open) + strlen(name) + 1;
+	char *cmd = lsp_calloc(cmd_len, 1);
+	snprintf(cmd, cmd_len, lsp_env_open, name);
+
+	if (cmd[0] == '|') {
+		/*
+		 * Create a pipe the preprocessor writes the content to.
+		 */
+		FILE *fp = popen(cmd + 1, "r");
+
+		if (fp == NULL) {
+			lsp_error("%s: could not popen(\"%s\").", __func__, lsp_env_open);
+		}
+
+		/*
+		 * Try to read from pipe.
+		 * Don't use fread(3) which causes problems when we later use read(2)!
+		 *
+		 * Use original file if the pipe has no data for us.
+		 */
+		size_t n = read(fileno(fp), buffer, 1);
+
+		if (n == 0) {
+			/*
+			 * No data in pipe.  Use original file.
+			 */
+			pclose(fp);
+			cf->fd = open(cf->name, 0, "r");
+		} else {
+			/*
+			 * There is data in the pipe.
+			 */
+			/*
+			 * We cannot unget the read byte; store it in cf for
+			 * later consumption.
+			 */
+			cf->flags |= LSP_PRE_READ;
+			cf->pre_read = buffer[0];
+			/* Remember that we need to pclose(3) this pipe. */
+			cf->flags |= LSP_FLAG_POPEN;
+			cf->fp = fp;
+			cf->fd = fileno(fp);
+		}
+	} else {
+		/*
+		 * Don't establish a pipe to the preprocessor but let it tell us
+		 * which replacement file we should read.
+		 */
+		FILE *fp = popen(cmd, "r");
+
+		if (fp == NULL) {
+			lsp_error("%s: could not popen(\"%s\").", __func__, lsp_env_open);
+		}
+
+		size_t nread = 0;
+
+		while (!feof(fp)) {
+			nread += lsp_fread(buffer + nread, 1, sizeof(buffer) - nread, fp);
+
+			if (nread == sizeof(buffer))
+				lsp_error("%s: replacement file name too long.", __func__);
+		}
+
+		pclose(fp);
+
+		if (nread == 0) {
+			lsp_debug("%s: no replacement file for \"%s\"", __func__, cf->name);
+			cf->fd = open(cf->name, 0, "r");
+		} else {
+			cf->rep_name = lsp_mdup2str(buffer, nread);
+			lsp_debug("%s: opening replacement file \"%s\"", __func__, cf->rep_name);
+			cf->fd = open(cf->rep_name, 0, "r");
+		}
+	}
+
+	free(cmd);
+
+	return 0;
+}
+
+/*
+ * Make given file new predecessor of cf.
+ * We need this for switching open files in which case we want to maintain
+ * the ring of input files as a stack so that more recently active files get
+ * offered at the top of the list of open files.
+ */
+static void lsp_file_move_here(struct file_t *file_p)
+{
+	if (cf == file_p)
+		return;		/* We can't become our predecessor. */
+
+	if (cf->prev == file_p)
+		return;		/* file_p already is our predecessor. */
+
+	/* Extract file_p from its current position in the ring. */
+	file_p->prev->next = file_p->next;
+	file_p->next->prev = file_p->prev;
+
+	/* Make file_p cf's new predecessor. */
+	cf->prev->next = file_p;
+	file_p->prev = cf->prev;
+	cf->prev = file_p;
+	file_p->next = cf;
+}
+
+/*
+ * Set size of current file.
+ */
+static void lsp_file_set_size()
+{
+	struct stat statbuf;
+	char *path;
+
+	if (fstat(cf->fd, &statbuf) == -1)
+		lsp_error("fstat(%s): %s", cf->name, strerror(errno));
+
+	if (!(S_ISREG(statbuf.st_mode) || S_ISFIFO(statbuf.st_mode)))
+		lsp_error("%s: %s: unsupported file type.",
+			  __func__, cf->name);
+
+	path = realpath(cf->name, NULL);
+	if (path == NULL ) {
+		lsp_debug("%s: couldn't get realpath(3) for %s",
+			  __func__, cf->name);
+		cf->size = LSP_FSIZE_UNKNOWN;
+		return;
+	}
+
+	/*
+	 * The size reported for some files (e.g. kernel generated pseudofiles)
+	 * is not accurate.  We handle them like stdin: unknown size until
+	 * read(2) hits EOF.
+	 */
+	if (LSP_STRN_EQ(path, "/proc/", 6) ||
+	    LSP_STRN_EQ(path, "/sys/", 5)) {
+		cf->size = LSP_FSIZE_UNKNOWN;
+		goto out;
+	}
+
+	/* We know sizes only of regular files. */
+	if (S_ISREG(statbuf.st_mode))
+		cf->size = statbuf.st_size;
+	else
+		cf->size = LSP_FSIZE_UNKNOWN;
+
+	/* Empty files have 0 lines. */
+	if (cf->size == 0)
+		cf->lines_count = 0;
+out:
+	free(path);
+}
+
+static void lsp_mark_regular_file()
+{
+	struct stat statbuf;
+
+	if (stat(cf->name, &statbuf) == -1)
+		lsp_error("fstat(%s): %s", cf->name, strerror(errno));
+
+	if (S_ISREG(statbuf.st_mode))
+		cf->ftype |= LSP_FTYPE_REGULAR;
+}
+
+/*
+ * Prepare current cf for regular use.
+ */
+static void lsp_file_init()
+{
 	lsp_open_file(cf->name);
 
-	if (cf->fd == -1)
-		lsp_error("%s: %s: %s", __func__, cf->name, strerror(errno));
+	if (cf->fd == -1)
+		lsp_error("%s: %s: %s", __func__, cf->name, strerror(errno));
+
+	lsp_mark_regular_file();
+
+	lsp_file_set_size();
+
+	lsp_file_set_blksize();
+
+	lsp_file_map();
+
+	lsp_file_add_block();
+}
+
+/*
+ * Initialize ring of input files
+ * Open the first given file (or stdin) for reading.
+ */
+static void lsp_file_init_ring()
+{
+	struct file_t *ring_start = cf;
+
+	if (cf == NULL) {
+		/* No file name given, try stdin. */
+		lsp_file_init_stdin();
+		return;
+	}
+
+	lsp_init_cmd_input();
+
+	/* Initialize all input files in the ring */
+	do {
+		lsp_file_init();
+
+		cf = cf->next;
+	} while (cf != ring_start);
+}
+
+/*
+ * Initialize the first 256 colors that we use when decoding SGR
+ * sequences.  The first 16 we take as is and the following are the colors of
+ * the 6x6x6 cube and 24 nuances of grayscale.
+ *
+ * All of this was looked up at:
+ *	https://en.wikipedia.org/wiki/ANSI_escape_code#8-bit
+ */
+static void lsp_init_256_colors()
+{
+	int i;
+	int cube_pos;
+	short cube6_steps[6] = {0, 370, 527, 684, 840, 1000};
+	short grayscale_start = 0x08;
+
+	/* Init 6x6x6 cube colors. */
+	int r, g, b;
+
+	for (r = 0; r < 6; r++) {
+		for (g = 0; g < 6; g++) {
+			for (b = 0; b < 6; b++) {
+				cube_pos = 16 + 36 * r + 6 * g + b;
+
+				init_color(cube_pos,
+					   cube6_steps[r],
+					   cube6_steps[g],
+					   cube6_steps[b]);
+			}
+		}
+	}
+
+	/* And 24 grayscale colors. */
+	for (i = 0; i < 24; i++) {
+		short c = grayscale_start + i * 41;
+		assert(c < 1000);
+		init_color(232 + i, c, c, c);
+	}
+}
+
+/*
+ * ncurses initialization
+ */
+static int lsp_init_screen()
+{
+	mmask_t new_mask, old_mask;
+
+	lsp_win = initscr();
+	if (lsp_win == NULL)
+		return -1;
+
+	getmaxyx(lsp_win, lsp_maxy, lsp_maxx);
+
+	if (!has_colors())
+		lsp_color = false;
+
+	if (lsp_color) {
+		start_color();
+
+		use_default_colors();
+		pair_content(LSP_DEFAULT_PAIR, &lsp_fg_color_default, &lsp_bg_color_default);
+
+		lsp_next_pair = LSP_FREE_PAIR;
+
+		init_pair(LSP_BOLD_PAIR,    COLOR_BLUE,	   lsp_bg_color_default);
+		init_pair(LSP_UL_PAIR,	    COLOR_CYAN,	   lsp_bg_color_default);
+		init_pair(LSP_REVERSE_PAIR, COLOR_WHITE,   COLOR_MAGENTA);
+
+		bkgd(COLOR_PAIR(LSP_DEFAULT_PAIR));
+
+		/* Make white a bit whiter.  1000 is max. */
+		int ret = init_color(COLOR_WHITE, 909, 909, 909);
+		if (ret == ERR)
+			lsp_error("%s: Could not change color.", __func__);
+
+		lsp_init_256_colors();
+	}
+
+	cbreak();
+	noecho();
+	keypad(stdscr, TRUE);
+	/* Let the terminal scroll scrolled parts of the window. */
+	idlok(lsp_win, TRUE);
+
+	new_mask = ALL_MOUSE_EVENTS;
+	mousemask(new_mask, &old_mask);
+
+	if (lsp_color)
+		wbkgd(lsp_win, COLOR_PAIR(LSP_DEFAULT_PAIR));
+
+	wattr_set(lsp_win, A_NORMAL, LSP_DEFAULT_PAIR, 0);
+
+	return 0;
+}
+
+#if DEBUG
+/*
+ * Output the ring of input file names.
+ */
+static void lsp_print_file_ring()
+{
+	size_t i = 1;
+	struct file_t *ptr = cf;
+
+	lsp_debug("Input files:");
+
+	if (cf == NULL)
+		return;
+
+	do {
+		lsp_debug("%ld: name=\"%s\", size=%ld", i++, ptr->name, ptr->size);
+		ptr = ptr->next;
+	} while (ptr != cf);
+}
+#endif
+
+/*
+ * Reset getch_pos and mark the file's buffers unaligned.
+ */
+static void lsp_file_set_pos(off_t pos)
+{
+	/* Don't exceed cf->seek when changing file positions. */
+	lsp_pos = pos > cf->seek ? cf->seek : pos;
+
+	/* Only existing buffers can be unaligned. */
+	if (cf->data != NULL)
+		cf->unaligned = 1;
+}
+
+/*
+ * Find last match in line.
+ *
+ * This function is used in searching backwards.
+ * The given line must already be prepared for the correct start/continuation of
+ * the search, i.e. already handled matches or any text following the start
+ * position must have been cut off the tail of the line prior to calling this
+ * function.
+ *
+ */
+static regmatch_t lsp_line_get_last_match(struct lsp_line_t **line)
+{
+	int ret;
+	regmatch_t pmatch[1];
+	 /* In LSP_REFS_MODE we need to validate references that we find.
+	    So, match positions first go to the variable match and if validation
+	    is needed they are copied to valid_match only after they are
+	    validated. */
+	regmatch_t match = lsp_no_match;
+	regmatch_t valid_match = lsp_no_match;
+	off_t offset;
+
+	/* With a literal we only need to look at lines containing it. */
+	bool use_literal = (cf->regex_p == lsp_search_regex &&
+			    lsp_search_literal != NULL &&
+			    !lsp_mode_is_toc());
+
+	if (*line == NULL)
+		return lsp_no_match;
+
+	do {
+		offset = 0;
+
+		/* Find all matches in the line; we need the last one. */
+		while (offset < (*line)->nlen) {
+			int eflags = REG_NOTEOL | REG_STARTEND;
+
+			if (offset > 0)
+				eflags |= REG_NOTBOL;
+
+			pmatch[0].rm_so = offset;
+			pmatch[0].rm_eo = (*line)->nlen;
+
+			ret = lsp_regexec(cf->regex_p, (*line)->normalized, 1, pmatch, eflags);
+
+			if (ret != 0)
+				break;
+
+			lsp_debug("%s: regexec match[%u]: \"%.*s\"",
+				  __func__, pmatch[0].rm_eo - pmatch[0].rm_so,
+				  pmatch[0].rm_eo - pmatch[0].rm_so,
+				  (*line)->normalized + offset);
+
+			/* Store offsets relative to line start. */
+			match.rm_so = pmatch[0].rm_so;
+			match.rm_eo = pmatch[0].rm_eo;
+			offset = pmatch[0].rm_eo;
+
+			/* Ensure progress for zero-length matches. */
+			if (pmatch[0].rm_so == pmatch[0].rm_eo)
+				offset += lsp_mblen((*line)->normalized + offset,
+						    (*line)->nlen - offset);
+
+			/* Now, calculate match offsets for raw data. */
+			match.rm_so = (*line)->pos +
+				lsp_line_n2raw(*line, match.rm_so);
+			match.rm_eo = (*line)->pos +
+				lsp_line_n2raw(*line, match.rm_eo);
+
+			if (lsp_mode_is_search()) {
+				valid_match = match;
+			} else {
+				/* LSP_REFS_MODE:
+				   we need to validate the match. */
+				bool valid = lsp_validate_ref_at_pos_wait(match);
+
+				if (valid)
+					valid_match = match;
+			}
+		}
+
+		if (lsp_is_a_match(valid_match)) {
+			lsp_mode_set_highlight();
+			return valid_match;
+		}
+
+		lsp_file_set_pos((*line)->pos);
+		lsp_line_dtor(*line);
+
+		if (use_literal) {
+			off_t candidate = lsp_file_search_candidate_bw(lsp_pos);
+
+			if (candidate == (off_t)-1) {
+				*line = NULL;
+				break;
+			}
+
+			lsp_file_set_pos(candidate);
+			*line = lsp_get_this_line();
+		} else
+			*line = lsp_file_get_prev_line();
+
+	} while (*line);
+
+	return valid_match;
+}
+
+/*
+ * Wrapper function for forward searches in the file or TOC.
+ */
+static regmatch_t lsp_search_next()
+{
+	regmatch_t match;
+
+	if (lsp_mode_is_toc())
+		return lsp_toc_search_next();
+	else if (lsp_matches_search_next(&match))
+		return match;
+	else
+		return lsp_file_search_next();
+}
+
+/*
+ * From the current TOC position:
+ *
+ * find first match for search pattern
+ */
+static regmatch_t lsp_toc_search_next()
+{
+	int ret;
+	regmatch_t pmatch[1];
+	regmatch_t ret_val = lsp_no_match;
+	struct lsp_line_t *line = NULL;
+
+	if (!cf->toc_entries)
+		return ret_val;
+
+	off_t start_pos = lsp_pos;
+	size_t start_toc = cf->toc;
+
+	while (1) {
+		regmatch_t match;
+
+		lsp_line_dtor(line);
+
+		line = lsp_get_line_from_here();
+
+		if (!line)
+			break;
+
+		int eflags = REG_NOTEOL | REG_STARTEND;
+
+		if (lsp_pos_is_at_bol(line->pos) == false)
+			eflags |= REG_NOTBOL;
+
+		pmatch[0].rm_so = 0;
+		pmatch[0].rm_eo = line->nlen;
+
+		ret = lsp_regexec(cf->regex_p, line->normalized, 1, pmatch, eflags);
+
+		if (ret == 0) {
+			lsp_debug("%s: regexec match[%u]: \"%.*s\"",
+				  __func__, pmatch[0].rm_eo - pmatch[0].rm_so,
+				  line->nlen, line->normalized);
+
+			match.rm_so = line->pos +
+				lsp_line_n2raw(line, pmatch[0].rm_so);
+			match.rm_eo = line->pos +
+				lsp_line_n2raw(line, pmatch[0].rm_eo);
+
+			lsp_mode_set_highlight();
+			ret_val = match;
+			break;
+		}
+		if (lsp_toc_move_to_next())
+			break;
+		lsp_file_set_pos(LSP_TOC(cf->toc).pos);
+	}
+
+	lsp_file_set_pos(start_pos);
+	cf->toc = start_toc;
+	lsp_line_dtor(line);
+	return ret_val;
+}
+
+/*
+ * Look for the search literal in the complete lines from pos to end, which
+ * must lie inside one data buffer.
+ *
+ * If the data contains backspace or escape sequences we look at its normalized
+ * version.
+ *
+ * Return the position of the first (or with last == true: the last) hit or
+ * (off_t)-1.
+ */
+static off_t lsp_file_search_window(off_t pos, off_t end, bool last)
+{
+	struct data_t *data = cf->blocks[pos / cf->blksize];
+	const char *start = (char *)data->buffer + (pos - data->seek);
+	const char *hit;
+	off_t ret = (off_t)-1;
+
+	if (memchr(start, '\b', end - pos) == NULL &&
+	    memchr(start, '\x1b', end - pos) == NULL) {
+		hit = lsp_search_literal_find(start, end - pos, last);
+
+		if (hit)
+			ret = pos + (hit - start);
+	} else {
+		struct lsp_arena_mark_t mark = lsp_arena_mark(&lsp_lines_arena);
+		struct lsp_line_t *chunk = lsp_line_ctor_transient();
+
+		chunk->len = end - pos;
+		chunk->normalized = lsp_normalize(start, chunk->len,
+						  &chunk->nlen,
+						  &chunk->nmap,
+						  &chunk->n_nmap,
+						  &lsp_lines_arena);
+
+		hit = lsp_search_literal_find(chunk->normalized, chunk->nlen,
+					      last);
+
+		if (hit)
+			ret = pos + lsp_line_n2raw(chunk,
+					hit - chunk->normalized + 1) - 1;
+
+		lsp_line_dtor(chunk);
+		lsp_arena_release(&lsp_lines_arena, mark);
+	}
+
+	return ret;
+}
+
+/*
+ * From the beginning of a line at pos: find the beginning of the next line that
+ * contains the search literal.
+ *
+ * We look at windows of complete lines inside the data buffer at hand.
+ * Windows grow while we don't find anything so that the work stays
+ * proportional to the distance to the next hit.
+ *
+ * Return (off_t)-1 if there is no such line.
+ */
+static off_t lsp_file_search_candidate(off_t pos)
+{
+	size_t window = LSP_SEARCH_WINDOW;
+
+	while (1) {
+		struct data_t *data;
+		off_t end;
+		off_t hit;
+
+		if (pos >= cf->seek) {
+			if (LSP_EOF)
+				return (off_t)-1;
+
+			lsp_file_add_block();
+
+			if (pos >= cf->seek)
+				return (off_t)-1;
+		}
+
+		data = cf->blocks[pos / cf->blksize];
+
+		end = data->seek + cf->blksize;
+		if (end > cf->seek)
+			end = cf->seek;
+		if (end - pos > window)
+			end = pos + window;
+
+		/* Only look at complete lines.  Leave a line that continues
+		 * beyond this data to the caller. */
+		if (end < cf->seek)
+			end = lsp_lines_get(lsp_lines_find(end));
+		else if (!LSP_EOF)
+			end = lsp_lines_get(lsp_lines_find(end - 1));
+
+		if (end <= pos)
+			return pos;
+
+		hit = lsp_file_search_window(pos, end, false);
+
+		if (hit != (off_t)-1)
+			return lsp_lines_get(lsp_lines_find(hit));
+
+		pos = end;
+
+		if (window < LSP_MMAP_CHUNK)
+			window *= 2;
+	}
+}
+
+/*
+ * Backward version of lsp_file_search_candidate(): from the beginning of a line
+ * at pos find the beginning of the closest line in front of it that contains
+ * the search literal.
+ *
+ * Return (off_t)-1 if there is no such line.
+ */
+static off_t lsp_file_search_candidate_bw(off_t pos)
+{
+	size_t window = LSP_SEARCH_WINDOW;
+
+	while (pos > 0) {
+		struct data_t *data = cf->blocks[(pos - 1) / cf->blksize];
+		off_t start;
+		off_t hit;
+		size_t i;
+
+		start = pos - window;
+		if (start < data->seek)
+			start = data->seek;
+
+		/* Start with a complete line inside this data buffer.
+		 * Leave a line that begins in front of it to the caller. */
+		i = lsp_lines_find(start);
+
+		if (lsp_lines_get(i) < data->seek) {
+			if (lsp_lines_get(lsp_lines_find(pos - 1)) < data->seek)
+				return lsp_lines_get(lsp_lines_find(pos - 1));
+			i++;
+		}
+
+		start = lsp_lines_get(i);
+
+		hit = lsp_file_search_window(start, pos, true);
+
+		if (hit != (off_t)-1)
+			return lsp_lines_get(lsp_lines_find(hit));
+
+		pos = start;
+
+		if (window < LSP_MMAP_CHUNK)
+			window *= 2;
+	}
+
+	return (off_t)-1;
+}
+
+/*
+ * From current file position:
+ *
+ * find first match for search pattern
+ */
+static regmatch_t lsp_file_search_next()
+{
+	int ret;
+	regmatch_t pmatch[1];
+	regmatch_t ret_val = lsp_no_match;
+	struct lsp_line_t *line = NULL;
+	off_t start_pos = lsp_pos;
+
+	/* With a literal we only need to look at lines containing it. */
+	bool use_literal = (cf->regex_p == lsp_search_regex &&
+			    lsp_search_literal != NULL);
+
+	while (1) {
+		regmatch_t match;
+
+		lsp_line_dtor(line);
+		line = NULL;
+
+		if (use_literal && lsp_is_at_bol()) {
+			off_t candidate = lsp_file_search_candidate(lsp_pos);
+
+			if (candidate == (off_t)-1)
+				break;
+
+			lsp_file_set_pos(candidate);
+		}
+
+		line = lsp_get_line_from_here();
+
+		if (!line)
+			break;
+
+		int eflags = REG_NOTEOL | REG_STARTEND;
+
+		if (lsp_pos_is_at_bol(line->pos) == false)
+			eflags |= REG_NOTBOL;
+
+		pmatch[0].rm_so = 0;
+		pmatch[0].rm_eo = line->nlen;
+
+		ret = lsp_regexec(cf->regex_p, line->normalized, 1, pmatch, eflags);
+
+		if (ret == 0) {
+			lsp_debug("%s: regexec match[%u]: \"%.*s\"",
+				  __func__, pmatch[0].rm_eo - pmatch[0].rm_so,
+				  line->nlen, line->normalized);
+
+			match.rm_so = line->pos +
+				lsp_line_n2raw(line, pmatch[0].rm_so);
+			match.rm_eo = line->pos +
+				lsp_line_n2raw(line, pmatch[0].rm_eo);
+
+			lsp_mode_set_highlight();
+			ret_val = match;
+			break;
+		}
+	}
+
+	lsp_file_set_pos(start_pos);
+	lsp_line_dtor(line);
+	return ret_val;
+}
+
+/*
+ * Forget the index of search matches of the given file.
+ * It gets built again for the current search pattern.
+ */
+static void lsp_matches_reset(struct file_t *file)
+{
+	file->matches_count = 0;
+	file->matches_seek = 0;
+	file->matches_tail = (off_t)-1;
+	file->matches_gen = lsp_search_gen;
+}
+
+/*
+ * Make the index of search matches of the current file fit its search pattern
+ * and data.
+ *
+ * Return true if it can be used.
+ */
+static bool lsp_matches_sync()
+{
+	if (lsp_search_regex == NULL || cf->regex_p != lsp_search_regex)
+		return false;
+
+	if (cf->matches_gen != lsp_search_gen)
+		lsp_matches_reset(cf);
+
+	if (cf->matches_seek == (off_t)-1)
+		return false;
+
+	/* An indexed last line without newline might have grown. */
+	if (cf->matches_tail != (off_t)-1 &&
+	    cf->matches_seek != lsp_file_data_end()) {
+		cf->matches_count = lsp_matches_find(cf->matches_tail);
+		cf->matches_seek = cf->matches_tail;
+		cf->matches_tail = (off_t)-1;
+	}
+
+	return true;
+}
+
+/*
+ * Check if there is data for the index of search matches of the current file.
+ */
+static bool lsp_matches_pending()
+{
+	return lsp_matches_sync() && cf->matches_seek < lsp_file_data_end();
+}
+
+/*
+ * Copy the line of the current file that starts at pos out of the data
+ * buffers.  The line ends with its newline or at end.
+ *
+ * The line is a transient one; callers take a mark of lsp_lines_arena.
+ */
+static struct lsp_line_t *lsp_line_from_data(off_t pos, off_t end)
+{
+	struct lsp_line_t *line = lsp_line_ctor_transient();
+	char *nl = NULL;
+
+	line->pos = pos;
+
+	/* Copy the line span by span. */
+	while (nl == NULL && pos < end) {
+		struct data_t *data = cf->blocks[pos / cf->blksize];
+		const char *start = (char *)data->buffer + (pos - data->seek);
+		size_t span = data->seek + cf->blksize - pos;
+
+		if (span > end - pos)
+			span = end - pos;
+
+		nl = memchr(start, '\n', span);
+
+		if (nl != NULL)
+			span = nl - start + 1;
+
+		line->raw = lsp_line_realloc(line, line->raw,
+					     line->len ? line->len + 1 : 0,
+					     line->len + span + 1);
+		memcpy(line->raw + line->len, start, span);
+		line->len += span;
+		pos += span;
+	}
+
+	line->current = line->raw;
+	line->normalized = lsp_normalize(line->raw, line->len,
+					 &line->nlen, &line->nmap,
+					 &line->n_nmap, &lsp_lines_arena);
+
+	return line;
+}
+
+/*
+ * Add the matches of the next lines of the current file to its index.
+ *
+ * We use lsp_line_find_matches() on complete lines, so the index holds exactly
+ * the matches that get highlighted.  Zero-length matches can't be navigated
+ * by an index of positions; if we find one we give up on the index.
+ */
+static void lsp_matches_step()
+{
+	off_t end = lsp_file_data_end();
+	off_t stop = cf->matches_seek + LSP_MATCHES_STEP;
+	regmatch_t *pmatch = NULL;
+	struct lsp_arena_mark_t mark = lsp_arena_mark(&lsp_lines_arena);
+
+	while (cf->matches_seek < end && cf->matches_seek < stop) {
+		struct lsp_line_t *line = lsp_line_from_data(cf->matches_seek, end);
+		size_t n, i;
+
+		n = line->nlen ? lsp_line_find_matches(line, &pmatch) : 0;
+
+		if (cf->matches_size < cf->matches_count + n) {
+			while (cf->matches_size < cf->matches_count + n)
+				cf->matches_size = cf->matches_size ?
+					2 * cf->matches_size :
+					LSP_MATCHES_INITIAL_SIZE;
+
+			cf->matches = lsp_realloc(cf->matches, cf->matches_size *
+						  sizeof(regmatch_t));
+		}
+
+		for (i = 0; i < n; i++) {
+			if (pmatch[i].rm_so == pmatch[i].rm_eo) {
+				lsp_debug("%s: zero-length match, no index",
+					  __func__);
+				cf->matches_count = 0;
+				cf->matches_seek = (off_t)-1;
+				lsp_line_dtor(line);
+				lsp_arena_release(&lsp_lines_arena, mark);
+				free(pmatch);
+				return;
+			}
+
+			cf->matches[cf->matches_count].rm_so = line->pos + pmatch[i].rm_so;
+			cf->matches[cf->matches_count].rm_eo = line->pos + pmatch[i].rm_eo;
+			cf->matches_count++;
+		}
+
+		if (line->raw[line->len - 1] != '\n')
+			cf->matches_tail = line->pos;
+
+		cf->matches_seek = line->pos + line->len;
+		lsp_line_dtor(line);
+
+		/* Reuse the memory of the line for the next one. */
+		lsp_arena_release(&lsp_lines_arena, mark);
+	}
+
+	free(pmatch);
+}
+
+/*
+ * Return the index of the first indexed search match of the current file that
+ * starts at or after pos.
+ */
+static size_t lsp_matches_find(off_t pos)
+{
+	size_t lo = 0;
+	size_t hi = cf->matches_count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cf->matches[mid].rm_so < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Check if the matches in the given full or partial line can be taken from
+ * the index of search matches.
+ */
+static bool lsp_matches_covers(const struct lsp_line_t *line)
+{
+	if (!lsp_matches_sync() || line->len == 0 ||
+	    line->pos + line->len > cf->matches_seek ||
+	    !lsp_pos_is_at_bol(line->pos))
+		return false;
+
+	/* Only the indexed last line may lack a newline. */
+	return line->raw[line->len - 1] == '\n' ||
+		line->pos == cf->matches_tail;
+}
+
+/*
+ * Like lsp_line_find_matches() but take the matches of a line covered by the
+ * index of search matches from there.
+ */
+static size_t lsp_matches_get(const struct lsp_line_t *line, regmatch_t **pmatch)
+{
+	size_t first = lsp_matches_find(line->pos);
+	size_t last = lsp_matches_find(line->pos + line->len);
+	size_t i;
+
+	*pmatch = lsp_realloc(*pmatch, (last - first + 1) * sizeof(regmatch_t));
+
+	for (i = first; i < last; i++) {
+		(*pmatch)[i - first].rm_so = cf->matches[i].rm_so - line->pos;
+		(*pmatch)[i - first].rm_eo = cf->matches[i].rm_eo - line->pos;
+	}
+
+	/* End-of-matches marker */
+	(*pmatch)[last - first] = lsp_no_match;
+
+	return last - first;
+}
+
+/*
+ * Find the next match from the current position with the index of search
+ * matches.  This works if we start at the beginning of a line or at either end
+ * of an indexed match, because matching proceeds from there just like it did
+ * for the index.  Matches in an indexed last line without newline are left to
+ * lsp_file_search_next() that looks at the whole line.
+ *
+ * Return false if the index can't tell, otherwise store the result in match.
+ */
+static bool lsp_matches_search_next(regmatch_t *match)
+{
+	off_t start = lsp_pos;
+	off_t end;
+	size_t i;
+
+	if (!lsp_matches_sync())
+		return false;
+
+	end = cf->matches_tail != (off_t)-1 ? cf->matches_tail : cf->matches_seek;
+
+	if (start > end)
+		return false;
+
+	i = lsp_matches_find(start);
+
+	if (!lsp_is_at_bol() &&
+	    !(i < cf->matches_count && cf->matches[i].rm_so == start) &&
+	    !(i > 0 && cf->matches[i - 1].rm_eo == start))
+		return false;
+
+	if (i < cf->matches_count && cf->matches[i].rm_so < end) {
+		*match = cf->matches[i];
+		lsp_mode_set_highlight();
+		return true;
+	}
+
+	/* Nothing more in the indexed lines: search behind them. */
+	lsp_file_set_pos(end);
+	*match = lsp_file_search_next();
+	lsp_file_set_pos(start);
+
+	return true;
+}
+
+/*
+ * Backward version of lsp_matches_search_next(): find the last match in front
+ * of the current position, which must be the beginning of a line or of an
+ * indexed match.
+ */
+static bool lsp_matches_search_prev(regmatch_t *match)
+{
+	off_t start = lsp_pos;
+	size_t i;
+
+	if (lsp_mode_is_toc() || !lsp_matches_sync())
+		return false;
+
+	if (start > (cf->matches_tail != (off_t)-1 ?
+		     cf->matches_tail : cf->matches_seek))
+		return false;
+
+	i = lsp_matches_find(start);
+
+	if (!lsp_is_at_bol() &&
+	    !(i < cf->matches_count && cf->matches[i].rm_so == start))
+		return false;
+
+	if (i == 0) {
+		*match = lsp_no_match;
+		return true;
+	}
+
+	*match = cf->matches[i - 1];
+	lsp_mode_set_highlight();
+
+	return true;
+}
+
+/*
+ * Translate the given string to one with all lowercase chars.
+ */
+static void lsp_to_lower(char *str)
+{
+	int i;
+	size_t len = strlen(str);
+
+	for (i = 0; i < len; i++)
+		str[i] = tolower(str[i]);
+
+	return;
+}
+
+/*
+ * Allocate len bytes from the given arena.
+ *
+ * Arenas are lists of chunks that only get freed as a whole by
+ * lsp_arena_dtor().  Allocations are aligned for any type.
+ */
+static void *lsp_arena_alloc(struct lsp_arena_t **arena, size_t len)
+{
+	struct lsp_arena_t *chunk = *arena;
+	size_t align = _Alignof(max_align_t);
+
+	len = (len + align - 1) & ~(align - 1);
+
+	if (chunk == NULL || chunk->size - chunk->used < len) {
+		size_t size = len > LSP_ARENA_CHUNK_SIZE ? len : LSP_ARENA_CHUNK_SIZE;
+
+		chunk = lsp_malloc(sizeof(*chunk) + size);
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->next = *arena;
+		*arena = chunk;
+	}
+
+	void *ptr = chunk->data + chunk->used;
+	chunk->used += len;
+
+	return ptr;
+}
+
+/*
+ * Free all chunks of the given arena.
+ */
+static void lsp_arena_dtor(struct lsp_arena_t **arena)
+{
+	while (*arena) {
+		struct lsp_arena_t *next = (*arena)->next;
+
+		free(*arena);
+		*arena = next;
+	}
+}
+
+/*
+ * Resize the allocation ptr of old_len bytes from the given arena to len
+ * bytes.  The last allocation of an arena can grow in place.
+ */
+static void *lsp_arena_realloc(struct lsp_arena_t **arena, void *ptr,
+			       size_t old_len, size_t len)
+{
+	struct lsp_arena_t *chunk = *arena;
+	size_t align = _Alignof(max_align_t);
+	size_t old = (old_len + align - 1) & ~(align - 1);
+
+	if (ptr != NULL && (char *)ptr + old == chunk->data + chunk->used &&
+	    len <= old + (chunk->size - chunk->used)) {
+		chunk->used -= old;
+		return lsp_arena_alloc(arena, len);
+	}
+
+	void *new = lsp_arena_alloc(arena, len);
+
+	if (ptr != NULL)
+		memcpy(new, ptr, old_len < len ? old_len : len);
+
+	return new;
+}
+
+/*
+ * Remember how much of the given arena is in use so that allocations made
+ * after this point can be released all at once with lsp_arena_release().
+ */
+static struct lsp_arena_mark_t lsp_arena_mark(struct lsp_arena_t **arena)
+{
+	struct lsp_arena_mark_t mark;
+
+	/* Keep a first chunk around for reuse after releases. */
+	if (*arena == NULL)
+		lsp_arena_alloc(arena, 0);
+
+	mark.chunk = *arena;
+	mark.used = (*arena)->used;
+
+	return mark;
+}
+
+/*
+ * Release everything allocated from the given arena after mark was taken.
+ */
+static void lsp_arena_release(struct lsp_arena_t **arena,
+			      struct lsp_arena_mark_t mark)
+{
+	while (*arena != mark.chunk) {
+		struct lsp_arena_t *next = (*arena)->next;
+
+		free(*arena);
+		*arena = next;
+	}
+
+	(*arena)->used = mark.used;
+}
+
+/*
+ * Hash a name of a reference (FNV-1a).
+ * Without case sensitivity for names of manual pages we hash the lowercase
+ * name, so lookups don't need a lowercase copy.
+ */
+static size_t lsp_gref_hash(const char *name, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = name[i];
+
+		if (!lsp_man_case_sensitivity)
+			c = tolower(c);
+
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * Check if the given gref has the given name.
+ */
+static bool lsp_gref_is(const struct gref_t *gref, size_t hash,
+			const char *name, size_t len)
+{
+	size_t i;
+
+	if (gref->hash != hash || gref->len != len)
+		return false;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = name[i];
+
+		if (!lsp_man_case_sensitivity)
+			c = tolower(c);
+
+		if ((unsigned char)gref->name[i] != c)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Double the size of the grefs table and rehash its entries.
+ */
+static void lsp_grefs_grow()
+{
+	size_t size = lsp_grefs.size ? 2 * lsp_grefs.size : LSP_GREFS_INITIAL_SIZE;
+	struct gref_t **slots = lsp_calloc(size, sizeof(*slots));
+	size_t i;
+
+	for (i = 0; i < lsp_grefs.size; i++) {
+		struct gref_t *gref = lsp_grefs.slots[i];
+
+		if (gref == NULL)
+			continue;
+
+		size_t j = gref->hash & (size - 1);
+
+		while (slots[j])
+			j = (j + 1) & (size - 1);
+
+		slots[j] = gref;
+	}
+
+	free(lsp_grefs.slots);
+	lsp_grefs.slots = slots;
+	lsp_grefs.size = size;
+}
+
+/*
+ * Search for a global reference.
+ * Add it if it does not exist.
+ */
+static struct gref_t *lsp_gref_search(const char *name, size_t len)
+{
+	struct gref_t *gref = lsp_gref_find(name, len);
+	size_t i;
+
+	if (gref != NULL)
+		return gref; /* gref already exists */
+
+	/* Keep the load factor below 3/4. */
+	if (4 * (lsp_grefs.count + 1) > 3 * lsp_grefs.size)
+		lsp_grefs_grow();
+
+	/* gref not found: add it. */
+	gref = lsp_arena_alloc(&lsp_grefs.arena, sizeof(*gref));
+	gref->name = lsp_arena_alloc(&lsp_grefs.arena, len + 1);
+	gref->len = len;
+	gref->hash = lsp_gref_hash(name, len);
+	gref->valid = -1;	/* not yet validated */
+
+	for (i = 0; i < len; i++)
+		gref->name[i] = lsp_man_case_sensitivity ?
+			name[i] : tolower((unsigned char)name[i]);
+	gref->name[len] = '\0';
+
+	i = gref->hash & (lsp_grefs.size - 1);
+
+	while (lsp_grefs.slots[i])
+		i = (i + 1) & (lsp_grefs.size - 1);
+
+	lsp_grefs.slots[i] = gref;
+	lsp_grefs.count++;
+
+	lsp_debug("%s: gref created: %s", __func__, gref->name);
+
+	return gref;
+}
+
+/*
+ * Find a global reference or return NULL.
+ */
+static struct gref_t *lsp_gref_find(const char *name, size_t len)
+{
+	size_t hash;
+	size_t i;
+
+	if (lsp_grefs.count == 0)
+		return NULL;
+
+	hash = lsp_gref_hash(name, len);
+
+	for (i = hash & (lsp_grefs.size - 1); lsp_grefs.slots[i];
+	     i = (i + 1) & (lsp_grefs.size - 1))
+		if (lsp_gref_is(lsp_grefs.slots[i], hash, name, len))
+			return lsp_grefs.slots[i];
+
+	return NULL;
+}
+
+/*
+ * Find the line number for a given position inside the file.
+ * That number is returned 1-based.
+ *
+ * This is the line in cf->lines that starts at <= pos with its following
+ * line starting at > pos.
+ */
+static size_t lsp_file_pos2line(off_t pos)
+{
+	/* Empty files have no lines. */
+	if (cf->size == 0)
+		return 0;
+
+	if (pos > cf->seek)
+		lsp_file_read_to_pos(pos);
+
+	if (cf->size != LSP_FSIZE_UNKNOWN && pos > cf->size)
+		lsp_error("%s: cannot get a line number outside "
+			  "the size of the file: %ld vs. %ld\n",
+			  cf->name, cf->size, pos);
+
+	if (pos == 0 || cf->lines_count == 1)
+		return 1;
+
+	if (pos == cf->size)
+		return cf->lines_count;
+
+	/* Return the line number 1-based. */
+	return lsp_lines_find(pos) + 1;
+}
+
+/*
+ * Like lsp_file_pos2line() but never read input to find the line.
+ * Positions beyond what we have read so far get a line number estimated
+ * from the number of lines per byte in the data we already know.
+ */
+static size_t lsp_file_pos2line_estimate(off_t pos)
+{
+	if (pos <= cf->seek)
+		return lsp_file_pos2line(pos);
+
+	/* Nothing read yet, nothing to estimate from. */
+	if (cf->seek == 0)
+		return cf->lines_count;
+
+	return (double)cf->lines_count * pos / cf->seek + 1;
+}
+
+/*
+ * Estimate the number of lines of the current file from the lines per byte
+ * in the data read so far.
+ * Without a known size the best we can tell is the number of lines so far.
+ */
+static size_t lsp_file_lines_estimate()
+{
+	if (cf->size == LSP_FSIZE_UNKNOWN || cf->seek >= cf->size ||
+	    cf->seek == 0)
+		return cf->lines_count;
+
+	return (double)cf->lines_count * cf->size / cf->seek;
+}
+
+/*
+ * Verify a reference.
+ * Usually this means: check if it is known to man(1).
+ */
+static bool lsp_ref_is_valid(struct gref_t *gref)
+{
+	int ret;
+
+	/*
+	 * If apropos(1) is used for verification create the apropos buffer
+	 * which will add grefs for all its content as it comes in.
+	 */
+	if (lsp_verify_with_apropos) {
+		lsp_apropos_start();
+
+		return gref->valid == 1;
+	}
+
+	char *command = lsp_ref_verify_command(gref);
+	double start = lsp_stats_now();
+
+	ret = system(command);
+
+	lsp_stats_add(&lsp_stats.verify, start);
+
+	lsp_debug("%s: reference %s is %s",
+		  __func__, command, ret == 0 ? "valid" : "invalid");
+
+	free(command);
+
+	return ret == 0;
+}
+
+/*
+ * Create the command to verify the given reference from lsp_verify_command.
+ *
+ * The caller has to free() the command.
+ */
+static char *lsp_ref_verify_command(struct gref_t *gref)
+{
+	size_t cmd_len;
+
+	/* Duplicate verify command.
+	 * In a few moments, we need to replace %n by %s for sprintf(3) -- but
+	 * we don't want to do that in the original string. */
+	char *format = strdup(lsp_verify_command);
+
+	/* Calculate length of command string.
+	 * First part is the length of the format string minus 4 bytes
+	 * conversion specifier. */
+	cmd_len = strlen(format) - 4;
+
+	/* Next part is the length of gref name
+	   minus 2 bytes for parentheses plus one byte terminator. */
+	cmd_len += (strlen(gref->name) - 2) + 1;
+
+	char *command = lsp_malloc(cmd_len);
+
+	/* Now, position to the first placeholder so that we can check if
+	   name or section comes first. */
+	char *cptr = strchr(format, '%') + 1;
+
+	if (cptr == (void *)1)
+		lsp_error("%s: no %% character in verify command.", __func__);
+
+	/* Extract name and section from gref name. */
+	struct man_id m_id = lsp_man_id_ctor(gref->name);
+
+	if (cptr[0] == 'n') {
+		cptr[0] = 's';
+		sprintf(command, format, m_id.name, m_id.section);
+	} else {
+		cptr = strchr(cptr, '%') + 1;
+		cptr[0] = 's';
+		sprintf(command, format, m_id.section, m_id.name);
+	}
+
+	lsp_man_id_dtor(&m_id);
+
+	free(format);
+
+	return command;
+}
+
+/*
+ * Verify the given references by running up to LSP_VERIFY_JOBS verify
+ * commands in parallel.
+ *
+ * We collect the commands as they finish, so each one counts only with its
+ * own runtime.  Other children, e.g. man(1) of prefetched manual pages,
+ * stay for their owners to reap.
+ */
+static void lsp_grefs_verify(struct gref_t **grefs, size_t n)
+{
+	pid_t pids[LSP_VERIFY_JOBS] = { 0 };
+	double starts[LSP_VERIFY_JOBS];
+	size_t jobs[LSP_VERIFY_JOBS];
+	size_t started = 0;
+	size_t running = 0;
+	size_t i;
+
+	/* Like system(3), leave SIGINT and SIGQUIT to the commands. */
+	struct sigaction ignore = { .sa_handler = SIG_IGN };
+	struct sigaction old_int, old_quit;
+
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGINT, &ignore, &old_int);
+	sigaction(SIGQUIT, &ignore, &old_quit);
+
+	while (started < n || running) {
+		/* Fill up the jobs. */
+		for (i = 0; i < LSP_VERIFY_JOBS && started < n; i++) {
+			if (pids[i] != 0)
+				continue;
+
+			char *command = lsp_ref_verify_command(grefs[started]);
+			double start = lsp_stats_now();
+			pid_t pid = fork();
+
+			if (pid == -1)
+				lsp_error("%s: fork(): %s", __func__, strerror(errno));
+
+			if (pid == 0) {
+				sigaction(SIGINT, &old_int, NULL);
+				sigaction(SIGQUIT, &old_quit, NULL);
+				execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+				_exit(127);
+			}
+
+			free(command);
+			pids[i] = pid;
+			starts[i] = start;
+			jobs[i] = started++;
+			running++;
+		}
+
+		/* See which child finished first without reaping it. */
+		siginfo_t info;
+
+		while (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == -1)
+			if (errno != EINTR)
+				lsp_error("%s: waitid(): %s", __func__, strerror(errno));
+
+		for (i = 0; i < LSP_VERIFY_JOBS; i++)
+			if (pids[i] != 0 && pids[i] == info.si_pid)
+				break;
+
+		/* Not one of ours, just wait for any of our jobs then. */
+		if (i == LSP_VERIFY_JOBS)
+			for (i = 0; pids[i] == 0; i++)
+				;
+
+		int wstatus;
+		struct gref_t *gref = grefs[jobs[i]];
+
+		while (waitpid(pids[i], &wstatus, 0) == -1)
+			if (errno != EINTR)
+				lsp_error("waitpid(%jd): %s", (intmax_t)pids[i], strerror(errno));
+
+		lsp_stats_add(&lsp_stats.verify, starts[i]);
+
+		gref->valid = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+
+		lsp_debug("%s: reference %s is %s", __func__, gref->name,
+			  gref->valid ? "valid" : "invalid");
+
+		pids[i] = 0;
+		running--;
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGQUIT, &old_quit, NULL);
+
+	lsp_refs_cache_add(grefs, n);
+}
+
+/*
+ * Return the path of the cache file for verified references or NULL if we
+ * can't find a place for it.
+ *
+ * The directory gets created if necessary.
+ * The caller has to free() the path.
+ */
+static char *lsp_refs_cache_path()
+{
+	char *xdg = getenv("XDG_CACHE_HOME");
+	char *home = getenv("HOME");
+	char *dir;
+	char *path;
+
+	if (xdg != NULL && xdg[0] == '/') {
+		dir = lsp_malloc(strlen(xdg) + strlen("/lsp") + 1);
+		sprintf(dir, "%s/lsp", xdg);
+	} else if (home != NULL) {
+		dir = lsp_malloc(strlen(home) + strlen("/.cache/lsp") + 1);
+		sprintf(dir, "%s/.cache", home);
+		mkdir(dir, 0700);
+		strcat(dir, "/lsp");
+	} else
+		return NULL;
 
-	lsp_mark_regular_file();
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		lsp_debug("%s: mkdir(2) %s: %s", __func__, dir, strerror(errno));
+		free(dir);
+		return NULL;
+	}
 
-	lsp_file_set_size();
+	path = lsp_malloc(strlen(dir) + strlen("/refs") + 1);
+	sprintf(path, "%s/refs", dir);
+	free(dir);
 
-	lsp_file_set_blksize();
+	return path;
+}
 
-	lsp_file_add_block();
+/*
+ * Return the latest modification time of the directories with manual pages
+ * and of the mandb index.  Cached verifications are only good as long as
+ * none of them changed.
+ */
+static time_t lsp_refs_cache_stamp()
+{
+	char *manpath = getenv("MANPATH");
+	char *dirs;
+	char *dir;
+	char *saveptr;
+	time_t stamp = 0;
+	struct stat st;
+
+	dirs = lsp_malloc(strlen(LSP_MANPATH_DEFAULT) + 1 +
+			  (manpath ? strlen(manpath) : 0) + 1);
+	strcpy(dirs, LSP_MANPATH_DEFAULT);
+
+	if (manpath) {
+		strcat(dirs, ":");
+		strcat(dirs, manpath);
+	}
+
+	for (dir = strtok_r(dirs, ":", &saveptr); dir;
+	     dir = strtok_r(NULL, ":", &saveptr)) {
+		DIR *dirp;
+		struct dirent *entry;
+
+		if (stat(dir, &st) == -1)
+			continue;
+
+		if (st.st_mtime > stamp)
+			stamp = st.st_mtime;
+
+		dirp = opendir(dir);
+		if (dirp == NULL)
+			continue;
+
+		/* Pages get installed in the section directories. */
+		while ((entry = readdir(dirp)) != NULL) {
+			if (LSP_STRN_NEQ(entry->d_name, "man", 3) &&
+			    LSP_STRN_NEQ(entry->d_name, "index", 5))
+				continue;
+
+			if (fstatat(dirfd(dirp), entry->d_name, &st, 0) == 0 &&
+			    st.st_mtime > stamp)
+				stamp = st.st_mtime;
+		}
+
+		closedir(dirp);
+	}
+
+	free(dirs);
+
+	return stamp;
 }
 
 /*
- * Initialize ring of input files
- * Open the first given file (or stdin) for reading.
+ * Open the cache of verified references and load its entries as grefs.
+ *
+ * The file starts with a header line that holds the stamp of the manual
+ * page directories and the verify command; if either changed, the cache is
+ * started anew.
+ * Each further line is "<valid> <name>", with valid being 0 or 1.
  */
-static void lsp_file_init_ring()
+static void lsp_refs_cache_load()
 {
-	struct file_t *ring_start = cf;
+	char *path = lsp_refs_cache_path();
+	char *header;
+	struct stat st;
 
-	if (cf == NULL) {
-		/* No file name given, try stdin. */
-		lsp_file_init_stdin();
+	if (path == NULL)
+		return;
+
+	lsp_refs_cache_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+
+	if (lsp_refs_cache_fd == -1) {
+		lsp_debug("%s: open(2) %s: %s", __func__, path, strerror(errno));
+		free(path);
 		return;
 	}
 
-	lsp_init_cmd_input();
+	free(path);
 
-	/* Initialize all input files in the ring */
-	do {
-		lsp_file_init();
+	header = lsp_malloc(strlen(lsp_verify_command) + 64);
+	sprintf(header, "lsp-refs-cache 1 %jd %s\n",
+		(intmax_t)lsp_refs_cache_stamp(), lsp_verify_command);
 
-		cf = cf->next;
-	} while (cf != ring_start);
+	size_t header_len = strlen(header);
+	char *map = MAP_FAILED;
+
+	if (fstat(lsp_refs_cache_fd, &st) == 0 && st.st_size >= header_len)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			   lsp_refs_cache_fd, 0);
+
+	if (map == MAP_FAILED || memcmp(map, header, header_len) != 0) {
+		lsp_debug("%s: starting a new cache", __func__);
+
+		if (ftruncate(lsp_refs_cache_fd, 0) == -1 ||
+		    write(lsp_refs_cache_fd, header, header_len) != header_len) {
+			close(lsp_refs_cache_fd);
+			lsp_refs_cache_fd = -1;
+		}
+	} else {
+		char *p = map + header_len;
+		char *end = map + st.st_size;
+
+		while (p < end) {
+			char *nl = memchr(p, '\n', end - p);
+
+			/* Stop at anything we didn't write completely. */
+			if (nl == NULL || nl - p < 3 || p[1] != ' ' ||
+			    (p[0] != '0' && p[0] != '1'))
+				break;
+
+			struct gref_t *gref = lsp_gref_search(p + 2, nl - (p + 2));
+
+			gref->valid = p[0] == '1';
+
+			p = nl + 1;
+		}
+
+		lsp_debug("%s: loaded %ld references", __func__, lsp_grefs.count);
+	}
+
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+
+	free(header);
 }
 
 /*
- * Initialize the first 256 colors that we use when decoding SGR
- * sequences.  The first 16 we take as is and the following are the colors of
- * the 6x6x6 cube and 24 nuances of grayscale.
+ * Append the given verified references to the cache.
+ * One write(2) in append mode keeps concurrent instances of lsp from
+ * mixing up their lines.
+ */
+static void lsp_refs_cache_add(struct gref_t **grefs, size_t n)
+{
+	size_t len = 0;
+	size_t i;
+	char *buffer;
+	char *p;
+
+	if (lsp_refs_cache_fd == -1 || n == 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		len += strlen(grefs[i]->name) + 3;
+
+	p = buffer = lsp_malloc(len + 1);
+
+	for (i = 0; i < n; i++)
+		p += sprintf(p, "%d %s\n", grefs[i]->valid == 1, grefs[i]->name);
+
+	if (write(lsp_refs_cache_fd, buffer, len) != len)
+		lsp_debug("%s: write(2): %s", __func__, strerror(errno));
+
+	free(buffer);
+}
+
+/*
+ * Verify all references that are not yet verified in the line containing
+ * pos, the page before it and two pages after it.
  *
- * All of this was looked up at:
- *	https://en.wikipedia.org/wiki/ANSI_escape_code#8-bit
+ * This way, one batch of parallel verifications usually serves the display
+ * of a page and navigating its references.
  */
-static void lsp_init_256_colors()
+static void lsp_refs_verify_around(off_t pos)
 {
-	int i;
-	int cube_pos;
-	short cube6_steps[6] = {0, 370, 527, 684, 840, 1000};
-	short grayscale_start = 0x08;
+	struct gref_t **grefs = NULL;
+	size_t n = 0;
+	size_t size = 0;
+	size_t page = lsp_maxy - 1;
+	size_t lnum = lsp_lines_find(pos);
+	size_t i = lnum > page ? lnum - page : 0;
+	size_t last = lnum + 2 * page;
 
-	/* Init 6x6x6 cube colors. */
-	int r, g, b;
+	for (; i <= last && i < cf->lines_count; i++) {
+		struct lsp_line_t *line = lsp_get_line_at_pos(lsp_lines_get(i));
+		regmatch_t pmatch[1];
+		size_t offset = 0;
 
-	for (r = 0; r < 6; r++) {
-		for (g = 0; g < 6; g++) {
-			for (b = 0; b < 6; b++) {
-				cube_pos = 16 + 36 * r + 6 * g + b;
+		if (line == NULL)
+			break;
 
-				init_color(cube_pos,
-					   cube6_steps[r],
-					   cube6_steps[g],
-					   cube6_steps[b]);
+		while (offset < line->nlen) {
+			int eflags = REG_STARTEND;
+
+			if (offset > 0)
+				eflags |= REG_NOTBOL;
+
+			pmatch[0].rm_so = offset;
+			pmatch[0].rm_eo = line->nlen;
+
+			if (lsp_regexec(lsp_refs_regex, line->normalized, 1, pmatch, eflags))
+				break;
+
+			offset = pmatch[0].rm_eo;
+
+			if (pmatch[0].rm_so == pmatch[0].rm_eo) {
+				offset += lsp_mblen(line->normalized + offset,
+						    line->nlen - offset);
+				continue;
+			}
+
+			struct gref_t *gref = lsp_gref_search(line->normalized + pmatch[0].rm_so,
+							      pmatch[0].rm_eo - pmatch[0].rm_so);
+			size_t j;
+
+			if (gref->valid != -1)
+				continue;
+
+			/* References repeat, collect each one only once. */
+			for (j = 0; j < n; j++)
+				if (grefs[j] == gref)
+					break;
+
+			if (j < n)
+				continue;
+
+			if (n == size) {
+				size = size ? 2 * size : 64;
+				grefs = lsp_realloc(grefs, size * sizeof(*grefs));
 			}
+
+			grefs[n++] = gref;
+		}
+
+		lsp_line_dtor(line);
+	}
+
+	lsp_debug("%s: verifying %ld references around %ld", __func__, n, pos);
+
+	lsp_grefs_verify(grefs, n);
+
+	free(grefs);
+}
+
+/*
+ * Create a man_id structure with separate name and section strings.
+ *
+ * The given string s could have one of four formats:
+ *
+ * - "name(section)"
+ * - "name.section"
+ * - "section name"
+ * - "name"
+ *
+ * In the last case, section will be set to "".
+ *
+ * Return the created structure.
+ */
+static struct man_id lsp_man_id_ctor(const char *s)
+{
+	struct man_id m_id;
+
+	char *nam;
+	size_t nam_len;
+	char *sec;
+	size_t sec_len;
+
+	lsp_debug("%s: create from \"%s\".", __func__, s);
+
+	/* Handle format "name(section)"
+	   Left and right parentheses mark the end of the name,
+	   the start of the section and the end of the section. */
+	char *lp = strchr(s, '(');
+	if (lp) {
+		char *rp = strchr(lp + 1, ')');
+
+		if (!rp)
+			lsp_error("%s: no right parenthesis found: \"%s\".",
+				  __func__, s);
+
+		nam = (char *)s;
+		nam_len = 1 + lp - s;
+		sec = lp + 1;		/* section follows left parenthesis. */
+		sec_len = 1 + rp - sec;
+
+		goto finish;
+	}
+
+	/* Handle format "name.section" */
+	char *dot = strrchr(s, '.');
+	if (dot) {
+		nam = (char *)s;
+		nam_len = 1 + dot - s;
+		sec = dot + 1;
+		sec_len = 1 + strlen(sec);
+
+		goto finish;
+	}
+
+	/* Handle format "section name" */
+	char *space = strchr(s, ' ');
+	if (space) {
+		nam = space + 1;
+		nam_len = 1 + strlen(nam);
+		sec = (char *)s;
+		sec_len = 1 + space - s;
+
+		goto finish;
+	}
+
+	/* Handle format "name" */
+	nam = (char *)s;
+	nam_len = strlen(s) + 1;
+	sec = "";
+	sec_len = 1;
+
+finish:
+	/*
+	 * Fill final structure with prepared parts.
+	 */
+	m_id.name = lsp_calloc(1, nam_len);
+	m_id.section = lsp_calloc(1, sec_len);
+
+	memcpy(m_id.name, nam, nam_len - 1);
+	memcpy(m_id.section, sec, sec_len - 1);
+
+	lsp_debug("%s: result is \"%s.%s\".", __func__, m_id.name, m_id.section);
+
+	return m_id;
+}
+
+/*
+ * Free memory used by a man_id.
+ */
+static void lsp_man_id_dtor(struct man_id *m_id)
+{
+	if (!m_id)
+		return;
+
+	free(m_id->section);
+	free(m_id->name);
+}
+
+/*
+ * Compile regular expression for search.
+ *
+ * Return NULL if successful, otherwise an error message.
+ */
+static char *lsp_search_compile_regex(lsp_mode_t search_mode)
+{
+	int ret;
+
+	if (search_mode == LSP_REFS_MODE) {
+		/* For references, we re-use the same regular expression.
+		   No need to compile it more than once. */
+		if (lsp_refs_regex == NULL) {
+			lsp_refs_regex = lsp_calloc(1, sizeof(regex_t));
+
+			ret = regcomp(lsp_refs_regex, lsp_search_ref_string, REG_EXTENDED);
+
+			/* No error handling here; we really should have a valid
+			   expression for refs in this program. */
+		}
+
+		/* In any case: return success. */
+		return NULL;
+	} else {
+		if (lsp_search_regex) {
+			regfree(lsp_search_regex);
+		} else {
+			lsp_search_regex = lsp_calloc(1, sizeof(regex_t));
 		}
+		/* Matches of the old expression could be in the window. */
+		lsp_page_invalidate();
+
+		int cflags = REG_EXTENDED | REG_NEWLINE;
+		if (!lsp_case_sensitivity)
+			cflags |= REG_ICASE;
+
+		ret = regcomp(lsp_search_regex, lsp_search_string, cflags);
+		lsp_search_gen++;
+
+		lsp_search_literal_ctor(ret == 0 ? lsp_search_string : NULL);
 	}
 
-	/* And 24 grayscale colors. */
-	for (i = 0; i < 24; i++) {
-		short c = grayscale_start + i * 41;
-		assert(c < 1000);
-		init_color(232 + i, c, c, c);
+	if (ret != 0) {
+		char *err_text;
+		size_t err_len = regerror(ret, lsp_search_regex, NULL, 0);
+		err_text = lsp_malloc(err_len);
+		regerror(ret, lsp_search_regex, err_text, err_len);
+		lsp_file_set_pos(cf->page_first);
+		return err_text;
 	}
+
+	return NULL;
 }
 
 /*
- * ncurses initialization
+ * Extract the longest literal string that every match of the given extended
+ * regular expression has to contain.  We use it to quickly skip data that
+ * can't match.
+ *
+ * This is conservative: whenever we are unsure about a part of the
+ * expression, it just ends the current literal.  If we find nothing usable,
+ * lsp_search_literal becomes NULL.
  */
-static int lsp_init_screen()
+static void lsp_search_literal_ctor(const char *regex)
 {
-	mmask_t new_mask, old_mask;
-
-	lsp_win = initscr();
-	if (lsp_win == NULL)
-		return -1;
-
-	getmaxyx(lsp_win, lsp_maxy, lsp_maxx);
+	size_t len;
+	char *run;
+	size_t run_len = 0;
+	size_t i;
 
-	if (!has_colors())
-		lsp_color = false;
+	free(lsp_search_literal);
+	lsp_search_literal = NULL;
+	lsp_search_literal_len = 0;
 
-	if (lsp_color) {
-		start_color();
+	if (regex == NULL)
+		return;
 
-		use_default_colors();
-		pair_content(LSP_DEFAULT_PAIR, &lsp_fg_color_default, &lsp_bg_color_default);
+	len = strlen(regex);
+	run = lsp_malloc(len + 1);
 
-		lsp_next_pair = LSP_FREE_PAIR;
+	for (i = 0; i < len; i++) {
+		char ch = regex[i];
+		bool end_run = false;
 
-		init_pair(LSP_BOLD_PAIR,    COLOR_BLUE,	   lsp_bg_color_default);
-		init_pair(LSP_UL_PAIR,	    COLOR_CYAN,	   lsp_bg_color_default);
-		init_pair(LSP_REVERSE_PAIR, COLOR_WHITE,   COLOR_MAGENTA);
+		switch (ch) {
+		case '|':
+			/* Alternatives: nothing is mandatory. */
+			free(run);
+			free(lsp_search_literal);
+			lsp_search_literal = NULL;
+			lsp_search_literal_len = 0;
+			return;
+		case '[':
+			/* Skip bracket expression, "]" first is literal. */
+			i++;
+			if (i < len && regex[i] == '^')
+				i++;
+			if (i < len && regex[i] == ']')
+				i++;
+			while (i < len && regex[i] != ']') {
+				if (regex[i] == '[' && i + 1 < len &&
+				    (regex[i + 1] == ':' || regex[i + 1] == '.' ||
+				     regex[i + 1] == '=')) {
+					char *e = strchr(regex + i + 2, regex[i + 1]);
+					i = e ? e - regex + 1 : len;
+				} else
+					i++;
+			}
+			ch = '\0';
+			break;
+		case '(': {
+			/* Skip groups, they could contain alternatives. */
+			int depth = 1;
+
+			for (i++; i < len && depth; i++) {
+				if (regex[i] == '\\')
+					i++;
+				else if (regex[i] == '(')
+					depth++;
+				else if (regex[i] == ')')
+					depth--;
+			}
+			i--;
+			ch = '\0';
+			break;
+		}
+		case '\\':
+			/* Only escaped ERE special characters are literals.
+			   Others are classes, anchors (e.g. \< or \b) or back
+			   references. */
+			if (i + 1 < len &&
+			    strchr(".[]()*+?{}|^$\\", regex[i + 1])) {
+				ch = regex[++i];
+			} else {
+				i++;
+				ch = '\0';
+			}
+			break;
+		case '{': {
+			/* Skip the interval expression. */
+			char *e = strchr(regex + i, '}');
+			i = e ? e - regex : len;
+			ch = '\0';
+			break;
+		}
+		case '.':
+		case '^':
+		case '$':
+		case '*':
+		case '+':
+		case '?':
+		case ')':
+			ch = '\0';
+			break;
+		}
 
-		bkgd(COLOR_PAIR(LSP_DEFAULT_PAIR));
+		/* We only use printable ASCII, case folding of other
+		   characters is beyond us. */
+		if ((unsigned char)ch < ' ' || (unsigned char)ch > '~')
+			end_run = true;
+
+		/* The next character could make this one optional or
+		   repeat it. */
+		if (!end_run && i + 1 < len) {
+			char next = regex[i + 1];
+
+			if (next == '*' || next == '?' || next == '{')
+				end_run = true;
+			else if (next == '+') {
+				run[run_len++] = ch;
+				end_run = true;
+				ch = '\0';
+			}
+		}
 
-		/* Make white a bit whiter.  1000 is max. */
-		int ret = init_color(COLOR_WHITE, 909, 909, 909);
-		if (ret == ERR)
-			lsp_error("%s: Could not change color.", __func__);
+		if (!end_run) {
+			run[run_len++] = ch;
+			if (i + 1 < len)
+				continue;
+		}
 
-		lsp_init_256_colors();
+		/* Keep the longest run. */
+		if (run_len > lsp_search_literal_len) {
+			free(lsp_search_literal);
+			lsp_search_literal = lsp_mdup(run, run_len);
+			lsp_search_literal_len = run_len;
+		}
+		run_len = 0;
 	}
 
-	cbreak();
-	noecho();
-	keypad(stdscr, TRUE);
-
-	new_mask = ALL_MOUSE_EVENTS;
-	mousemask(new_mask, &old_mask);
-
-	if (lsp_color)
-		wbkgd(lsp_win, COLOR_PAIR(LSP_DEFAULT_PAIR));
-
-	wattr_set(lsp_win, A_NORMAL, LSP_DEFAULT_PAIR, 0);
+	free(run);
 
-	return 0;
+	lsp_debug("%s: literal for \"%s\" is \"%.*s\"", __func__, regex,
+		  lsp_search_literal_len, lsp_search_literal);
 }
 
-#if DEBUG
 /*
- * Output the ring of input file names.
+ * Find the first (or with last == true: the last) occurrence of the search
+ * literal in the given data.
+ *
+ * Without case sensitivity we compare ASCII characters case-insensitive.
+ * Return a pointer to the literal in the data or NULL.
  */
-static void lsp_print_file_ring()
+static const char *lsp_search_literal_find(const char *data, size_t len,
+					   bool last)
 {
-	size_t i = 1;
-	struct file_t *ptr = cf;
-
-	lsp_debug("Input files:");
+	const char *hit;
+	const char *next;
 
-	if (cf == NULL)
-		return;
+	hit = lsp_search_literal_find_first(data, len);
 
-	do {
-		lsp_debug("%ld: name=\"%s\", size=%ld", i++, ptr->name, ptr->size);
-		ptr = ptr->next;
-	} while (ptr != cf);
-}
-#endif
+	if (!last)
+		return hit;
 
-/*
- * Reset getch_pos and mark the file's buffers unaligned.
- */
-static void lsp_file_set_pos(off_t pos)
-{
-	/* Don't exceed cf->seek when changing file positions. */
-	lsp_pos = pos > cf->seek ? cf->seek : pos;
+	for (next = hit; next != NULL;
+	     next = lsp_search_literal_find_first(next + 1,
+						  data + len - (next + 1)))
+		hit = next;
 
-	/* Only existing buffers can be unaligned. */
-	if (cf->data != NULL)
-		cf->unaligned = 1;
+	return hit;
 }
 
 /*
- * Find last match in line.
- *
- * This function is used in searching backwards.
- * The given line must already be prepared for the correct start/continuation of
- * the search, i.e. already handled matches or any text following the start
- * position must have been cut off the tail of the line prior to calling this
- * function.
- *
+ * Find the first occurrence of the search literal in the given data.
  */
-static regmatch_t lsp_line_get_last_match(struct lsp_line_t **line)
+static const char *lsp_search_literal_find_first(const char *data, size_t len)
 {
-	int ret;
-	regmatch_t pmatch[1];
-	 /* In LSP_REFS_MODE we need to validate references that we find.
-	    So, match positions first go to the variable match and if validation
-	    is needed they are copied to valid_match only after they are
-	    validated. */
-	regmatch_t match = lsp_no_match;
-	regmatch_t valid_match = lsp_no_match;
-	off_t offset;
-
-	if (*line == NULL)
-		return lsp_no_match;
-
-	do {
-		offset = 0;
-
-		/* Find all matches in the line; we need the last one. */
-		while (offset < (*line)->nlen) {
-			int eflags = REG_NOTEOL | REG_STARTEND;
-
-			if (offset > 0)
-				eflags |= REG_NOTBOL;
-
-			pmatch[0].rm_so = offset;
-			pmatch[0].rm_eo = (*line)->nlen;
-
-			ret = regexec(cf->regex_p, (*line)->normalized, 1, pmatch, eflags);
+	const char *end = data + len;
+	size_t l_len = lsp_search_literal_len;
+	char first = lsp_search_literal[0];
+	char alt = first;
 
-			if (ret != 0)
-				break;
+	if (len < l_len)
+		return NULL;
 
-			lsp_debug("%s: regexec match[%u]: \"%.*s\"",
-				  __func__, pmatch[0].rm_eo - pmatch[0].rm_so,
-				  pmatch[0].rm_eo - pmatch[0].rm_so,
-				  (*line)->normalized + offset);
+	if (lsp_case_sensitivity)
+		return memmem(data, len, lsp_search_literal, l_len);
 
-			/* Store offsets relative to line start. */
-			match.rm_so = pmatch[0].rm_so;
-			match.rm_eo = pmatch[0].rm_eo;
-			offset = pmatch[0].rm_eo;
+	if (islower((unsigned char)first))
+		alt = toupper((unsigned char)first);
+	else if (isupper((unsigned char)first))
+		alt = tolower((unsigned char)first);
 
-			/* Ensure progress for zero-length matches. */
-			if (pmatch[0].rm_so == pmatch[0].rm_eo)
-				offset += lsp_mblen((*line)->normalized + offset,
-						    (*line)->nlen - offset);
+	/*
+	 * Look for both cases of the first character with memchr(3) and
+	 * compare the rest for each candidate.
+	 */
+	const char *p1 = memchr(data, first, len - l_len + 1);
+	const char *p2 = alt == first ? NULL : memchr(data, alt, len - l_len + 1);
 
-			/* Now, calculate match offsets for raw data. */
-			match.rm_so = (*line)->pos +
-				lsp_normalize_count((*line)->raw, (*line)->len, match.rm_so);
-			match.rm_eo = (*line)->pos +
-				lsp_normalize_count((*line)->raw, (*line)->len, match.rm_eo);
+	while (p1 || p2) {
+		const char *p = (p2 == NULL || (p1 != NULL && p1 < p2)) ? p1 : p2;
 
-			if (lsp_mode_is_search()) {
-				valid_match = match;
-			} else {
-				/* LSP_REFS_MODE:
-				   we need to validate the match. */
-				bool valid = lsp_validate_ref_at_pos(match);
+		if (strncasecmp(p + 1, lsp_search_literal + 1, l_len - 1) == 0)
+			return p;
 
-				if (valid)
-					valid_match = match;
-			}
-		}
+		if (p == p1)
+			p1 = memchr(p1 + 1, first, end - l_len + 1 - (p1 + 1));
+		else
+			p2 = memchr(p2 + 1, alt, end - l_len + 1 - (p2 + 1));
+	}
 
-		if (lsp_is_a_match(valid_match)) {
-			lsp_mode_set_highlight();
-			return valid_match;
-		}
+	return NULL;
+}
 
-		lsp_file_set_pos((*line)->pos);
-		lsp_line_dtor(*line);
-		*line = lsp_file_get_prev_line();
+static void lsp_set_no_current_match()
+{
+	cf->current_match = lsp_no_match;
+}
 
-	} while (*line);
+static bool lsp_file_is_regular()
+{
+	return cf->ftype & LSP_FTYPE_REGULAR;
+}
 
-	return valid_match;
+static bool lsp_file_is_stdin()
+{
+	return cf->ftype & LSP_FTYPE_STDIN;
 }
 
 /*
- * Wrapper function for forward searches in the file or TOC.
+ * Read content of file up to given pos or EOF, if the file is smaller.
  */
-static regmatch_t lsp_search_next()
+static void lsp_file_read_to_pos(off_t pos)
 {
-	if (lsp_mode_is_toc())
-		return lsp_toc_search_next();
-	else
-		return lsp_file_search_next();
+	while (!LSP_EOF && cf->seek < pos)
+		lsp_file_add_block();
 }
 
 /*
- * From the current TOC position:
+ * Read input of the current file as long as it doesn't block the user.
  *
- * find first match for search pattern
- */
-static regmatch_t lsp_toc_search_next()
-{
-	int ret;
-	regmatch_t pmatch[1];
-	regmatch_t ret_val = lsp_no_match;
-	struct lsp_line_t *line = NULL;
+ * We wait up to timeout milliseconds (see poll(2)) for the first data to
+ * arrive and then read what is available, at most LSP_INGEST_SIZE bytes.
+ * Reading stops as soon as a key was pressed.
+ *
+ * Return true if we got new data or reached EOF.
+ */
+static bool lsp_file_ingest(int timeout)
+{
+	struct pollfd fds[2];
+	nfds_t nfds;
+	off_t seek = cf->seek;
+
+	while (!LSP_EOF && cf->seek - seek < LSP_INGEST_SIZE) {
+		fds[0].fd = STDIN_FILENO;
+		fds[0].events = POLLIN;
+		nfds = 1;
+
+		if (cf->flags & LSP_FLAG_MMAP) {
+			/* All data is there, just look at the keyboard. */
+			timeout = 0;
+		} else if (cf->fd != -1) {
+			fds[1].fd = cf->fd;
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+			nfds = 2;
+		}
 
-	if (!cf->toc)
-		return ret_val;
+		if (poll(fds, nfds, timeout) == -1) {
+			/* E.g. SIGWINCH -- let the caller handle the key. */
+			if (errno == EINTR)
+				break;
+			lsp_error("%s: poll(2): %s", __func__, strerror(errno));
+		}
 
-	off_t start_pos = lsp_pos;
-	struct toc_node_t *start_toc = cf->toc;
+		if (fds[0].revents)
+			break;
 
-	while (1) {
-		regmatch_t match;
+		if (nfds == 2 && fds[1].revents == 0)
+			break;
 
-		lsp_line_dtor(line);
+		if (nfds == 1 && !(cf->flags & LSP_FLAG_MMAP))
+			break;
 
-		line = lsp_get_line_from_here();
+		lsp_file_add_block();
+		timeout = 0;
+	}
 
-		if (!line)
-			break;
+	return cf->seek != seek || LSP_EOF;
+}
 
-		int eflags = REG_NOTEOL | REG_STARTEND;
+/*
+ * In follow mode: wait a while for a key and then check if the current file
+ * grew.  The new data gets read by lsp_file_ingest().
+ *
+ * Return true if the file changed.
+ */
+static bool lsp_file_follow()
+{
+	struct pollfd fds = { .fd = STDIN_FILENO, .events = POLLIN };
+	struct stat st;
 
-		if (lsp_pos_is_at_bol(line->pos) == false)
-			eflags |= REG_NOTBOL;
+	/* Key pressed or signal. */
+	if (poll(&fds, 1, LSP_FOLLOW_INTERVAL) != 0)
+		return false;
 
-		pmatch[0].rm_so = 0;
-		pmatch[0].rm_eo = line->nlen;
+	/* Only regular files grow while we still have them open. */
+	if (!lsp_file_is_regular() || cf->fd == -1)
+		return false;
 
-		ret = regexec(cf->regex_p, line->normalized, 1, pmatch, eflags);
+	if (fstat(cf->fd, &st) == -1)
+		lsp_error("%s: fstat(2) %s: %s", __func__, cf->name, strerror(errno));
 
-		if (ret == 0) {
-			lsp_debug("%s: regexec match[%u]: \"%.*s\"",
-				  __func__, pmatch[0].rm_eo - pmatch[0].rm_so,
-				  line->nlen, line->normalized);
+	if (st.st_size == cf->size)
+		return false;
 
-			match.rm_so = line->pos +
-				lsp_normalize_count(line->raw, line->len, pmatch[0].rm_so);
-			match.rm_eo = line->pos +
-				lsp_normalize_count(line->raw, line->len, pmatch[0].rm_eo);
+	if (st.st_size < cf->size) {
+		/* Truncated, e.g. a rotated log. */
+		lsp_debug("%s: %s truncated to %ld", __func__, cf->name, st.st_size);
+		lsp_cmd_reload();
+		lsp_display_page();
+		return true;
+	}
 
-			lsp_mode_set_highlight();
-			ret_val = match;
-			break;
-		}
-		if (lsp_toc_move_to_next())
-			break;
-		lsp_file_set_pos(cf->toc->pos);
+	if (cf->flags & LSP_FLAG_MMAP)
+		lsp_file_remap(st.st_size);
+
+	/* An empty file had 0 lines, now its first one starts at 0. */
+	if (cf->size == 0) {
+		lsp_lines_dtor(cf);
+		lsp_lines_ctor(cf);
 	}
 
-	lsp_file_set_pos(start_pos);
-	cf->toc = start_toc;
-	lsp_line_dtor(line);
-	return ret_val;
+	cf->size = st.st_size;
+
+	/* The formerly last line might have been incomplete. */
+	lsp_line_cache_dtor(cf);
+
+	return true;
 }
 
 /*
- * From current file position:
+ * Reload the current file if it is mapped and got truncated meanwhile, e.g.
+ * by logrotate's copytruncate.  Touching the mapping beyond the new end of
+ * the file would get us SIGBUS.
  *
- * find first match for search pattern
+ * Return true if the file got reloaded.
  */
-static regmatch_t lsp_file_search_next()
+static bool lsp_file_check_truncated()
 {
-	int ret;
-	regmatch_t pmatch[1];
-	regmatch_t ret_val = lsp_no_match;
-	struct lsp_line_t *line = NULL;
-	off_t start_pos = lsp_pos;
+	struct stat st;
 
-	while (1) {
-		regmatch_t match;
+	if (!(cf->flags & LSP_FLAG_MMAP) || cf->fd == -1)
+		return false;
 
-		lsp_line_dtor(line);
+	if (fstat(cf->fd, &st) == -1)
+		lsp_error("%s: fstat(2) %s: %s", __func__, cf->name, strerror(errno));
 
-		line = lsp_get_line_from_here();
+	if (st.st_size >= cf->blksize)
+		return false;
 
-		if (!line)
-			break;
+	lsp_debug("%s: %s truncated to %ld", __func__, cf->name, st.st_size);
+	lsp_cmd_reload();
 
-		int eflags = REG_NOTEOL | REG_STARTEND;
+	return true;
+}
 
-		if (lsp_pos_is_at_bol(line->pos) == false)
-			eflags |= REG_NOTBOL;
+/*
+ * Check if the given file is (still) readable.
+ */
+static bool lsp_is_readable(char *path)
+{
+	return access(path, R_OK) == 0;
+}
 
-		pmatch[0].rm_so = 0;
-		pmatch[0].rm_eo = line->nlen;
+/*
+ * Reread current regular file and try to position to the page last shown.
+ */
+static void lsp_file_reread()
+{
+	/* Save position of last page shown. */
+	off_t old_page_first = cf->page_first;
 
-		ret = regexec(cf->regex_p, line->normalized, 1, pmatch, eflags);
+	if (!lsp_is_readable(cf->name)) {
+		lsp_prompt = "File is no longer readable.";
+		lsp_file_set_pos(cf->page_first);
+		return;
+	}
 
-		if (ret == 0) {
-			lsp_debug("%s: regexec match[%u]: \"%.*s\"",
-				  __func__, pmatch[0].rm_eo - pmatch[0].rm_so,
-				  line->nlen, line->normalized);
+	lsp_file_reset();
+	lsp_file_init();
 
-			match.rm_so = line->pos +
-				lsp_normalize_count(line->raw, line->len, pmatch[0].rm_so);
-			match.rm_eo = line->pos +
-				lsp_normalize_count(line->raw, line->len, pmatch[0].rm_eo);
+	/* Try to reread to the position we displayed last. */
+	lsp_file_read_to_pos(old_page_first);
 
-			lsp_mode_set_highlight();
-			ret_val = match;
-			break;
-		}
-	}
+	lsp_debug("%s: reread file %s to pos %ld", __func__, cf->name, cf->size);
 
-	lsp_file_set_pos(start_pos);
-	lsp_line_dtor(line);
-	return ret_val;
+	/* If the file is now smaller, position to its last page. */
+	if (cf->seek <= old_page_first) {
+		lsp_cmd_goto_end();
+		cf->page_first = lsp_pos;
+	} else
+		cf->page_first = old_page_first;
+
+	lsp_file_set_pos(cf->page_first);
+	return;
 }
 
 /*
- * Insert a new gref into the grefs hash table.
+ * Return the approximate number of bytes used for the data of a file.
  */
-static int lsp_gref_henter(struct gref_t *gref_p)
+static size_t lsp_file_mem(struct file_t *file)
 {
-	ENTRY e;
-	ENTRY *ep;
-
-/*
- * BSD hdestroy() calls free() for each key.
- * So, create a duplicate key for those systems to ensure our later cleanup works correctly.
- */
-#if defined __APPLE__ && defined __MACH__
-	e.key = strdup(gref_p->name);
-#else
-	e.key = gref_p->name;
-#endif
-	e.data = gref_p;
-
-	ep = hsearch(e, ENTER);
+	struct file_t *render;
+	size_t mem = file->blocks_count * file->blksize +
+		lsp_lines_mem(file) +
+		file->toc_size * sizeof(struct toc_node_t) +
+		file->matches_size * sizeof(regmatch_t);
 
-	if (ep == NULL)
-		lsp_error("Enter \"%s\" into hash table: %s", gref_p->name, strerror(errno));
+	for (render = file->renders; render != NULL; render = render->next)
+		mem += lsp_file_mem(render);
 
-	return 0;
+	return mem;
 }
 
 /*
- * Translate the given string to one with all lowercase chars.
+ * Return true if we are able to drop the data of the given file and get it
+ * back later: regular files get reread and manual pages reloaded.
  */
-static void lsp_to_lower(char *str)
+static bool lsp_file_evictable(struct file_t *file)
 {
-	int i;
-	size_t len = strlen(str);
+	if (file->evicted || file->data == NULL)
+		return false;
 
-	for (i = 0; i < len; i++)
-		str[i] = tolower(str[i]);
+	if (file->ftype & (LSP_FTYPE_STDIN | LSP_FTYPE_APROPOS))
+		return false;
 
-	return;
+	return file->ftype & (LSP_FTYPE_MANPAGE | LSP_FTYPE_REGULAR);
 }
 
 /*
- * Search for a global reference.
- * Add it if it does not exist.
+ * Drop the data of the current file, keeping what we need to get back to
+ * the position shown last.
  */
-static struct gref_t *lsp_gref_search(const char *name)
+static void lsp_file_evict()
 {
-	struct gref_t *ptr;
-	char *tmp_name;
+	lsp_debug("%s: dropping data of \"%s\" (%zu bytes)",
+		  __func__, cf->name, lsp_file_mem(cf));
 
-	tmp_name = strdup(name);
+	/* Files never shown are going to start at their beginning. */
+	if (cf->page_first == (off_t)-1)
+		cf->page_first = 0;
 
-	if (!lsp_man_case_sensitivity)
-		lsp_to_lower(tmp_name);
+	if (lsp_is_manpage())
+		cf->evicted_section = lsp_man_get_section(cf->page_first);
 
-	if (lsp_grefs) {
-		ptr = lsp_gref_find(tmp_name);
+	while (cf->renders != NULL)
+		lsp_man_render_drop(cf->renders);
 
-		if (ptr != NULL) {
-			free(tmp_name);
-			return ptr; /* gref already exists */
-		}
-	} else {
-		/*
-		 * If we have no grefs the hash table is also missing.
-		 */
-		int ret = hcreate(lsp_htable_entries);
+	lsp_mode_unset_toc();
+	lsp_toc_dtor(cf);
 
-		if (ret == 0)
-			lsp_error("hcreate(): %s", strerror(errno));
-	}
+	lsp_file_reset();
 
-	/* gref not found: add it. */
-	ptr = lsp_malloc(sizeof(struct gref_t));
-	ptr->name = tmp_name;   /* duplication already done. */
-	ptr->valid = -1;	/* not yet validated */
+	cf->do_reload = false;
+	cf->evicted = true;
+}
 
-	if (lsp_grefs)
-		ptr->next = lsp_grefs;
-	else
-		ptr->next = NULL;
+/*
+ * Get back the data of the current file if it was evicted.
+ */
+static void lsp_file_restore()
+{
+	if (!cf->evicted)
+		return;
+
+	lsp_debug("%s: restoring \"%s\"", __func__, cf->name);
 
-	lsp_grefs = ptr;
+	cf->evicted = false;
+
+	if (!lsp_is_manpage()) {
+		lsp_file_reread();
+		return;
+	}
 
-	lsp_debug("%s: gref created: %s", __func__, ptr->name);
+	struct file_t *file = cf;
+	char *saved_man_section = cf->evicted_section;
+	int width = cf->width;
 
-	/* Insert pointer to gref into hash table. */
-	lsp_gref_henter(ptr);
+	cf->evicted_section = NULL;
 
-	lsp_grefs_count++;
+	lsp_exec_man();
 
-	return ptr;
+	/* The manual page turned out to be another one already open. */
+	if (cf == file) {
+		/* Same width, same rendering: go back to the exact position. */
+		if (cf->width == width) {
+			lsp_file_read_to_pos(cf->page_first);
+			lsp_file_set_pos(cf->page_first);
+		} else {
+			lsp_man_reposition(saved_man_section);
+			cf->page_first = lsp_pos;
+		}
+	}
+
+	free(saved_man_section);
 }
 
 /*
- * Find a global reference or return NULL.
+ * Drop the data of files not shown for the longest time until all files
+ * fit into --max-mem again.
  */
-static struct gref_t *lsp_gref_find(char *name)
+static void lsp_files_evict()
 {
-	ENTRY e;
-	ENTRY *ep;
+	if (lsp_max_mem == 0)
+		return;
+
+	cf->used = ++lsp_files_clock;
+
+	while (1) {
+		struct file_t *file = cf;
+		struct file_t *victim = NULL;
+		size_t mem = 0;
+
+		do {
+			mem += lsp_file_mem(file);
 
-	e.key = name;
+			if (file != cf && lsp_file_evictable(file) &&
+			    (victim == NULL || file->used < victim->used))
+				victim = file;
 
-	ep = hsearch(e, FIND);
+			file = file->next;
+		} while (file != cf);
 
-	if (ep == NULL)
-		return (struct gref_t *)ep;
+		if (mem <= lsp_max_mem || victim == NULL)
+			return;
 
-	return (struct gref_t *)(ep->data);
+		cf = victim;
+		lsp_file_evict();
+		cf = file;
+	}
 }
 
 /*
- * Check if the given position is inside the given line.
+ * Reload content of current file.
+ *
+ * Currently, explicit reloading is supported only for regular files.
  *
- * Return:   0 if it is
- *         < 0 if pos is in a previous line (left of the given)
- *         > 0 if pos is in a following line (right of the given)
  */
-static int lsp_cmp_line_pos(size_t line_no, off_t pos)
+static void lsp_cmd_reload()
 {
-	off_t next;
-
-	if (cf->lines[line_no] > pos)
-		return -1;	/* pos is to the left of the given line */
-
-	/*
-	 * Here, we know: this line is either left of the given position or it
-	 * contains it.
-	 */
-
-	/*
-	 * Calculate start pos of next line.
-	 * Use current file size (seek) if we are looking at the last line.
-	 */
-	if (line_no + 1 == cf->lines_count)
-		next = cf->seek;
-	else
-		next = cf->lines[line_no + 1];
-
-	if (next > pos)
-		return 0;	/* Next line starts right of pos, so this line
-				 * must include it */
+	if (lsp_file_is_regular()) {
+		lsp_file_reread();
+		return;
+	}
 
-	return 1;		/* Pos is to the right of the given line */
+	lsp_file_set_pos(cf->page_first);
+	lsp_prompt = lsp_reload_not_supported;
+	return;
 }
 
 /*
- * Find the line number for a given position inside the file.
- * That number is returned 1-based.
+ * Get the regex for a search ready.
+ * get_string specifies if we need to read a search string after showing the
+ * prompt character.  If false lsp_search_string is already prepared.
  *
- * Search for the line in cf->lines array that starts at <= pos with
- * its following line starting at > pos.
+ * Return false if there is nothing to search for.
  */
-static size_t lsp_file_pos2line(off_t pos)
+static bool lsp_search_prepare(bool get_string, char prompt)
 {
-	size_t start;
-	size_t mid;
-	size_t end;
+	if (get_string) {
+		/* Read search string */
+		if (wmove(lsp_win, lsp_maxy - 1, 0) == ERR)
+			lsp_error("%s: wmove failed.", __func__);
+		wattr_set(lsp_win, A_NORMAL, LSP_DEFAULT_PAIR, NULL);
 
-	/* Empty files have no lines. */
-	if (cf->size == 0)
-		return 0;
+		mvwaddch(lsp_win, lsp_maxy - 1, 0, prompt);
 
-	if (pos > cf->seek) {
-		lsp_file_read_all();
+		wclrtoeol(lsp_win);
 
-		if (cf->size == LSP_FSIZE_UNKNOWN)
-			lsp_debug("%s: file %s: cf->size == 0 "
-				  "after reading the whole file.",
-				  __func__, cf->name);
-	}
+		wrefresh(lsp_win);
 
-	if (cf->size != LSP_FSIZE_UNKNOWN && pos > cf->size)
-		lsp_error("%s: cannot get a line number outside "
-			  "the size of the file: %ld vs. %ld\n",
-			  cf->name, cf->size, pos);
+		/* Save old search string if any */
+		if (*lsp_search_string != '\0')
+			strcpy(lsp_search_string_old, lsp_search_string);
 
-	if (pos == 0 || cf->lines_count == 1)
-		return 1;
+		curs_set(1);
+		echo();
+		mvwgetnstr(lsp_win, lsp_maxy - 1, 1, lsp_search_string,
+			   sizeof(lsp_search_string));
 
-	if (pos == cf->size)
-		return cf->lines_count;
+		lsp_remove_bs_from_string(lsp_search_string);
 
-	/*
-	 * Do a binary search in lines for the one containing the given
-	 * position.
-	 */
-	start = 0;
-	end = cf->lines_count - 1;
+		noecho();
+		curs_set(0);
+	}
 
-	while (start <= end) {
-		mid = (end + start) / 2;
+	if (*lsp_search_string == '\0')
+		if (*lsp_search_string_old != '\0')
+			strcpy(lsp_search_string, lsp_search_string_old);
+		else {
+			/* New and old search string are empty.
+			   Do nothing but turn off highlighting. */
+			lsp_mode_unset_highlight();
+			lsp_file_set_pos(cf->page_first);
+			return false;
+		}
+	else if (lsp_search_regex) {
+		regfree(lsp_search_regex);
+		free(lsp_search_regex);
+		lsp_search_regex = NULL;
+	}
 
-		int cmp = lsp_cmp_line_pos(mid, pos);
+	if (lsp_search_regex == NULL ) {
+		/* Compile regex if we got a new one. */
+		char *reg_err_text;
 
-		if (cmp == 0)
-			break;
+		reg_err_text = lsp_search_compile_regex(LSP_SEARCH_MODE);
 
-		if (cmp < 0)
-			end = mid - 1;
-		else
-			start = mid + 1;
+		if (reg_err_text) {
+			regfree(lsp_search_regex);
+			free(lsp_search_regex);
+			lsp_search_regex = NULL;
+			lsp_mode_unset_highlight();
+			waddstr(lsp_win, reg_err_text);
+			free(reg_err_text);
+			wgetch(lsp_win);
+			return false;
+		}
 	}
 
-	lsp_debug("%s (%s): pos %ld found in line #%ld",
-		  __func__, cf->name, pos, start + 1);
-
-	/* Return the line number 1-based. */
-	return mid + 1;
+	return true;
 }
 
 /*
- * Verify a reference.
- * Usually this means: check if it is known to man(1).
+ * Search command.
+ * get_string specifies if we need to read a search string.
+ * If false lsp_search_string is already prepared.
  */
-static bool lsp_ref_is_valid(struct gref_t *gref)
+static void lsp_cmd_search(bool get_string)
 {
-	int ret;
-	size_t cmd_len;
+	if (!lsp_search_prepare(get_string,
+				lsp_search_direction == LSP_FW ? '/' : '?'))
+		return;
+
+	cf->regex_p = lsp_search_regex;
+
+	if (lsp_search_direction == LSP_FW)
+		lsp_cmd_search_fw(LSP_SEARCH_MODE);
+	else
+		lsp_cmd_search_bw(LSP_SEARCH_MODE);
+}
+
+static void lsp_cmd_search_refs()
+{
+	lsp_search_compile_regex(LSP_REFS_MODE);
+
+	cf->regex_p = lsp_refs_regex;
+
+	if (lsp_search_direction == LSP_FW)
+		lsp_cmd_search_fw(LSP_REFS_MODE);
+	else
+		lsp_cmd_search_bw(LSP_REFS_MODE);
+}
 
-	/*
-	 * If apropos(1) is used for verification create the apropos buffer
-	 * which will add grefs for all its content.
-	 *
-	 * Save current file and mode, because they get reset by creating the
-	 * apropos file and then switching back to the current file.
-	 */
-	if (lsp_verify_with_apropos) {
-		char *current_cf = cf->name;
-		int current_mode = cf->mode;
+/*
+ * Write the given starts of lines with a match to the pipe of a search worker.
+ */
+static void lsp_search_files_write(int fd, const off_t *hits, size_t count)
+{
+	size_t len = count * sizeof(off_t);
+	size_t n = 0;
 
-		lsp_cmd_apropos();
+	while (n < len) {
+		ssize_t i = write(fd, (const char *)hits + n, len - n);
 
-		cf = lsp_file_find(current_cf);
-		lsp_mode_set(current_mode);
+		if (i == -1) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
 
-		return gref->valid == 1;
+		n += i;
 	}
+}
 
-	/* Duplicate verify command.
-	 * In a few moments, we need to replace %n by %s for sprintf(3) -- but
-	 * we don't want to do that in the original string. */
-	char *format = strdup(lsp_verify_command);
+/*
+ * Search worker for one file, running in a child process.
+ *
+ * The child has its own copy of lsp_search_regex and of the data of the file
+ * and is free to make the file the current one.  The start of each line with
+ * a match gets sent to the parent.
+ */
+static void lsp_search_files_worker(struct lsp_search_worker_t *worker, int fd)
+{
+	off_t hits[LSP_SEARCH_HITS_BATCH];
+	size_t count = 0;
+	off_t pos = 0;
+	struct lsp_arena_mark_t mark = lsp_arena_mark(&lsp_lines_arena);
 
-	/* Calculate length of command string.
-	 * First part is the length of the format string minus 4 bytes
-	 * conversion specifier. */
-	cmd_len = strlen(format) - 4;
+	cf = worker->file;
 
-	/* Next part is the length of gref name
-	   minus 2 bytes for parentheses plus one byte terminator. */
-	cmd_len += (strlen(gref->name) - 2) + 1;
+	while (pos < worker->end) {
+		struct lsp_line_t *line = lsp_line_from_data(pos, worker->end);
+		regmatch_t match;
 
-	char *command = lsp_malloc(cmd_len);
+		/* Like lsp_line_find_matches(): search without the newline. */
+		match.rm_so = 0;
+		match.rm_eo = line->nlen;
 
-	/* Now, position to the first placeholder so that we can check if
-	   name or section comes first. */
-	char *cptr = strchr(format, '%') + 1;
+		if (match.rm_eo > 0 && line->normalized[match.rm_eo - 1] == '\n')
+			match.rm_eo--;
 
-	if (cptr == (void *)1)
-		lsp_error("%s: no %% character in verify command.", __func__);
+		if (lsp_regexec(lsp_search_regex, line->normalized, 1, &match,
+				REG_STARTEND) == 0)
+			hits[count++] = pos;
 
-	/* Extract name and section from gref name. */
-	struct man_id m_id = lsp_man_id_ctor(gref->name);
+		pos += line->len;
+		lsp_line_dtor(line);
+		lsp_arena_release(&lsp_lines_arena, mark);
 
-	if (cptr[0] == 'n') {
-		cptr[0] = 's';
-		sprintf(command, format, m_id.name, m_id.section);
-	} else {
-		cptr = strchr(cptr, '%') + 1;
-		cptr[0] = 's';
-		sprintf(command, format, m_id.section, m_id.name);
+		if (count == LSP_SEARCH_HITS_BATCH) {
+			lsp_search_files_write(fd, hits, count);
+			count = 0;
+		}
 	}
 
-	lsp_man_id_dtor(&m_id);
-
-	ret = system(command);
-
-	lsp_debug("%s: reference %s is %s",
-		  __func__, command, ret == 0 ? "valid" : "invalid");
-
-	free(format);
-	free(command);
+	lsp_search_files_write(fd, hits, count);
 
-	return ret == 0;
+	_exit(0);
 }
 
 /*
- * Create a man_id structure with separate name and section strings.
- *
- * The given string s could have one of four formats:
- *
- * - "name(section)"
- * - "name.section"
- * - "section name"
- * - "name"
+ * Start a search worker for each file in the ring.
  *
- * In the last case, section will be set to "".
+ * Files that could block us we search in only as far as we have read them.
+ * Files without data (e.g. evicted ones) are skipped.
  *
- * Return the created structure.
+ * Return the number of workers stored in workers.
  */
-static struct man_id lsp_man_id_ctor(const char *s)
+static size_t lsp_search_files_start(struct lsp_search_worker_t *workers)
 {
-	struct man_id m_id;
-
-	char *nam;
-	size_t nam_len;
-	char *sec;
-	size_t sec_len;
-
-	lsp_debug("%s: create from \"%s\".", __func__, s);
-
-	/* Handle format "name(section)"
-	   Left and right parentheses mark the end of the name,
-	   the start of the section and the end of the section. */
-	char *lp = strchr(s, '(');
-	if (lp) {
-		char *rp = strchr(lp + 1, ')');
-
-		if (!rp)
-			lsp_error("%s: no right parenthesis found: \"%s\".",
-				  __func__, s);
+	struct file_t *current = cf;
+	struct file_t *file = cf;
+	size_t n = 0;
 
-		nam = (char *)s;
-		nam_len = 1 + lp - s;
-		sec = lp + 1;		/* section follows left parenthesis. */
-		sec_len = 1 + rp - sec;
+	do {
+		struct lsp_search_worker_t *worker = &workers[n];
+		int pipefd[2];
 
-		goto finish;
-	}
+		if (file->evicted || file->data == NULL) {
+			file = file->next;
+			continue;
+		}
 
-	/* Handle format "name.section" */
-	char *dot = strrchr(s, '.');
-	if (dot) {
-		nam = (char *)s;
-		nam_len = 1 + dot - s;
-		sec = dot + 1;
-		sec_len = 1 + strlen(sec);
+		cf = file;
 
-		goto finish;
-	}
+		if ((cf->ftype & (LSP_FTYPE_REGULAR | LSP_FTYPE_MANPAGE)) &&
+		    !(cf->ftype & (LSP_FTYPE_STDIN | LSP_FTYPE_APROPOS)))
+			while (!LSP_EOF)
+				lsp_file_add_block();
 
-	/* Handle format "section name" */
-	char *space = strchr(s, ' ');
-	if (space) {
-		nam = space + 1;
-		nam_len = 1 + strlen(nam);
-		sec = (char *)s;
-		sec_len = 1 + space - s;
+		worker->file = cf;
+		worker->end = lsp_file_data_end();
+		worker->hits = NULL;
+		worker->bytes = 0;
+		worker->size = 0;
 
-		goto finish;
-	}
+		cf = current;
 
-	/* Handle format "name" */
-	nam = (char *)s;
-	nam_len = strlen(s) + 1;
-	sec = "";
-	sec_len = 1;
+		if (pipe(pipefd) == -1)
+			lsp_error("%s: pipe(): %s", __func__, strerror(errno));
 
-finish:
-	/*
-	 * Fill final structure with prepared parts.
-	 */
-	m_id.name = lsp_calloc(1, nam_len);
-	m_id.section = lsp_calloc(1, sec_len);
+		worker->pid = fork();
 
-	memcpy(m_id.name, nam, nam_len - 1);
-	memcpy(m_id.section, sec, sec_len - 1);
+		if (worker->pid == -1)
+			lsp_error("%s: fork(): %s", __func__, strerror(errno));
 
-	lsp_debug("%s: result is \"%s.%s\".", __func__, m_id.name, m_id.section);
+		if (worker->pid == 0) {
+			close(pipefd[0]);
+			lsp_search_files_worker(worker, pipefd[1]);
+		}
 
-	return m_id;
-}
+		close(pipefd[1]);
+		worker->fd = pipefd[0];
 
-/*
- * Free memory used by a man_id.
- */
-static void lsp_man_id_dtor(struct man_id *m_id)
-{
-	if (!m_id)
-		return;
+		n++;
+		file = file->next;
+	} while (file != current);
 
-	free(m_id->section);
-	free(m_id->name);
+	return n;
 }
 
 /*
- * Compile regular expression for search.
+ * Collect the results of the search workers until all of them are done or a
+ * key gets pressed.
  *
- * Return NULL if successful, otherwise an error message.
+ * Return false if the search got interrupted.
  */
-static char *lsp_search_compile_regex(lsp_mode_t search_mode)
+static bool lsp_search_files_collect(struct lsp_search_worker_t *workers,
+				     size_t n)
 {
-	int ret;
+	struct pollfd *fds = lsp_malloc((n + 1) * sizeof(struct pollfd));
+	size_t active = n;
+	bool done = true;
+	size_t i;
 
-	if (search_mode == LSP_REFS_MODE) {
-		/* For references, we re-use the same regular expression.
-		   No need to compile it more than once. */
-		if (lsp_refs_regex == NULL) {
-			lsp_refs_regex = lsp_calloc(1, sizeof(regex_t));
+	while (active) {
+		nfds_t nfds = 1;
 
-			ret = regcomp(lsp_refs_regex, lsp_search_ref_string, REG_EXTENDED);
+		fds[0].fd = STDIN_FILENO;
+		fds[0].events = POLLIN;
 
-			/* No error handling here; we really should have a valid
-			   expression for refs in this program. */
-		}
+		for (i = 0; i < n; i++) {
+			if (workers[i].fd == -1)
+				continue;
 
-		/* In any case: return success. */
-		return NULL;
-	} else {
-		if (lsp_search_regex) {
-			regfree(lsp_search_regex);
-		} else {
-			lsp_search_regex = lsp_calloc(1, sizeof(regex_t));
+			fds[nfds].fd = workers[i].fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
 		}
-		int cflags = REG_EXTENDED | REG_NEWLINE;
-		if (!lsp_case_sensitivity)
-			cflags |= REG_ICASE;
 
-		ret = regcomp(lsp_search_regex, lsp_search_string, cflags);
-	}
+		if (poll(fds, nfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			lsp_error("%s: poll(2): %s", __func__, strerror(errno));
+		}
 
-	if (ret != 0) {
-		char *err_text;
-		size_t err_len = regerror(ret, lsp_search_regex, NULL, 0);
-		err_text = lsp_malloc(err_len);
-		regerror(ret, lsp_search_regex, err_text, err_len);
-		lsp_file_set_pos(cf->page_first);
-		return err_text;
-	}
+		if (fds[0].revents) {
+			/* Stop searching and show what we have so far. */
+			wgetch(lsp_win);
+			done = false;
+			break;
+		}
 
-	return NULL;
-}
+		for (i = 0, nfds = 1; i < n; i++) {
+			struct lsp_search_worker_t *worker = &workers[i];
+			ssize_t len;
 
-static void lsp_set_no_current_match()
-{
-	cf->current_match = lsp_no_match;
-}
+			if (worker->fd == -1)
+				continue;
 
-static bool lsp_file_is_regular()
-{
-	return cf->ftype & LSP_FTYPE_REGULAR;
-}
+			if (fds[nfds++].revents == 0)
+				continue;
 
-static bool lsp_file_is_stdin()
-{
-	return cf->ftype & LSP_FTYPE_STDIN;
-}
+			if (worker->size - worker->bytes <
+			    LSP_SEARCH_HITS_BATCH * sizeof(off_t)) {
+				worker->size = worker->size ? 2 * worker->size :
+					LSP_SEARCH_HITS_BATCH * sizeof(off_t);
+				worker->hits = lsp_realloc(worker->hits,
+							   worker->size);
+			}
 
-/*
- * Read content of file up to given pos or EOF, if the file is smaller.
- */
-static void lsp_file_read_to_pos(off_t pos)
-{
-	while (!LSP_EOF && cf->seek < pos)
-		lsp_file_add_block();
-}
+			len = read(worker->fd, (char *)worker->hits + worker->bytes,
+				   worker->size - worker->bytes);
 
-/*
- * Check if the given file is (still) readable.
- */
-static bool lsp_is_readable(char *path)
-{
-	return access(path, R_OK) == 0;
-}
+			if (len == -1) {
+				if (errno == EINTR)
+					continue;
+				lsp_error("%s: read(2): %s", __func__, strerror(errno));
+			}
 
-/*
- * Reread current regular file and try to position to the page last shown.
- */
-static void lsp_file_reread()
-{
-	/* Save position of last page shown. */
-	off_t old_page_first = cf->page_first;
+			if (len == 0) {
+				close(worker->fd);
+				worker->fd = -1;
+				active--;
+				continue;
+			}
 
-	if (!lsp_is_readable(cf->name)) {
-		lsp_prompt = "File is no longer readable.";
-		lsp_file_set_pos(cf->page_first);
-		return;
+			worker->bytes += len;
+		}
 	}
 
-	lsp_file_reset();
-	lsp_file_init();
-
-	/* Try to reread to the position we displayed last. */
-	lsp_file_read_to_pos(old_page_first);
-
-	lsp_debug("%s: reread file %s to pos %ld", __func__, cf->name, cf->size);
+	for (i = 0; i < n; i++) {
+		struct lsp_search_worker_t *worker = &workers[i];
 
-	/* If the file is now smaller, position to its last page. */
-	if (cf->seek <= old_page_first) {
-		lsp_cmd_goto_end();
-		cf->page_first = lsp_pos;
-	} else
-		cf->page_first = old_page_first;
+		/* Not SIGTERM, curses would restore the terminal on its way out. */
+		if (worker->fd != -1) {
+			kill(worker->pid, SIGKILL);
+			close(worker->fd);
+		}
 
-	lsp_file_set_pos(cf->page_first);
-	return;
-}
+		while (waitpid(worker->pid, NULL, 0) == -1)
+			if (errno != EINTR)
+				break;
 
-/*
- * Reload content of current file.
- *
- * Currently, explicit reloading is supported only for regular files.
- *
- */
-static void lsp_cmd_reload()
-{
-	if (lsp_file_is_regular()) {
-		lsp_file_reread();
-		return;
+		/* Drop a partially read line start of an interrupted worker. */
+		worker->bytes -= worker->bytes % sizeof(off_t);
 	}
 
-	lsp_file_set_pos(cf->page_first);
-	lsp_prompt = lsp_reload_not_supported;
-	return;
+	free(fds);
+
+	return done;
 }
 
 /*
- * Search command.
- * get_string specifies if we need to read a search string.
- * If false lsp_search_string is already prepared.
+ * Add a line for the given match to the current file, i.e. the list of
+ * search results: file name, line number and the line itself as far as it
+ * fits the window.
  */
-static void lsp_cmd_search(bool get_string)
+static void lsp_search_files_add_hit(struct lsp_search_worker_t *worker,
+				     off_t pos)
 {
-	if (get_string) {
-		/* Read search string */
-		if (wmove(lsp_win, lsp_maxy - 1, 0) == ERR)
-			lsp_error("%s: wmove failed.", __func__);
-		wattr_set(lsp_win, A_NORMAL, LSP_DEFAULT_PAIR, NULL);
+	struct file_t *results = cf;
+	char *name = worker->file->name;
+	struct lsp_arena_mark_t mark = lsp_arena_mark(&lsp_lines_arena);
+	struct lsp_line_t *line;
+	size_t lnum, prefix, len, i;
+	char *text;
 
-		if (lsp_search_direction == LSP_FW)
-			mvwaddch(lsp_win, lsp_maxy - 1, 0, '/');
-		else
-			mvwaddch(lsp_win, lsp_maxy - 1, 0, '?');
+	cf = worker->file;
+	lnum = lsp_file_pos2line(pos);
+	line = lsp_line_from_data(pos, worker->end);
+	cf = results;
 
-		wclrtoeol(lsp_win);
+	if (*name == '\0')
+		name = "*stdin*";
 
-		wrefresh(lsp_win);
+	len = line->nlen;
 
-		/* Save old search string if any */
-		if (*lsp_search_string != '\0')
-			strcpy(lsp_search_string_old, lsp_search_string);
+	if (len > 0 && line->normalized[len - 1] == '\n')
+		len--;
 
-		curs_set(1);
-		echo();
-		mvwgetnstr(lsp_win, lsp_maxy - 1, 1, lsp_search_string,
-			   sizeof(lsp_search_string));
+	text = lsp_malloc(strlen(name) + 32 + len + 2);
+	prefix = sprintf(text, "%s:%zu: ", name, lnum);
 
-		lsp_remove_bs_from_string(lsp_search_string);
+	/* Keep it to one line in the window.  Cut at a character boundary. */
+	if (prefix + len > (size_t)lsp_maxx - 1) {
+		len = prefix < (size_t)lsp_maxx - 1 ? lsp_maxx - 1 - prefix : 0;
 
-		noecho();
-		curs_set(0);
+		while (len > 0 && (line->normalized[len] & 0xc0) == 0x80)
+			len--;
 	}
 
-	if (*lsp_search_string == '\0')
-		if (*lsp_search_string_old != '\0')
-			strcpy(lsp_search_string, lsp_search_string_old);
-		else {
-			/* New and old search string are empty.
-			   Do nothing but turn off highlighting. */
-			lsp_mode_unset_highlight();
-			lsp_file_set_pos(cf->page_first);
-			return;
-		}
-	else if (lsp_search_regex) {
-		regfree(lsp_search_regex);
-		free(lsp_search_regex);
-		lsp_search_regex = NULL;
+	for (i = 0; i < len; i++) {
+		unsigned char c = line->normalized[i];
+
+		text[prefix + i] = (c < ' ' || c == 0x7f) ? ' ' : c;
 	}
 
-	if (lsp_search_regex == NULL ) {
-		/* Compile regex if we got a new one. */
-		char *reg_err_text;
+	text[prefix + len] = '\n';
 
-		reg_err_text = lsp_search_compile_regex(LSP_SEARCH_MODE);
+	lsp_file_add_line(text);
 
-		if (reg_err_text) {
-			regfree(lsp_search_regex);
-			free(lsp_search_regex);
-			lsp_search_regex = NULL;
-			lsp_mode_unset_highlight();
-			waddstr(lsp_win, reg_err_text);
-			free(reg_err_text);
-			wgetch(lsp_win);
-			return;
-		}
-	}
+	free(text);
+	lsp_line_dtor(line);
+	lsp_arena_release(&lsp_lines_arena, mark);
+}
+
+/*
+ * Search all open files for a pattern.
+ *
+ * Each file gets searched by its own child process so the files don't need
+ * to wait for each other.  We list all matching lines in a new file and let
+ * the user select one of them.  The selected match then becomes the current
+ * match in its file.
+ */
+static void lsp_cmd_search_files()
+{
+	struct lsp_search_worker_t *workers;
+	size_t n_files = 0;
+	size_t n, hits, i, j;
+	struct file_t *file = cf;
+	bool done;
+	char *prompt;
+
+	if (!lsp_search_prepare(true, '/'))
+		return;
 
 	cf->regex_p = lsp_search_regex;
 
-	if (lsp_search_direction == LSP_FW)
-		lsp_cmd_search_fw(LSP_SEARCH_MODE);
-	else
-		lsp_cmd_search_bw(LSP_SEARCH_MODE);
-}
+	do {
+		n_files++;
+		file = file->next;
+	} while (file != cf);
 
-static void lsp_cmd_search_refs()
-{
-	lsp_search_compile_regex(LSP_REFS_MODE);
+	lsp_prompt = "Searching all files... (any key to stop)";
+	lsp_create_status_line();
 
-	cf->regex_p = lsp_refs_regex;
+	workers = lsp_malloc(n_files * sizeof(struct lsp_search_worker_t));
+	n = lsp_search_files_start(workers);
+	done = lsp_search_files_collect(workers, n);
 
-	if (lsp_search_direction == LSP_FW)
-		lsp_cmd_search_fw(LSP_REFS_MODE);
+	for (i = 0, hits = 0; i < n; i++)
+		hits += workers[i].bytes / sizeof(off_t);
+
+	lsp_file_set_pos(cf->page_first);
+
+	if (hits == 0) {
+		lsp_prompt = done ? lsp_not_found : "Interrupted";
+		goto out;
+	}
+
+	lsp_file_add("Search results", 1);
+
+	for (i = 0; i < n; i++)
+		for (j = 0; j < workers[i].bytes / sizeof(off_t); j++)
+			lsp_search_files_add_hit(&workers[i], workers[i].hits[j]);
+
+	if (done)
+		prompt = "Select match and press ENTER.";
 	else
-		lsp_cmd_search_bw(LSP_REFS_MODE);
+		prompt = "Interrupted. Select match and press ENTER.";
+
+	size_t line_index = lsp_cmd_select_line(prompt, 0);
+
+	lsp_file_kill();
+
+	if (line_index == (size_t)-1)
+		goto out;
+
+	/* Find the worker and the match of the selected line. */
+	for (i = 0; line_index >= workers[i].bytes / sizeof(off_t); i++)
+		line_index -= workers[i].bytes / sizeof(off_t);
+
+	if (workers[i].file != cf) {
+		lsp_file_move_here(workers[i].file);
+		cf = cf->prev;
+	}
+
+	/* Search from the selected line to make its match the current one. */
+	lsp_mode_unset_toc();
+	lsp_set_no_current_match();
+	cf->page_first = workers[i].hits[line_index];
+	cf->regex_p = lsp_search_regex;
+	lsp_cmd_search_fw(LSP_SEARCH_MODE);
+
+out:
+	for (i = 0; i < n; i++)
+		free(workers[i].hits);
+
+	free(workers);
 }
 
 static bool lsp_is_no_match(regmatch_t match)
@@ -3363,7 +6405,7 @@ static void lsp_cmd_search_bw(lsp_mode_t search_mode)
 	else
 		if (lsp_mode_is_toc()) {
 			cf->toc = cf->toc_first;
-			lsp_file_set_pos(cf->toc->pos);
+			lsp_file_set_pos(LSP_TOC(cf->toc).pos);
 		} else
 			lsp_file_set_pos(cf->page_first);
 
@@ -3376,22 +6418,26 @@ static void lsp_cmd_search_bw(lsp_mode_t search_mode)
 	lsp_prompt = "Searching...";
 	lsp_create_status_line();
 
-	/* Find match backwards.
-	   If we are in the middle of a line we cut the tail
-	   starting from the previous match and start with inspecting the
-	   remaining part of the line.
-	   Otherwise we inspect the previous line. */
-	if (lsp_is_at_bol())
-		line = lsp_file_get_prev_line();
-	else {
-		line = lsp_get_this_line();
-		lsp_line_cut_tail(line, cf->current_match.rm_so);
-	}
-
 	lsp_mode_set(search_mode);
 
-	regmatch_t pos = lsp_line_get_last_match(&line);
-	lsp_line_dtor(line);
+	regmatch_t pos;
+
+	if (!lsp_matches_search_prev(&pos)) {
+		/* Find match backwards.
+		   If we are in the middle of a line we cut the tail
+		   starting from the previous match and start with inspecting
+		   the remaining part of the line.
+		   Otherwise we inspect the previous line. */
+		if (lsp_is_at_bol())
+			line = lsp_file_get_prev_line();
+		else {
+			line = lsp_get_this_line();
+			line = lsp_line_cut_tail(line, cf->current_match.rm_so);
+		}
+
+		pos = lsp_line_get_last_match(&line);
+		lsp_line_dtor(line);
+	}
 
 	if (lsp_is_no_match(pos)) {
 		lsp_prompt = lsp_not_found;
@@ -3409,19 +6455,33 @@ static void lsp_cmd_search_bw(lsp_mode_t search_mode)
 }
 
 /*
- * Cut tail starting at t_pos off the given line
+ * Cut tail starting at t_pos off the given line.
+ *
+ * The line could be shared with the line cache, so we release it and return
+ * a private copy of its head.
  */
-static void lsp_line_cut_tail(struct lsp_line_t *line, off_t t_pos)
+static struct lsp_line_t *lsp_line_cut_tail(struct lsp_line_t *line, off_t t_pos)
 {
+	struct lsp_line_t *head;
+
 	if (t_pos < line->pos ||
 	    t_pos > line->pos + line->len)
 		lsp_error("%s: dangerous position %ld to "
 			  "cut the current line [%ld..%ld].\n",
 			  __func__, t_pos, line->pos, line->pos + line->len);
 
-	line->len = t_pos - line->pos;
-	free(line->normalized);
-	line->normalized = lsp_normalize(line->raw, line->len, &line->nlen);
+	head = lsp_line_ctor();
+	head->pos = line->pos;
+	head->len = t_pos - line->pos;
+	head->raw = lsp_malloc(head->len + 1);
+	memcpy(head->raw, line->raw, head->len);
+	head->current = head->raw;
+	head->normalized = lsp_normalize(head->raw, head->len, &head->nlen,
+					 &head->nmap, &head->n_nmap, NULL);
+
+	lsp_line_dtor(line);
+
+	return head;
 }
 
 /*
@@ -3454,7 +6514,7 @@ static void lsp_cmd_search_fw(lsp_mode_t search_mode)
 		/* Search starts at top of page */
 		if (lsp_mode_is_toc()) {
 			cf->toc = cf->toc_first;
-			lsp_file_set_pos(cf->toc->pos);
+			lsp_file_set_pos(LSP_TOC(cf->toc).pos);
 		} else {
 			lsp_file_set_pos(cf->page_first);
 		}
@@ -3481,7 +6541,7 @@ static void lsp_cmd_search_fw(lsp_mode_t search_mode)
 		if (search_mode == LSP_SEARCH_MODE)
 			break;
 
-		bool valid = lsp_validate_ref_at_pos(pos);
+		bool valid = lsp_validate_ref_at_pos_wait(pos);
 
 		if (valid)
 			break;
@@ -3530,7 +6590,7 @@ static struct gref_t *lsp_get_gref_at_pos(regmatch_t pos)
 		lsp_normalize2str(ref_start, pos.rm_eo - pos.rm_so);
 
 	/* Create gref or get existing one. */
-	struct gref_t *gref = lsp_gref_search(ref_name);
+	struct gref_t *gref = lsp_gref_search(ref_name, strlen(ref_name));
 
 	free(ref_name);
 	lsp_line_dtor(line);
@@ -3546,12 +6606,38 @@ static bool lsp_validate_ref_at_pos(regmatch_t pos)
 	if (!lsp_verify)
 		return true;
 
-	if (gref->valid == -1)
-		gref->valid = lsp_ref_is_valid(gref);
+	/* Verify it together with its neighbours. */
+	if (gref->valid == -1 && !lsp_verify_with_apropos)
+		lsp_refs_verify_around(pos.rm_so);
+
+	if (gref->valid == -1) {
+		bool valid = lsp_ref_is_valid(gref);
+
+		/* Apropos output still coming in might know it later. */
+		if (!valid && lsp_verify_with_apropos && lsp_apropos_pending())
+			return false;
+
+		gref->valid = valid;
+	}
 
 	return gref->valid;
 }
 
+/*
+ * Like lsp_validate_ref_at_pos() but wait for apropos output that might
+ * still validate the reference.  Used when navigating references.
+ * A key pressed by the user stops waiting.
+ */
+static bool lsp_validate_ref_at_pos_wait(regmatch_t pos)
+{
+	bool valid = lsp_validate_ref_at_pos(pos);
+
+	while (!valid && lsp_apropos_ingest(-1))
+		valid = lsp_validate_ref_at_pos(pos);
+
+	return valid;
+}
+
 /*
  * Upper level aligninment of search matches.
  *
@@ -3615,9 +6701,10 @@ static void lsp_search_align_toc_to_match()
 
 	size_t match_line = lsp_file_pos2line(cf->current_match.rm_so);
 
-	size_t bottom_line = lsp_file_pos2line(cf->toc_last ? cf->toc_last->pos : cf->size - 1);
+	size_t bottom_line = lsp_file_pos2line(cf->toc_last != LSP_TOC_NONE ?
+						 LSP_TOC(cf->toc_last).pos : cf->size - 1);
 
-	if (match_line == bottom_line && cf->toc_last) {
+	if (match_line == bottom_line && cf->toc_last != LSP_TOC_NONE) {
 		cf->toc = cf->toc_first;
 		lsp_toc_fw(lsp_maxy / 2);
 	} else if (lsp_pos_is_current_page(cf->current_match.rm_so) == TRUE) {
@@ -3653,7 +6740,7 @@ static void lsp_search_align_page_to_match()
 		lsp_file_set_pos(cf->page_first);
 	else {
 		/* pos2line gives us 1-based line numbers! */
-		lsp_file_set_pos(cf->lines[match_line - 1]);
+		lsp_file_set_pos(lsp_lines_get(match_line - 1));
 		lsp_file_backward(lsp_maxy / 2);
 	}
 }
@@ -3690,9 +6777,9 @@ static bool lsp_pos_is_current_page(off_t pos)
 		return (cf->page_first <= pos && cf->page_last > pos);
 
 	/* TOC mode. */
-	if (cf->toc_first->pos <= pos &&
-	    /* Last TOC entry is on this page if cf->toc_last == NULL */
-	    (!cf->toc_last || cf->toc_last->pos > pos)) {
+	if (LSP_TOC(cf->toc_first).pos <= pos &&
+	    /* Last TOC entry is on this page if cf->toc_last == LSP_TOC_NONE */
+	    (cf->toc_last == LSP_TOC_NONE || LSP_TOC(cf->toc_last).pos > pos)) {
 		/*
 		 * Our answer could be "true".
 		 * Test for visibility, i.e. pos must be part of a currently
@@ -3717,9 +6804,42 @@ static void lsp_cmd_goto_start()
  */
 static void lsp_cmd_goto_end()
 {
-	lsp_file_read_all();
+	/* Slow input could keep us waiting for EOF forever.
+	   Show progress and let the user stop it with any key. */
+	while (!LSP_EOF) {
+		if (lsp_file_ingest(-1)) {
+			lsp_prompt = "Reading... (any key to stop)";
+			lsp_create_status_line();
+			continue;
+		}
+
+		if (LSP_EOF)
+			break;
+
+		nodelay(lsp_win, true);
+		int cmd = wgetch(lsp_win);
+		nodelay(lsp_win, false);
+
+		if (cmd == KEY_RESIZE)
+			lsp_cmd_resize();
+
+		if (cmd == ERR || cmd == KEY_RESIZE)
+			continue;
+
+		/* Show what we have so far. */
+		lsp_prompt = "Interrupted";
+		break;
+	}
 
-	lsp_file_set_pos(cf->size);
+	lsp_file_goto_data_end();
+}
+
+/*
+ * Go to the last page of the data we can show without waiting for input.
+ */
+static void lsp_file_goto_data_end()
+{
+	lsp_file_set_pos(lsp_file_data_end());
 
 	if (lsp_chop_lines)
 		lsp_file_backward(0);
@@ -3727,6 +6847,23 @@ static void lsp_cmd_goto_end()
 		lsp_goto_last_wpage();
 }
 
+/*
+ * Return the end of the current file's data that we can show without
+ * waiting for more input: EOF or the end of the last complete line.
+ */
+static off_t lsp_file_data_end()
+{
+	off_t last = cf->seek - 1;
+
+	if (LSP_EOF || cf->seek == 0)
+		return cf->seek;
+
+	if (cf->blocks[last / cf->blksize]->buffer[last % cf->blksize] == '\n')
+		return cf->seek;
+
+	return lsp_lines_get(cf->lines_count - 1);
+}
+
 /*
  * Find all matches in a line and store them in an array of type
  * regmatch_t.  We allocate the needed memory, the caller must free()
@@ -3736,21 +6873,34 @@ static void lsp_cmd_goto_end()
  */
 static size_t lsp_line_get_matches(const struct lsp_line_t *line, regmatch_t **pmatch)
 {
-	size_t i = 0;
-	size_t pmatch_len = 0;
-
 	/* There are no matches if we aren't searching. */
 	if (lsp_mode_is_highlight() == false)
 		return 0;
 
+	if (lsp_matches_covers(line))
+		return lsp_matches_get(line, pmatch);
+
+	return lsp_line_find_matches(line, pmatch);
+}
+
+/*
+ * Worker for lsp_line_get_matches(): find all matches of cf->regex_p in the
+ * given line.
+ */
+static size_t lsp_line_find_matches(const struct lsp_line_t *line, regmatch_t **pmatch)
+{
+	size_t i = 0;
+	size_t pmatch_len = 0;
+
 	/*
 	 * We want to search in lines without newline characters (\n), because
 	 * they bring in the empty string at the beginning of the next line as
 	 * well.  Also, they aren't needed to match the end of the line.
 	 *
-	 * Duplicate the normalized line and remove the final \n.
+	 * With REG_STARTEND we simply leave it out of the searched range, no
+	 * need for a copy of the normalized line.
 	 */
-	char *sstring = lsp_mdup(line->normalized, line->nlen - 1);
+	const char *sstring = line->normalized;
 	size_t slen = line->nlen - 1;
 
 	/* Allocate memory for max possible number of matches and that
@@ -3763,7 +6913,7 @@ static size_t lsp_line_get_matches(const struct lsp_line_t *line, regmatch_t **p
 	/* Initialize the end-of-matches marker. */
 	(*pmatch)[pmatch_len - 1] = lsp_no_match;
 
-	char *ptr = sstring;
+	const char *ptr = sstring;
 
 	/* Collect all pattern matches in this line */
 	for (i = 0; i < pmatch_len; i++) {
@@ -3777,7 +6927,7 @@ static size_t lsp_line_get_matches(const struct lsp_line_t *line, regmatch_t **p
 		(*pmatch)[i].rm_so = 0;
 		(*pmatch)[i].rm_eo = slen - (ptr - sstring);
 
-		if (regexec(cf->regex_p, ptr, 1, *pmatch + i, eflags)) {
+		if (lsp_regexec(cf->regex_p, ptr, 1, *pmatch + i, eflags)) {
 			/* No more hits: mark end of matches. */
 			(*pmatch)[i].rm_so = (off_t)-1;
 			(*pmatch)[i].rm_eo = (off_t)-1;
@@ -3797,10 +6947,8 @@ static size_t lsp_line_get_matches(const struct lsp_line_t *line, regmatch_t **p
 
 		/* Compute offsets for raw data, because it is the
 		   one that we need to do highlighting for. */
-		(*pmatch)[i].rm_so = lsp_normalize_count(line->raw, line->len,
-						       (*pmatch)[i].rm_so);
-		(*pmatch)[i].rm_eo = lsp_normalize_count(line->raw, line->len,
-						       (*pmatch)[i].rm_eo);
+		(*pmatch)[i].rm_so = lsp_line_n2raw(line, (*pmatch)[i].rm_so);
+		(*pmatch)[i].rm_eo = lsp_line_n2raw(line, (*pmatch)[i].rm_eo);
 
 		/* For references: only mark valid ones. */
 		if (cf->regex_p == lsp_refs_regex) {
@@ -3814,7 +6962,6 @@ static size_t lsp_line_get_matches(const struct lsp_line_t *line, regmatch_t **p
 		}
 	}
 
-	free(sstring);
 	return i;
 }
 
@@ -3904,72 +7051,263 @@ static struct lsp_line_t *lsp_get_next_display_line()
 	struct lsp_line_t *line;
 
 	if (lsp_mode_is_toc()) {
-		/* Search next TOC line with level <= active level. */
-		while (cf->toc->level > cf->current_toc_level) {
-			if (cf->toc->next)
-				cf->toc = cf->toc->next;
-		}
+		/* Next TOC line with level <= active level. */
+		size_t toc = lsp_toc_visible(lsp_toc_rank(cf->toc));
 
-		if (cf->toc->level > cf->current_toc_level) {
+		if (toc == LSP_TOC_NONE) {
 			/* No more TOC entries in this level. */
 			line = NULL;
 		} else {
-			line = lsp_get_line_at_pos(cf->toc->pos);
+			cf->toc = toc;
+			line = lsp_get_line_at_pos(LSP_TOC(cf->toc).pos);
 
 			if (!line)
 				lsp_error("%s: could not get line at pos %ld",
-					  __func__, cf->toc->pos);
+					  __func__, LSP_TOC(cf->toc).pos);
 		}
 	} else {
 		/* No TOC mode; just return next line in file. */
 		line = lsp_get_line_from_here();
 	}
 
-	return line;
+	return line;
+}
+
+/*
+ * For a tail of a line: handle SGR sequences in the heading part of that line.
+ *
+ * Return 0 if we didn't find an SGR sequence, != 0 otherwise.
+ */
+static int lsp_line_handle_leading_sgr(attr_t *attr, short *pair)
+{
+	int ret_val = 0;
+
+	off_t old_pos = lsp_pos;
+
+	struct lsp_line_t *line = lsp_get_this_line();
+
+	assert(line->len > (old_pos - line->pos));
+
+	/* Only look at the part before the tail. */
+	size_t len = old_pos - line->pos;
+
+	size_t li = 0;
+
+	while (li < len) {
+		while (lsp_is_sgr_sequence(line->raw + li)) {
+			size_t l;
+			/* Get attributes according to SGR sequence. */
+			l = lsp_decode_sgr(line->raw + li, attr, pair);
+
+			/* Only use correct SGR sequences. */
+			if (l != (size_t)-1) {
+				if (l > 1)
+					ret_val = 1;
+				li += l;
+			} else
+				break;
+		}
+		/* Skip next possible multibyte sequence in the line. */
+		li += lsp_mblen(line->raw + li, len - li);
+	}
+
+	lsp_line_dtor(line);
+	lsp_file_set_pos(old_pos);
+
+	return ret_val;
+}
+
+/*
+ * Forget about the page in the window, the next one is drawn completely.
+ */
+static void lsp_page_invalidate()
+{
+	lsp_page.file = NULL;
+}
+
+/*
+ * Remember the start of window line y.
+ */
+static void lsp_page_row(int y, off_t pos, bool bol)
+{
+	lsp_page.rows[y] = pos;
+	lsp_page.bol[y] = bol;
+
+	/* The window line before is done (if we drew it). */
+	if (y > lsp_page.first)
+		lsp_page.last[y - 1] = cf->page_last;
+}
+
+/*
+ * Count the window lines from position from to position to.
+ *
+ * Return -1 if to isn't the start of one of the next max window lines.
+ */
+static int lsp_page_count_rows(off_t from, off_t to, int max)
+{
+	struct lsp_line_t *line;
+	int n = 0;
+	int ret = -1;
+
+	lsp_file_set_pos(from);
+
+	while (n < max && (line = lsp_get_line_from_here()) != NULL) {
+		size_t rows = 1;
+
+		if (!lsp_chop_lines && line->len > 1) {
+			lsp_line_add_wlines(line);
+			rows = line->n_wlines;
+		}
+
+		for (size_t i = 0; i < rows && n < max; i++, n++) {
+			off_t pos = line->pos + line->wlines[i];
+
+			if (pos >= to) {
+				if (pos == to)
+					ret = n;
+				max = 0;
+				break;
+			}
+		}
+
+		lsp_line_dtor(line);
+	}
+
+	lsp_file_set_pos(from);
+
+	return ret;
+}
+
+/*
+ * Tell if the window lines from y on are kept from the last page and drawing
+ * can stop.
+ */
+static bool lsp_page_is_kept(int y)
+{
+	if (lsp_page.kept == 0 || y < lsp_page.kept || y > lsp_page.n_rows)
+		return false;
+
+	/* Draw a new current match to get its cursor position. */
+	if (lsp_page.dirty != (off_t)-1 && lsp_pos <= lsp_page.dirty)
+		return false;
+
+	return lsp_page.bol[y] && lsp_page.rows[y] == lsp_pos;
 }
 
 /*
- * For a tail of a line: handle SGR sequences in the heading part of that line.
+ * Compare the page to show at the current position with the one in the
+ * window.  If they overlap, scroll the window and its window lines.
  *
- * Return 0 if we didn't find an SGR sequence, != 0 otherwise.
- */
-static int lsp_line_handle_leading_sgr(attr_t *attr, short *pair)
-{
-	int ret_val = 0;
+ * Return the window line to start drawing at.  The current position then is
+ * where that window line starts.
+ */
+static int lsp_page_scroll()
+{
+	off_t first = lsp_pos;
+	int max = lsp_maxy - 1;
+	int n = lsp_page.n_rows;
+	int k, j;
+
+	if (lsp_page.size < lsp_maxy + 1) {
+		lsp_page.size = lsp_maxy + 1;
+		lsp_page.rows = lsp_realloc(lsp_page.rows,
+					    lsp_page.size * sizeof(lsp_page.rows[0]));
+		lsp_page.bol = lsp_realloc(lsp_page.bol,
+					   lsp_page.size * sizeof(lsp_page.bol[0]));
+		lsp_page.last = lsp_realloc(lsp_page.last,
+					    lsp_page.size * sizeof(lsp_page.last[0]));
+	}
+
+	lsp_page.first = 0;
+	lsp_page.kept = 0;
+	lsp_page.dirty = (off_t)-1;
+
+	if (lsp_page.file != cf || lsp_mode_is_toc() ||
+	    lsp_page.maxx != lsp_maxx || lsp_page.maxy != lsp_maxy ||
+	    lsp_page.shift != lsp_shift || lsp_page.mode != cf->mode ||
+	    lsp_page.regex_p != cf->regex_p)
+		return 0;
 
-	off_t old_pos = lsp_pos;
+	if (lsp_mode_is_highlight() && lsp_is_a_match(cf->current_match) &&
+	    cf->current_match.rm_so != lsp_page.current_match.rm_so)
+		lsp_page.dirty = cf->current_match.rm_so;
 
-	struct lsp_line_t *line = lsp_get_this_line();
+	/* Moving forward: the page starts with one of its window lines. */
+	for (k = 1; k < n; k++)
+		if (lsp_page.rows[k] == first)
+			break;
 
-	assert(line->len > (old_pos - line->pos));
+	if (k < n) {
+		/* Draw from the beginning of the line that continues below
+		   the page or has a new current match. */
+		for (j = n; j >= k; j--) {
+			if (!lsp_page.bol[j])
+				continue;
+
+			if (lsp_page.dirty < first || lsp_page.rows[j] <= lsp_page.dirty)
+				break;
+		}
 
-	/* Terminate line where the tail starts. */
-	line->len = old_pos - line->pos;
+		if (j < k)
+			return 0;
 
-	size_t li = 0;
+		lsp_debug("%s: scrolling %d window lines forward", __func__, k);
 
-	while (li < line->len) {
-		while (lsp_is_sgr_sequence(line->raw + li)) {
-			size_t l;
-			/* Get attributes according to SGR sequence. */
-			l = lsp_decode_sgr(line->raw + li, attr, pair);
+		scrollok(lsp_win, TRUE);
+		wsetscrreg(lsp_win, 0, max - 1);
+		wscrl(lsp_win, k);
+		wsetscrreg(lsp_win, 0, max);
+		scrollok(lsp_win, FALSE);
 
-			/* Only use correct SGR sequences. */
-			if (l != (size_t)-1) {
-				if (l > 1)
-					ret_val = 1;
-				li += l;
-			} else
-				break;
-		}
-		/* Skip next possible multibyte sequence in the line. */
-		li += lsp_mblen(line->raw + li, line->len - li);
+		memmove(lsp_page.rows, lsp_page.rows + k,
+			(n - k + 1) * sizeof(lsp_page.rows[0]));
+		memmove(lsp_page.bol, lsp_page.bol + k,
+			(n - k + 1) * sizeof(lsp_page.bol[0]));
+		memmove(lsp_page.last, lsp_page.last + k,
+			(n - k) * sizeof(lsp_page.last[0]));
+
+		lsp_page.n_rows = n - k;
+		lsp_page.first = j - k;
+		cf->cmatch_y -= k;
+
+		lsp_file_set_pos(lsp_page.rows[lsp_page.first]);
+
+		return lsp_page.first;
 	}
 
-	lsp_line_dtor(line);
-	lsp_file_set_pos(old_pos);
+	/* Moving backward: the page goes on with the first window line. */
+	if (first >= lsp_page.rows[0])
+		return 0;
 
-	return ret_val;
+	k = lsp_page_count_rows(first, lsp_page.rows[0], max);
+
+	if (k <= 0)
+		return 0;
+
+	lsp_debug("%s: scrolling %d window lines backward", __func__, k);
+
+	scrollok(lsp_win, TRUE);
+	wsetscrreg(lsp_win, 0, max - 1);
+	wscrl(lsp_win, -k);
+	wsetscrreg(lsp_win, 0, max);
+	scrollok(lsp_win, FALSE);
+
+	/* Window lines scrolled out at the bottom are dropped. */
+	if (n > max - k)
+		n = max - k;
+
+	memmove(lsp_page.rows + k, lsp_page.rows,
+		(n + 1) * sizeof(lsp_page.rows[0]));
+	memmove(lsp_page.bol + k, lsp_page.bol,
+		(n + 1) * sizeof(lsp_page.bol[0]));
+	memmove(lsp_page.last + k, lsp_page.last,
+		n * sizeof(lsp_page.last[0]));
+
+	lsp_page.n_rows = n + k;
+	lsp_page.kept = k;
+	cf->cmatch_y += k;
+
+	return 0;
 }
 
 /*
@@ -3989,9 +7327,12 @@ static void lsp_display_page()
 	cchar_t cchar_ch[2];
 
 	int y, x;
-
-	/* Remember if the text has SGR sequences in it. */
-	char sgr_active = 0;
+	/* Last window line we know the start of. */
+	int row = -1;
+	/* Window lines below the drawn ones are kept. */
+	bool kept = false;
+	bool chained = false;
+	int cmatch_y, cmatch_x;
 
 	regmatch_t *pmatch = NULL;
 	struct lsp_line_t *line = NULL;
@@ -4008,9 +7349,16 @@ static void lsp_display_page()
 
 	y = x = 0;		/* Start in upper left corner */
 
-	/* Reload file if necessary, e.g. after a resize. */
-	if (cf->do_reload)
-		lsp_file_reload();
+	/* We might just have switched to a file that got truncated. */
+	lsp_file_check_truncated();
+
+	/* Bring back data dropped for --max-mem. */
+	lsp_file_restore();
+
+	/* Use a rendering for the current width if we have one. */
+	lsp_man_render_update();
+
+	lsp_files_evict();
 
 	if (!lsp_mode_is_toc()) {
 		/* Nothing to display at EOF. */
@@ -4021,6 +7369,11 @@ static void lsp_display_page()
 		cf->page_first = lsp_pos;
 	}
 
+	/* Only draw what isn't in the window already. */
+	y = lsp_page_scroll();
+
+	cmatch_y = cf->cmatch_y;
+	cmatch_x = cf->cmatch_x;
 	lsp_invalidate_cm_cursor();
 
 	/*
@@ -4032,13 +7385,24 @@ static void lsp_display_page()
 		 */
 		bool cr_active = false;
 
+		/* Remember if the line has SGR sequences in it. */
+		char sgr_active = 0;
+
+		if (!x && lsp_page_is_kept(y)) {
+			lsp_page.last[y - 1] = cf->page_last;
+			kept = true;
+			break;
+		}
+
+		bool bol = lsp_is_at_bol();
+
 		attr = A_NORMAL;
 		pair = LSP_DEFAULT_PAIR;
 
 		/* If we have long lines that consume multiple lines on the page
 		   we need to process SGR sequences that might be in the
 		   previous part of the line. */
-		if (!lsp_is_at_bol())
+		if (!bol)
 			if (lsp_line_handle_leading_sgr(&attr, &pair))
 				sgr_active = 1;
 
@@ -4052,6 +7416,14 @@ static void lsp_display_page()
 		if (!line)
 			break;	/* EOF */
 
+		/* Lines not starting a window line make window lines
+		   depend on each other: nothing can be kept then. */
+		if (x)
+			chained = true;
+
+		row = y;
+		lsp_page_row(y, line->pos, bol);
+
 		/* Display line numbers. */
 		if (lsp_do_line_numbers) {
 			mvwprintw(lsp_win, y, x, "%7ld|",
@@ -4237,7 +7609,7 @@ static void lsp_display_page()
 
 			/* Record position of last TOC entry or first byte not part of this page. */
 			if (lsp_mode_is_toc()) {
-				cf->toc_last = cf->toc->next;
+				cf->toc_last = lsp_toc_next(cf->toc);
 			} else {
 				cf->page_last = line->pos + lindex + 1;
 			}
@@ -4269,7 +7641,7 @@ static void lsp_display_page()
 				if (lsp_mode_is_toc()) {
 					if (lindex == 0) {
 						/* Avoid nirvana cursor on last page. */
-						if (!cf->toc->next)
+						if (lsp_toc_next(cf->toc) == LSP_TOC_NONE)
 							if (cf->toc_cursor > y)
 								cf->toc_cursor = y;
 					}
@@ -4351,24 +7723,57 @@ static void lsp_display_page()
 				/* Don't go ahead when we are currently
 				   translating '\r' to "^M'. */
 				line->current += ch_len;
+
+			/* The line continues in the next window line.  Its
+			   start is unknown if it got a part of the last
+			   character. */
+			if (y != row && lindex < line->len) {
+				row = y;
+				lsp_page_row(y, x || tab_spaces || cr_active ?
+					     (off_t)-1 : line->pos + lindex, false);
+			}
 		}
 line_done:
 		free(pmatch);
 		pmatch = NULL;
 
 		if (lsp_mode_is_toc()) {
-			if (!cf->toc->next)
+			size_t next = lsp_toc_next(cf->toc);
+
+			if (next == LSP_TOC_NONE)
 				break;
 
-			cf->toc = cf->toc->next;
+			cf->toc = next;
 		}
 	}
 
+	if (kept) {
+		cf->page_last = lsp_page.last[lsp_page.n_rows - 1];
+	} else {
+		/* Remember where the page ends, a last line without a
+		   newline is on it, too. */
+		int end = x && y < lsp_maxy - 1 ? y + 1 : y;
+
+		if (row != end)
+			lsp_page_row(end, line ? line->pos + line->len : lsp_pos, true);
+
+		lsp_page.n_rows = end;
+	}
+
+	/* The current match could be in a window line we kept. */
+	if (cf->cmatch_x == -1 && cmatch_x != -1 &&
+	    cf->current_match.rm_so == lsp_page.current_match.rm_so &&
+	    cmatch_y >= 0 && cmatch_y < lsp_maxy - 1 &&
+	    (cmatch_y < lsp_page.first || (kept && cmatch_y >= lsp_page.kept))) {
+		cf->cmatch_y = cmatch_y;
+		cf->cmatch_x = cmatch_x;
+	}
+
 	/* Fill the remainder of the window with empty lines */
 	ch[0] = L'\n';
 	setcchar(cchar_ch, ch, attr, pair, NULL);
 
-	while ((y < (lsp_maxy - 1))) {
+	while (!kept && (y < (lsp_maxy - 1))) {
 		mvwadd_wch(lsp_win, y, x, cchar_ch);
 		getyx(lsp_win, y, x);
 	}
@@ -4379,6 +7784,18 @@ line_done:
 	if (lsp_mode_is_toc() && top_line != (off_t)-1)
 		cf->toc_first = lsp_pos_to_toc(top_line);
 
+	if (lsp_mode_is_toc() || chained) {
+		lsp_page_invalidate();
+	} else {
+		lsp_page.file = cf;
+		lsp_page.maxx = lsp_maxx;
+		lsp_page.maxy = lsp_maxy;
+		lsp_page.shift = lsp_shift;
+		lsp_page.mode = cf->mode;
+		lsp_page.regex_p = cf->regex_p;
+		lsp_page.current_match = cf->current_match;
+	}
+
 	wrefresh(lsp_win);
 
 	lsp_line_dtor(line);
@@ -4574,7 +7991,7 @@ static void lsp_goto_last_wpage()
 	struct lsp_line_t *line = NULL;
 
 	/* Go to last line in file but ignore a final newline. */
-	lsp_file_set_pos(cf->size - 1);
+	lsp_file_set_pos(lsp_file_data_end() - 1);
 
 	while (n) {
 		lsp_line_dtor(line);
@@ -4598,9 +8015,8 @@ static void lsp_goto_last_wpage()
 			/* Prepare to get the previous line. */
 			lsp_file_set_pos(line->pos ? line->pos - 1 : 0);
 		} else {
-			line->n_wlines -= n;
 			/* The top window line is within this line. */
-			lsp_file_set_pos(line->wlines[line->n_wlines] + line->pos);
+			lsp_file_set_pos(line->wlines[line->n_wlines - n] + line->pos);
 			break;
 		}
 	}
@@ -4645,8 +8061,126 @@ static void lsp_cmd_visit_reference()
 	lsp_open_manpage(gref->name);
 }
 
+/*
+ * Start formatting the manual page of the selected reference in the
+ * background so that visiting it doesn't need to wait for man(1).
+ */
+static void lsp_prefetch_ref()
+{
+	if (!lsp_prefetch || !lsp_mode_is_refs() ||
+	    !lsp_is_a_match(cf->current_match))
+		return;
+
+	struct gref_t *gref = lsp_get_gref_at_pos(cf->current_match);
+
+	if (lsp_verify && gref->valid != 1)
+		return;
+
+	if (lsp_file_find(gref->name) != NULL)
+		return;
+
+	struct file_t **p = &lsp_prefetched;
+	size_t count = 0;
+
+	/* Keep the most recent ones within LSP_PREFETCH_MAX. */
+	while (*p != NULL) {
+		struct file_t *file = *p;
+
+		if (LSP_STR_EQ(file->name, gref->name)) {
+			*p = file->next;
+			file->next = lsp_prefetched;
+			lsp_prefetched = file;
+			return;
+		}
+
+		if (++count >= LSP_PREFETCH_MAX) {
+			*p = file->next;
+			lsp_file_dtor(file);
+			continue;
+		}
+
+		p = &file->next;
+	}
+
+	struct file_t *current = cf;
+	struct file_t *file = lsp_file_ctor();
+
+	file->name = strdup(gref->name);
+	file->ftype = LSP_FTYPE_MANPAGE;
+	file->flags = LSP_FLAG_MAN_PN;
+
+	cf = file;
+	lsp_man_fork();
+	cf = current;
+
+	lsp_debug("%s: prefetching \"%s\"", __func__, file->name);
+
+	file->next = lsp_prefetched;
+	lsp_prefetched = file;
+}
+
+/*
+ * Return a prefetched manual page we still want to read ahead, if any.
+ */
+static struct file_t *lsp_prefetch_pending()
+{
+	struct file_t *file;
+
+	for (file = lsp_prefetched; file != NULL; file = file->next)
+		if (!lsp_man_done(file) && file->seek < LSP_PREFETCH_SIZE)
+			break;
+
+	return file;
+}
+
+/*
+ * Make the prefetched manual page with the given name the current file.
+ *
+ * Return false if there is no such manual page.
+ */
+static bool lsp_prefetch_take(char *name)
+{
+	struct file_t **p = &lsp_prefetched;
+
+	while (*p != NULL && LSP_STR_NEQ((*p)->name, name))
+		p = &(*p)->next;
+
+	if (*p == NULL)
+		return false;
+
+	struct file_t *file = *p;
+
+	*p = file->next;
+	lsp_file_insert(file, TRUE);
+
+	lsp_debug("%s: using prefetched \"%s\"", __func__, cf->name);
+
+	char *man_pn = cf->man_pn;
+
+	cf->man_pn = NULL;
+
+	if (cf->flags & LSP_FLAG_MAN_PN) {
+		man_pn = lsp_read_manpage_name();
+		cf->flags &= ~LSP_FLAG_MAN_PN;
+	}
+
+	/* Get the first block of the real content. */
+	if (cf->data == NULL)
+		lsp_file_add_block();
+
+	lsp_man_set_name(man_pn);
+
+	/* The terminal might have been resized since we started man(1). */
+	cf->do_reload = (cf->width != lsp_maxx);
+
+	return true;
+}
+
 static void lsp_open_manpage(char *name)
 {
+	if (lsp_file_find(name) == NULL && lsp_prefetch_take(name))
+		return;
+
 	lsp_file_add(name, TRUE);
 
 	/* Check if manpage was already open */
@@ -4837,7 +8371,10 @@ static void lsp_set_manpager()
 		putenv("PAGER=lsp_cat");
 }
 
-static void lsp_exec_man()
+/*
+ * Start man(1) for the current file and make its output our data source.
+ */
+static void lsp_man_fork()
 {
 	/*
 	 * We want man(1) to see a tty so that it sends us a well
@@ -4871,32 +8408,36 @@ static void lsp_exec_man()
 
 	lsp_file_set_blksize();
 
-	/* Try to find a manpage name heading its content. */
-	char *name = lsp_read_manpage_name();
+	/* The rest of the manual page is read on demand and while we wait for
+	   user input.  The child gets reaped when its output is done. */
+	cf->pid = pid;
+	cf->width = winsize.ws_col;
+}
 
-	lsp_file_read_all();
+static void lsp_exec_man()
+{
+	double start = lsp_stats_now();
 
-	while (1) {
-		int wstatus;
+	lsp_man_fork();
 
-		pid_t ret_pid = waitpid(pid, &wstatus, 0);
+	/* Try to find a manpage name heading its content. */
+	char *name = lsp_read_manpage_name();
 
-		if (ret_pid == -1)
-			lsp_error("waitpid(%jd): %s", (intmax_t)pid, strerror(errno));
+	/* Get the first block of the real content. */
+	lsp_file_add_block();
 
-		if (WIFEXITED(wstatus)) {
-			lsp_debug("%s: child %jd exited: %d",
-				  __func__, (intmax_t)pid, WEXITSTATUS(wstatus));
-			break;
-		} else if (WIFSIGNALED(wstatus)) {
-			lsp_debug("%s: child %jd terminated by signal: %d (%s)",
-				  __func__, (intmax_t)pid, WTERMSIG(wstatus), strsignal(WTERMSIG(wstatus)));
-			break;
-		}
-		lsp_debug("%s: %jd: still waiting for child %jd to exit...",
-			  __func__, (intmax_t)ret_pid, (intmax_t)pid);
-	}
+	lsp_stats_add(&lsp_stats.man, start);
+
+	lsp_man_set_name(name);
+}
 
+/*
+ * Give the current manual page its name found in the content, NULL if
+ * there was no MAN_PN.  If a file with that name already exists, it
+ * replaces the current one.
+ */
+static void lsp_man_set_name(char *name)
+{
 	if (name == NULL)
 		name = lsp_detect_manpage(false);
 
@@ -4942,21 +8483,21 @@ static void lsp_cmd_resize()
 
 	lsp_debug("%s: new geometry is %ldx%ld", __func__, lsp_maxx, lsp_maxy);
 
-	lsp_file_set_pos(cf->page_first);
+	lsp_page_invalidate();
 
-	if (lsp_is_manpage())
-		lsp_file_reload();
+	lsp_file_set_pos(cf->page_first);
 
 	struct file_t *here = cf;
-	cf = cf->next;
 
-	/* Mark other manual pages in the ring for reload as soon as they become
-	   current. */
-	while (here != cf) {
+	/* Mark manual pages in the ring for a rendering at the new width.  Until
+	   it is ready they keep showing the old one. */
+	do {
 		if (lsp_is_manpage())
 			cf->do_reload = true;
 		cf = cf->next;
-	}
+	} while (here != cf);
+
+	lsp_man_render_update();
 }
 
 /*
@@ -5171,40 +8712,259 @@ static void lsp_man_reposition(char *section)
 	}
 }
 
-static void lsp_file_reload()
+/*
+ * Exchange the data read for two files, e.g. two renderings of a manual page.
+ */
+static void lsp_file_swap_data(struct file_t *a, struct file_t *b)
+{
+	LSP_SWAP(a->getch_pos, b->getch_pos);
+	LSP_SWAP(a->unaligned, b->unaligned);
+	LSP_SWAP(a->pre_read, b->pre_read);
+	LSP_SWAP(a->fp, b->fp);
+	LSP_SWAP(a->fd, b->fd);
+	LSP_SWAP(a->pid, b->pid);
+	LSP_SWAP(a->lines_count, b->lines_count);
+	LSP_SWAP(a->lines, b->lines);
+	LSP_SWAP(a->lines_size, b->lines_size);
+	LSP_SWAP(a->seek, b->seek);
+	LSP_SWAP(a->size, b->size);
+	LSP_SWAP(a->blksize, b->blksize);
+	LSP_SWAP(a->data, b->data);
+	LSP_SWAP(a->blocks, b->blocks);
+	LSP_SWAP(a->blocks_count, b->blocks_count);
+	LSP_SWAP(a->blocks_size, b->blocks_size);
+	LSP_SWAP(a->lcache, b->lcache);
+	LSP_SWAP(a->lcache_mru, b->lcache_mru);
+	LSP_SWAP(a->lcache_lru, b->lcache_lru);
+	LSP_SWAP(a->lcache_count, b->lcache_count);
+	LSP_SWAP(a->matches, b->matches);
+	LSP_SWAP(a->matches_count, b->matches_count);
+	LSP_SWAP(a->matches_size, b->matches_size);
+	LSP_SWAP(a->matches_seek, b->matches_seek);
+	LSP_SWAP(a->matches_tail, b->matches_tail);
+	LSP_SWAP(a->matches_gen, b->matches_gen);
+	LSP_SWAP(a->flags, b->flags);
+	LSP_SWAP(a->width, b->width);
+}
+
+/*
+ * Return true if the given rendering of a manual page is complete.
+ */
+static bool lsp_man_done(struct file_t *file)
+{
+	return !(file->flags & LSP_FLAG_MAN_PN) &&
+		file->size != LSP_FSIZE_UNKNOWN && file->size == file->seek;
+}
+
+/*
+ * Read output of man(1) for a manual page outside of the ring while we wait
+ * for user input.  Its MAN_PN heading line is kept in man_pn.
+ */
+static void lsp_man_ingest(struct file_t *file, int timeout)
+{
+	struct file_t *current = cf;
+
+	cf = file;
+
+	if (cf->flags & LSP_FLAG_MAN_PN) {
+		struct pollfd fds[2];
+
+		fds[0].fd = STDIN_FILENO;
+		fds[0].events = POLLIN;
+		fds[1].fd = cf->fd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if (poll(fds, 2, timeout) > 0 && fds[1].revents) {
+			cf->man_pn = lsp_read_manpage_name();
+			cf->flags &= ~LSP_FLAG_MAN_PN;
+		}
+	} else {
+		lsp_file_ingest(timeout);
+	}
+
+	cf = current;
+}
+
+/*
+ * Find a rendering of the current manual page for the given width.
+ */
+static struct file_t *lsp_man_render_find(int width)
+{
+	struct file_t *render;
+
+	for (render = cf->renders; render != NULL; render = render->next)
+		if (render->width == width)
+			break;
+
+	return render;
+}
+
+/*
+ * Remove a rendering from the list of the current manual page and
+ * destroy it.  A man(1) still working on it gets a hangup.
+ */
+static void lsp_man_render_drop(struct file_t *render)
+{
+	struct file_t **p = &cf->renders;
+
+	while (*p != render)
+		p = &(*p)->next;
+
+	*p = render->next;
+
+	lsp_file_dtor(render);
+}
+
+/*
+ * Start a rendering of the current manual page at the current terminal
+ * width.  It is read in the background by lsp_man_render_step().
+ */
+static void lsp_man_render_start()
+{
+	struct file_t *current = cf;
+	struct file_t *render = cf->renders;
+	size_t count = 1;
+
+	/* Make room for the new rendering. */
+	while (render != NULL) {
+		struct file_t *next = render->next;
+
+		if (count++ >= LSP_MAN_RENDERS)
+			lsp_man_render_drop(render);
+
+		render = next;
+	}
+
+	render = lsp_file_ctor();
+	render->name = strdup(cf->name);
+	render->ftype = LSP_FTYPE_MANPAGE;
+	render->flags = LSP_FLAG_MAN_PN;
+
+	cf = render;
+	lsp_man_fork();
+	cf = current;
+
+	lsp_debug("%s: rendering \"%s\" for width %d",
+		  __func__, cf->name, render->width);
+
+	render->next = cf->renders;
+	cf->renders = render;
+}
+
+/*
+ * Switch the current manual page over to the given complete rendering.
+ * The rendering shown so far takes its place in the list for later use.
+ */
+static void lsp_man_render_switch(struct file_t *render)
+{
+	char *saved_man_section = lsp_man_get_section(cf->page_first);
+
+	lsp_debug("%s: \"%s\" switches from width %d to %d",
+		  __func__, cf->name, cf->width, render->width);
+
+	lsp_file_swap_data(cf, render);
+	lsp_page_invalidate();
+
+	/* Don't keep a rendering that was interrupted. */
+	if (!lsp_man_done(render)) {
+		lsp_man_render_drop(render);
+	} else if (cf->renders != render) {
+		struct file_t **p = &cf->renders;
+
+		while (*p != render)
+			p = &(*p)->next;
+
+		*p = render->next;
+		render->next = cf->renders;
+		cf->renders = render;
+	}
+
+	/* If there was a TOC all its entries now have invalid
+	   positions (at a high possibility).  Start a new one, its
+	   entries get classified again while they are used. */
+	if (cf->toc_entries) {
+		lsp_toc_dtor(cf);
+		lsp_toc_ctor();
+
+		if (cf->toc_count == 0)
+			lsp_mode_unset_toc();
+	}
+
+	cf->do_reload = false;
+
+	lsp_man_reposition(saved_man_section);
+
+	free(saved_man_section);
+
+	cf->page_first = lsp_pos;
+	lsp_set_no_current_match();
+}
+
+/*
+ * Check if the current manual page needs a rendering for the current
+ * terminal width and switch to one we already have.
+ */
+static void lsp_man_render_update()
+{
+	if (!cf->do_reload)
+		return;
+
+	if (cf->width == lsp_maxx) {
+		cf->do_reload = false;
+		return;
+	}
+
+	struct file_t *render = lsp_man_render_find(lsp_maxx);
+
+	if (render != NULL && lsp_man_done(render))
+		lsp_man_render_switch(render);
+}
+
+/*
+ * Produce a rendering of the current manual page for the current terminal
+ * width while we wait for user input.  We start man(1) after the size didn't
+ * change for LSP_RENDER_DELAY milliseconds and keep reading its output with
+ * the given timeout until we can switch over.
+ *
+ * Return true when the current file got switched to the new rendering.
+ */
+static bool lsp_man_render_step(int timeout)
 {
-	char *saved_man_section;
+	struct file_t *render = lsp_man_render_find(lsp_maxx);
 
-	if (lsp_is_manpage())
-		saved_man_section = lsp_man_get_section(cf->page_first);
+	if (cf->width == lsp_maxx) {
+		cf->do_reload = false;
+		return false;
+	}
 
-	lsp_file_reset();
+	if (render == NULL) {
+		/* Give up on renderings for sizes we no longer need. */
+		struct file_t *next;
 
-	lsp_exec_man();
+		for (render = cf->renders; render != NULL; render = next) {
+			next = render->next;
 
-	/* If there was a TOC all its entries now have invalid
-	   pointers (at a high possibility).  Rebuild it. */
-	if (cf->toc) {
-		lsp_mode_t old_mode;
+			if (!lsp_man_done(render))
+				lsp_man_render_drop(render);
+		}
 
-		lsp_toc_dtor(cf);
-		/* A TOC must be created in neutral mode (!toc).
-		   But we also want to stay in TOC mode if this is where
-		   the resize happened. */
-		old_mode = cf->mode;
-		lsp_mode_unset_toc();
-		lsp_toc_ctor();
-		cf->mode = old_mode;
+		struct pollfd fds = { .fd = STDIN_FILENO, .events = POLLIN };
+
+		if (poll(&fds, 1, LSP_RENDER_DELAY) == 0)
+			lsp_man_render_start();
+
+		return false;
 	}
 
-	cf->do_reload = false;
+	lsp_man_ingest(render, timeout);
 
-	lsp_man_reposition(saved_man_section);
+	if (!lsp_man_done(render))
+		return false;
 
-	free(saved_man_section);
+	lsp_man_render_switch(render);
 
-	cf->page_first = lsp_pos;
-	lsp_set_no_current_match();
+	return true;
 }
 
 /*
@@ -5213,8 +8973,10 @@ static void lsp_file_reload()
  */
 static void lsp_file_reset()
 {
-	lsp_file_data_dtor(cf->data);
-	cf->data = NULL;
+	lsp_page_invalidate();
+
+	lsp_line_cache_dtor(cf);
+	lsp_file_data_dtor(cf);
 
 	lsp_file_close();
 
@@ -5223,7 +8985,12 @@ static void lsp_file_reset()
 	cf->page_last = 0;
 	cf->getch_pos = 0;
 	cf->unaligned = 0;
-	cf->lines_count = 1;
+	lsp_lines_dtor(cf);
+	lsp_lines_ctor(cf);
+	free(cf->matches);
+	cf->matches = NULL;
+	cf->matches_size = 0;
+	lsp_matches_reset(cf);
 	cf->current_match = lsp_no_match;
 
 }
@@ -5294,6 +9061,43 @@ static void lsp_files_list()
 	free(file_name);
 }
 
+/*
+ * Show the counters of lsp_stats in a file of their own.
+ * An older such file gets replaced to show current numbers.
+ */
+static void lsp_cmd_stats()
+{
+	struct file_t *current = cf;
+	struct file_t *old = lsp_file_find("lsp statistics");
+	char *text = NULL;
+	size_t len = 0;
+	char *line;
+	FILE *fp;
+
+	if (old != NULL) {
+		cf = old;
+		lsp_file_kill();
+
+		if (old != current)
+			cf = current;
+	}
+
+	fp = open_memstream(&text, &len);
+
+	if (fp == NULL)
+		lsp_error("%s: open_memstream(3): %s", __func__, strerror(errno));
+
+	lsp_stats_print(fp);
+	fclose(fp);
+
+	lsp_file_add("lsp statistics", true);
+
+	for (line = text; line < text + len; line = strchr(line, '\n') + 1)
+		lsp_file_add_line(line);
+
+	free(text);
+}
+
 /*
  * Show buffer with open files and let the user select one of them.
  *
@@ -5303,42 +9107,60 @@ static void lsp_files_list()
  */
 static char *lsp_cmd_select_file()
 {
-	size_t first_line;
-	size_t last_line;
-	size_t line_no = 1;
 	struct lsp_line_t *line;
 	char *file_name;
-	lsp_prompt = "Select file and press ENTER.";
+	size_t line_index = lsp_cmd_select_line("Select file and press ENTER.", 1);
+
+	if (line_index == (size_t)-1)
+		return NULL;
+
+	line = lsp_get_line_at_pos(lsp_lines_get(line_index));
+
+	/* Remove the final newline '\n'.*/
+	size_t len = line->len - 1;
+
+	lsp_debug("%s: selected file %.*s", __func__, len, line->raw);
+
+	/* The name *stdin* is a generated one that needs to be
+	   converted. */
+	if (LSP_STRN_EQ(line->raw, "*stdin*", len)) {
+		file_name = strdup("");
+	} else
+		file_name = lsp_mdup2str(line->raw, len);
+
+	lsp_line_dtor(line);
+	return file_name;
+}
+
+/*
+ * Let the user select a line of the current file, starting with the given
+ * line of the window.
+ *
+ * Return the (zero-based) index of the selected line or (size_t)-1 if
+ * there was no selection.
+ */
+static size_t lsp_cmd_select_line(char *prompt, size_t line_no)
+{
+	size_t first_line;
+	size_t last_line;
+	lsp_prompt = prompt;
 
 	lsp_display_page();
 	lsp_create_status_line();
 
 	while (1) {
 		mvwchgat(lsp_win, line_no, 0, -1, A_STANDOUT, LSP_REVERSE_PAIR, NULL);
+		/* The window now differs from the page drawn. */
+		lsp_page_invalidate();
 
 		int cmd = wgetch(lsp_win);
 
 		switch (cmd) {
 		case '\n':
-			/* Visit file on active line. */
+			/* Select the active line. */
 			first_line = lsp_file_pos2line(cf->page_first) - 1;
 
-			line = lsp_get_line_at_pos(cf->lines[first_line + line_no]);
-
-			/* Remove the final newline '\n'.*/
-			line->len--;
-
-			lsp_debug("%s: selected file %.*s", __func__, line->len, line->raw);
-
-			/* The name *stdin* is a generated one that needs to be
-			   converted. */
-			if (LSP_STRN_EQ(line->raw, "*stdin*", line->len)) {
-				file_name = strdup("");
-			} else
-				file_name = lsp_mdup2str(line->raw, line->len);
-
-			lsp_line_dtor(line);
-			return file_name;
+			return first_line + line_no;
 
 		case KEY_DOWN:
 			if (line_no == (lsp_maxy - 2)) {
@@ -5346,7 +9168,7 @@ static char *lsp_cmd_select_file()
 				if (cf->page_last < cf->size) {
 					lsp_cmd_forward(1);
 					lsp_display_page();
-					lsp_prompt = "Select file and press ENTER.";
+					lsp_prompt = prompt;
 					lsp_create_status_line();
 				}
 				break;
@@ -5382,7 +9204,7 @@ static char *lsp_cmd_select_file()
 			if (cf->page_first > 0) {
 				lsp_cmd_backward(1);
 				lsp_display_page();
-				lsp_prompt = "Select file and press ENTER.";
+				lsp_prompt = prompt;
 				lsp_create_status_line();
 			}
 
@@ -5391,26 +9213,26 @@ static char *lsp_cmd_select_file()
 		case KEY_RESIZE:
 			lsp_cmd_resize();
 			lsp_display_page();
-			lsp_prompt = "Select file and press ENTER.";
+			lsp_prompt = prompt;
 			lsp_create_status_line();
 			break;
 
 		case KEY_PPAGE:
 			lsp_cmd_backward(0); /* 0 == one page */
 			lsp_display_page();
-			lsp_prompt = "Select file and press ENTER.";
+			lsp_prompt = prompt;
 			lsp_create_status_line();
 			break;
 
 		case KEY_NPAGE:
 			lsp_display_page();
-			lsp_prompt = "Select file and press ENTER.";
+			lsp_prompt = prompt;
 			lsp_create_status_line();
 			break;
 
 		case 'q':
 		case 'Q':
-			return NULL;
+			return (size_t)-1;
 		} /* end switch() */
 	}
 }
@@ -5425,8 +9247,11 @@ static void lsp_cmd_apropos()
 {
 	lsp_file_add("Apropos", true);
 
-	/* Do nothing else if file already exists. */
-	if (cf->size != LSP_FSIZE_UNKNOWN)
+	/*
+	 * Do nothing else if file already exists.
+	 * The rest of its data gets read in the background by lsp_getch().
+	 */
+	if (cf->ftype & LSP_FTYPE_APROPOS)
 		return;
 
 	FILE *fp = popen(lsp_apropos_command, "r");
@@ -5437,58 +9262,113 @@ static void lsp_cmd_apropos()
 
 	/* Remember that we need to pclose(3) this pipe. */
 	cf->flags |= LSP_FLAG_POPEN;
+	cf->ftype |= LSP_FTYPE_APROPOS;
 	cf->fp = fp;
 	cf->fd = fileno(fp);
 
 	lsp_file_set_blksize();
 	lsp_file_add_block();
+}
+
+/*
+ * Create the apropos buffer without switching to it.
+ */
+static void lsp_apropos_start()
+{
+	struct file_t *current = cf;
+	off_t pos = lsp_pos;
+	lsp_mode_t mode = cf->mode;
 
-	if (lsp_verify_with_apropos)
-		lsp_apropos_create_grefs();
+	lsp_cmd_apropos();
+
+	/* Switching files resets position and mode of the current file. */
+	cf = current;
+	lsp_file_set_pos(pos);
+	lsp_mode_set(mode);
 }
 
 /*
- * Process the apropos buffer and add valid grefs for each line in it.
- *
- * The apropos buffer consits of lines like:
- *
- * "xyz(nn) - some description\n"
- *
- * So, a gref can be build from the first part (which is a reference in
- * lsp-jargon).
+ * Return the apropos file if we are still reading its data.
  */
-static void lsp_apropos_create_grefs()
+static struct file_t *lsp_apropos_pending()
 {
-	size_t line_nr;
-	struct lsp_line_t *line;
-	char *end_ref;
-	struct gref_t *gref;
+	struct file_t *apropos = lsp_file_find("Apropos");
+
+	if (apropos == NULL || !(apropos->ftype & LSP_FTYPE_APROPOS))
+		return NULL;
 
-	lsp_file_read_all();
+	if (apropos->size != LSP_FSIZE_UNKNOWN && apropos->size == apropos->seek)
+		return NULL;
 
-	/*
-	 * Process each line of the apropos file and add a gref marked valid.
-	 */
-	for (line_nr = 0; line_nr < cf->lines_count; line_nr++) {
-		/* Get next line */
-		line = lsp_get_line_at_pos(cf->lines[line_nr]);
+	return apropos;
+}
+
+/*
+ * Read more data of the apropos file, usually while it isn't the current
+ * file.  Return true if we got new data.
+ */
+static bool lsp_apropos_ingest(int timeout)
+{
+	struct file_t *apropos = lsp_apropos_pending();
+	struct file_t *current = cf;
+	bool more;
 
-		/* Find closing parenthesis of "xyz(nn)" */
-		end_ref = memchr(line->normalized, ')', line->nlen) + 1;
+	if (apropos == NULL)
+		return false;
 
-		assert(end_ref != (void *)1);
+	cf = apropos;
+	more = lsp_file_ingest(timeout);
+	cf = current;
 
-		char *ref_name = lsp_mdup2str(line->normalized, end_ref - line->normalized);
+	return more;
+}
 
-		gref = lsp_gref_search(ref_name);
+/*
+ * Add valid grefs for the complete lines of the apropos buffer that
+ * arrived since the last call.
+ *
+ * The apropos buffer consits of lines like:
+ *
+ * "xyz(nn) - some description\n"
+ *
+ * So, a gref can be build from the first part (which is a reference in
+ * lsp-jargon).  We take it straight from the data buffers without creating
+ * line structures.
+ */
+static void lsp_apropos_add_grefs()
+{
+	char ref[LSP_REF_MAX_LEN];
+	size_t last;
 
-		free(ref_name);
+	if (!lsp_verify_with_apropos)
+		return;
 
-		assert(gref != NULL);
+	/* A line is complete if we know where the next one starts or if
+	   it is the last one and its newline already arrived. */
+	last = cf->lines_count - 1;
+	if (LSP_EOF || (cf->seek > 0 &&
+			cf->blocks[(cf->seek - 1) / cf->blksize]->buffer[(cf->seek - 1) % cf->blksize] == '\n'))
+		last = cf->lines_count;
+
+	for (; cf->apropos_lines < last; cf->apropos_lines++) {
+		size_t line_nr = cf->apropos_lines;
+		off_t pos = lsp_lines_get(line_nr);
+		off_t end = line_nr + 1 < cf->lines_count ?
+			lsp_lines_get(line_nr + 1) : cf->seek;
+		size_t len = 0;
+
+		/* Copy "xyz(nn)", it might span two buffers. */
+		while (pos < end && len < sizeof(ref)) {
+			ref[len] = cf->blocks[pos / cf->blksize]->buffer[pos % cf->blksize];
+			pos++;
+			if (ref[len++] == ')')
+				break;
+		}
 
-		gref->valid = 1;
+		if (len == 0 || ref[len - 1] != ')')
+			continue;
 
-		lsp_line_dtor(line);
+		lsp_gref_search(ref, len)->valid = 1;
 	}
 }
 
@@ -5622,19 +9502,54 @@ static void lsp_create_status_line()
 		mvwaddstr(lsp_win, lsp_maxy - 1, x, cf->name);
 
 	x = getcurx(lsp_win);
-	if (cf->size == LSP_FSIZE_UNKNOWN || cf->seek < cf->size)
+	if (lsp_approx_status && cf->size != LSP_FSIZE_UNKNOWN &&
+	    cf->size != 0) {
+		/* Byte percentage and line numbers, estimated as long as we
+		   are still reading. */
+		const char *approx = cf->seek < cf->size ? "~" : "";
+
 		mvwprintw(lsp_win, lsp_maxy - 1, x,
-			  " line %ld",
-			  lsp_file_pos2line(cf->page_first));
+			  " line %s%ld/%s%ld %d%%",
+			  cf->page_first > cf->seek ? "~" : "",
+			  lsp_file_pos2line_estimate(cf->page_first),
+			  approx, lsp_file_lines_estimate(),
+			  (int)(100.0 * cf->page_last / cf->size));
+	} else if (cf->size == LSP_FSIZE_UNKNOWN || cf->seek < cf->size)
+		/* Still reading: tell how many lines we have so far. */
+		mvwprintw(lsp_win, lsp_maxy - 1, x,
+			  " line %ld/%ld...",
+			  lsp_file_pos2line(cf->page_first),
+			  cf->lines_count);
 	else
 		mvwprintw(lsp_win, lsp_maxy - 1, x,
 			  " line %ld/%ld",
 			  lsp_file_pos2line(cf->page_first),
 			  cf->lines_count);
 
+	/* Tell which of the matches we know of is the current one, unless
+	   a message takes the space. */
+	if (lsp_prompt == NULL &&
+	    lsp_mode_is_highlight() && !lsp_mode_is_toc() &&
+	    lsp_is_a_match(cf->current_match) && lsp_matches_sync()) {
+		size_t i = lsp_matches_find(cf->current_match.rm_so);
+		const char *more = cf->matches_seek == lsp_file_data_end() &&
+			LSP_EOF ? "" : "...";
+
+		x = getcurx(lsp_win);
+		if (i < cf->matches_count &&
+		    cf->matches[i].rm_so == cf->current_match.rm_so)
+			mvwprintw(lsp_win, lsp_maxy - 1, x, " match %zu/%zu%s",
+				  i + 1, cf->matches_count, more);
+		else
+			mvwprintw(lsp_win, lsp_maxy - 1, x, " match ?/%zu%s",
+				  cf->matches_count, more);
+	}
+
 	wclrtoeol(lsp_win);
 
 	/* If any, put temporary message in the middle of the footer. */
+	lsp_prompt_shown = lsp_prompt;
+
 	if (lsp_prompt != NULL) {
 		x = (lsp_maxx - strlen(lsp_prompt)) / 2;
 		mvwaddstr(lsp_win, lsp_maxy - 1, x, lsp_prompt);
@@ -5690,6 +9605,9 @@ static void lsp_cmd_toggle_options()
 {
 	int cmd = wgetch(lsp_win);
 
+	/* All options change the way lines are shown. */
+	lsp_page_invalidate();
+
 	switch(cmd) {
 	case 'h':
 		lsp_mode_toggle_highlight();
@@ -5729,6 +9647,14 @@ static void lsp_cmd_toggle_options()
 		else
 			lsp_maxx += 8;
 		break;
+	case '%':
+		lsp_approx_status = !lsp_approx_status;
+
+		if (lsp_approx_status)
+			lsp_prompt = "Approximate status line turned ON.";
+		else
+			lsp_prompt = "Approximate status line turned OFF.";
+		break;
 	case 'V':
 		lsp_verify = !lsp_verify;
 
@@ -5813,27 +9739,162 @@ static void lsp_mode_unset_search_or_refs()
  */
 static void lsp_toc_first_adjust()
 {
-	struct toc_node_t *toc = cf->toc_first;
+	size_t rank = lsp_toc_rank(cf->toc_first);
+	size_t toc = lsp_toc_visible(rank);
 
-	/* Start with searching backwards. */
-	while (toc && toc->level > cf->current_toc_level)
-		toc = toc->prev;
+	/* Use the visible entry at or before toc_first if there is one. */
+	if (toc != cf->toc_first && rank > 0)
+		toc = lsp_toc_visible(rank - 1);
 
-	if (toc) {
-		cf->toc_first = toc;
+	/* Nothing visible in this level, keep the current position. */
+	if (toc == LSP_TOC_NONE)
 		return;
-	}
 
-	/* We didn't find a matching TOC entry.
-	   Try to search forward. */
-	toc = cf->toc_first;
-	while (toc && toc->level > cf->current_toc_level)
-		toc = toc->next;
+	cf->toc_first = toc;
+}
+
+/*
+ * Get the next command from the user.
+ *
+ * Until we have all input of the current file, we read it while waiting and
+ * keep the status line up to date.
+ * In follow mode, we also wait for the file to grow and keep showing its
+ * end if the last page is visible.
+ */
+static int lsp_getch()
+{
+	int cmd;
 
-	if (!toc)
-		lsp_error("%s: cannot find proper TOC entry.", __func__);
+	while (!LSP_EOF || lsp_follow || lsp_apropos_pending() ||
+	       cf->do_reload || lsp_prefetch_pending() ||
+	       lsp_matches_pending() || lsp_ofile_pending.len) {
+		nodelay(lsp_win, true);
+		cmd = wgetch(lsp_win);
+		nodelay(lsp_win, false);
 
-	cf->toc_first = toc;
+		if (cmd != ERR) {
+			lsp_file_check_truncated();
+			return cmd;
+		}
+
+		struct file_t *apropos = lsp_apropos_pending();
+		struct file_t *prefetch = lsp_prefetch_pending();
+		bool busy = !LSP_EOF || lsp_follow;
+
+		if (apropos == cf)
+			apropos = NULL;
+
+		/*
+		 * Render a resized manual page in the background and show
+		 * it as soon as it is complete.
+		 */
+		if (cf->do_reload) {
+			if (lsp_man_render_step(busy || apropos || prefetch ?
+						0 : -1)) {
+				if (lsp_mode_is_toc())
+					cf->toc = cf->toc_first;
+				else
+					lsp_file_set_pos(cf->page_first);
+				lsp_display_page();
+				lsp_prompt = lsp_prompt_shown;
+				lsp_create_status_line();
+				continue;
+			}
+
+			if (!busy && !apropos && !prefetch)
+				continue;
+		}
+
+		/* Read ahead manual pages of selected references. */
+		if (prefetch != NULL) {
+			lsp_man_ingest(prefetch, busy || apropos ? 0 :
+				       cf->do_reload ? LSP_FOLLOW_INTERVAL : -1);
+
+			if (!busy && !apropos)
+				continue;
+		}
+
+		/*
+		 * Keep reading apropos output for verifying references and
+		 * show the ones that turned out to be valid.
+		 */
+		if (apropos != NULL) {
+			size_t lines = apropos->apropos_lines;
+
+			lsp_apropos_ingest(busy ? 0 :
+					   cf->do_reload || prefetch ?
+					   LSP_FOLLOW_INTERVAL : -1);
+
+			if (apropos->apropos_lines != lines &&
+			    lsp_mode_is_highlight() && !lsp_mode_is_toc() &&
+			    cf->regex_p == lsp_refs_regex) {
+				lsp_file_set_pos(cf->page_first);
+				lsp_display_page();
+				lsp_prompt = lsp_prompt_shown;
+				lsp_create_status_line();
+			}
+
+			if (!busy)
+				continue;
+		}
+
+		/*
+		 * Hand input over to the writer of the -o file.
+		 * If it is too far behind, reading more has to wait.
+		 */
+		if (lsp_ofile_pending.len) {
+			lsp_ofile_flush((busy && !lsp_ofile_full()) ||
+					apropos || prefetch || cf->do_reload ||
+					lsp_matches_pending() ? 0 : -1);
+
+			if ((!busy || lsp_ofile_full()) &&
+			    !lsp_matches_pending())
+				continue;
+		}
+
+		/* Count the matches of the search pattern. */
+		if (lsp_matches_pending()) {
+			lsp_matches_step();
+
+			lsp_prompt = lsp_prompt_shown;
+			lsp_create_status_line();
+
+			if (!busy)
+				continue;
+		}
+
+		if (lsp_ofile_full())
+			continue;
+
+		if (lsp_file_check_truncated()) {
+			lsp_display_page();
+			lsp_create_status_line();
+			continue;
+		}
+
+		off_t end = lsp_file_data_end();
+
+		if (LSP_EOF ? !lsp_file_follow() :
+		    !lsp_file_ingest(apropos || prefetch || cf->do_reload ||
+				     lsp_ofile_pending.len ?
+				     LSP_FOLLOW_INTERVAL : -1))
+			continue;
+
+		if (lsp_follow && !lsp_mode_is_toc() && cf->page_last >= end &&
+		    lsp_file_data_end() != end) {
+			lsp_file_goto_data_end();
+			lsp_display_page();
+		}
+
+		/* Keep a message the user didn't see for long. */
+		lsp_prompt = lsp_prompt_shown;
+		lsp_create_status_line();
+	}
+
+	cmd = wgetch(lsp_win);
+	lsp_file_check_truncated();
+
+	return cmd;
 }
 
 /*
@@ -5852,6 +9913,8 @@ static void lsp_workhorse()
 	 * The initial command is to display the first page of content.
 	 */
 	int cmd = ' ';
+	/* When we got cmd, for the time spent per key. */
+	double start = lsp_stats_now();
 
 	while (1) {
 		switch (cmd) {
@@ -5866,6 +9929,10 @@ static void lsp_workhorse()
 			lsp_cmd_apropos();
 			lsp_display_page();
 			break;
+		case 'i':
+			lsp_cmd_stats();
+			lsp_display_page();
+			break;
 		case 'h':
 			lsp_open_manpage("lsp-help(1)");
 			lsp_display_page();
@@ -5925,6 +9992,16 @@ static void lsp_workhorse()
 				lsp_cmd_goto_start();
 			lsp_display_page();
 			break;
+		case 'F':
+			lsp_follow = !lsp_follow;
+			lsp_prompt = lsp_follow ? "Follow mode" : "Follow mode off";
+			if (lsp_follow && !lsp_mode_is_toc()) {
+				lsp_cursor_set = false;
+				lsp_file_goto_data_end();
+			} else if (!lsp_mode_is_toc())
+				lsp_file_set_pos(cf->page_first);
+			lsp_display_page();
+			break;
 		case 'G':
 		case '>':
 			lsp_cursor_set = false;
@@ -5939,17 +10016,19 @@ static void lsp_workhorse()
 			lsp_search_direction = LSP_BW;
 			lsp_cmd_search_refs();
 			lsp_display_page();
+			lsp_prefetch_ref();
 			break;
 		case '\t':
 			lsp_cursor_set = false;
 			lsp_search_direction = LSP_FW;
 			lsp_cmd_search_refs();
 			lsp_display_page();
+			lsp_prefetch_ref();
 			break;
 		case KEY_RIGHT:
 			lsp_shift += 1;
 			if (lsp_mode_is_toc())
-				lsp_toc_rewind(cf->toc_first->pos);
+				lsp_toc_rewind(LSP_TOC(cf->toc_first).pos);
 			else
 				lsp_file_set_pos(cf->page_first);
 			lsp_display_page();
@@ -5958,7 +10037,7 @@ static void lsp_workhorse()
 			if (lsp_shift)
 				lsp_shift = lsp_shift - 1;
 			if (lsp_mode_is_toc())
-				lsp_toc_rewind(cf->toc_first->pos);
+				lsp_toc_rewind(LSP_TOC(cf->toc_first).pos);
 			else
 				lsp_file_set_pos(cf->page_first);
 			lsp_display_page();
@@ -5992,8 +10071,8 @@ static void lsp_workhorse()
 			} else {
 				/* In TOC mode, line movement ends a search. */
 				lsp_mode_unset_highlight();
-				if (cf->toc->next) {
-					lsp_toc_rewind(cf->toc_first->pos);
+				if (lsp_toc_next(cf->toc) != LSP_TOC_NONE) {
+					lsp_toc_rewind(LSP_TOC(cf->toc_first).pos);
 
 					if (cf->toc_cursor + 1 < lsp_maxy - 1) {
 						cf->toc_cursor++;
@@ -6003,9 +10082,9 @@ static void lsp_workhorse()
 					}
 				} else {
 					if (lsp_toc_get_offset_at_cursor() <
-					    cf->toc->pos)
+					    LSP_TOC(cf->toc).pos)
 						cf->toc_cursor++;
-					lsp_toc_rewind(cf->toc_first->pos);
+					lsp_toc_rewind(LSP_TOC(cf->toc_first).pos);
 				}
 			}
 
@@ -6014,7 +10093,7 @@ static void lsp_workhorse()
 		case KEY_PPAGE:
 		case 'b':
 			if (lsp_mode_is_toc()) {
-				lsp_toc_rewind(cf->toc_first->pos);
+				lsp_toc_rewind(LSP_TOC(cf->toc_first).pos);
 				lsp_toc_bw(lsp_maxy - 1);
 			} else {
 				lsp_cursor_set = false;
@@ -6030,14 +10109,14 @@ static void lsp_workhorse()
 				/* In TOC mode, line movement ends a search. */
 				lsp_mode_unset_highlight();
 
-				lsp_toc_rewind(cf->toc_first->pos);
+				lsp_toc_rewind(LSP_TOC(cf->toc_first).pos);
 
 				if (cf->toc_cursor) {
 					/* Cursor stays on page */
 					cf->toc_cursor--;
 				} else
 					/* Cursor moves out of page */
-					if (cf->toc_first->prev) {
+					if (cf->toc_first > 0) {
 						/* We are not on first page.
 						   Go 1/2 page up. */
 						lsp_toc_bw(lsp_maxy / 2);
@@ -6094,9 +10173,14 @@ static void lsp_workhorse()
 			lsp_cmd_search(true);
 			lsp_display_page();
 			break;
+		case 'S':
+			lsp_cursor_set = false;
+			lsp_cmd_search_files();
+			lsp_display_page();
+			break;
 		case 'T':
 			if (lsp_mode_is_toc()) {
-				cf->current_toc_level = (cf->current_toc_level + 1) % 3;
+				cf->current_toc_level = (cf->current_toc_level + 1) % LSP_TOC_LEVELS;
 				/* If we are switching from
 				   level 2 to 0 the current toc_first could
 				   become invisible.
@@ -6104,11 +10188,14 @@ static void lsp_workhorse()
 				if (!cf->current_toc_level)
 					lsp_toc_first_adjust();
 
-				lsp_toc_rewind(cf->toc_first->pos);
+				lsp_toc_rewind(LSP_TOC(cf->toc_first).pos);
 			} else if (cf->size != 0) {
 				/* create TOC only for non-empty files. */
 				lsp_toc_ctor();
-				lsp_mode_set_toc();
+				if (cf->toc_count)
+					lsp_mode_set_toc();
+				else
+					lsp_prompt = "No TOC entries";
 			} else
 				lsp_prompt = "No TOC for empty files";
 
@@ -6139,8 +10226,10 @@ static void lsp_workhorse()
 				lsp_mode_unset_toc();
 				lsp_file_set_pos(cf->page_first);
 			} else {
-				/* Allow to exit from help with 'q' */
-				if (LSP_STR_EQ(cf->name, "lsp-help(1)")) {
+				/* Allow to exit from help and statistics
+				   with 'q' */
+				if (LSP_STR_EQ(cf->name, "lsp-help(1)") ||
+				    LSP_STR_EQ(cf->name, "lsp statistics")) {
 					lsp_cmd_kill_file();
 				} else {
 					return;
@@ -6158,7 +10247,11 @@ static void lsp_workhorse()
 
 		lsp_create_status_line();
 
-		cmd = wgetch(lsp_win);
+		if (cmd >= 0 && cmd <= KEY_MAX)
+			lsp_stats_add(&lsp_stats.keys[cmd], start);
+
+		cmd = lsp_getch();
+		start = lsp_stats_now();
 		lsp_debug("Next command: %s (0x%04x)", keyname(cmd), cmd);
 
 		if (cmd != CTRL_L)
@@ -6220,6 +10313,15 @@ static void lsp_file_add(char *name, bool new_current)
 
 	new_file->name = strdup(name);
 
+	lsp_file_insert(new_file, new_current);
+}
+
+/*
+ * Insert a file_t into the ring, either as new current file or as the last
+ * one.
+ */
+static void lsp_file_insert(struct file_t *new_file, bool new_current)
+{
 	if (cf == NULL) {
 		cf = new_file;
 		new_file->prev = new_file->next = new_file;
@@ -6266,32 +10368,51 @@ static struct file_t *lsp_file_ctor()
 	new_file->rep_name = NULL;
 	new_file->fp = NULL;
 	new_file->fd = -1;
+	new_file->pid = 0;
 	new_file->page_first = (off_t)-1;
 	new_file->page_last = 0;
 	new_file->getch_pos = 0;
 	new_file->unaligned = 0;
-	new_file->lines_count = 1;
-	new_file->lines = lsp_malloc(LSP_LINES_INITIAL_SIZE * sizeof(off_t));
-	/* The first line always starts at pos 0 */
-	new_file->lines[0] = 0;
-	new_file->lines_size = LSP_LINES_INITIAL_SIZE;
+	lsp_lines_ctor(new_file);
+	new_file->apropos_lines = 0;
 	new_file->seek = 0;
 	new_file->size = LSP_FSIZE_UNKNOWN;
 	new_file->blksize = 0;
 	new_file->data = NULL;
+	new_file->blocks = NULL;
+	new_file->blocks_count = 0;
+	new_file->blocks_size = 0;
+	new_file->lcache = NULL;
+	new_file->lcache_mru = new_file->lcache_lru = NULL;
+	new_file->lcache_count = 0;
 
 	new_file->flags = 0;
 	new_file->ftype = LSP_FTYPE_OTHER;
 	new_file->do_reload = FALSE;
+	new_file->width = 0;
+	new_file->man_pn = NULL;
+	new_file->used = 0;
+	new_file->evicted = false;
+	new_file->evicted_section = NULL;
+	new_file->renders = NULL;
 
 	new_file->regex_p = NULL;
 	new_file->current_match = lsp_no_match;
 	new_file->cmatch_x = -1;
 
-	new_file->toc = NULL;
+	new_file->matches = NULL;
+	new_file->matches_size = 0;
+	lsp_matches_reset(new_file);
+
+	new_file->toc_entries = NULL;
+	memset(new_file->toc_levels, 0, sizeof(new_file->toc_levels));
+	new_file->toc_count = 0;
+	new_file->toc_size = 0;
+	new_file->toc_seek = 0;
+	new_file->toc = 0;
 	new_file->toc_cursor = 0;
-	new_file->toc_first = NULL;
-	new_file->toc_last = NULL;
+	new_file->toc_first = LSP_TOC_NONE;
+	new_file->toc_last = LSP_TOC_NONE;
 	new_file->current_toc_level = 0;
 
 	return new_file;
@@ -6514,6 +10635,33 @@ static bool lsp_has_man_placeholders(const char *str)
 	return (n_count == 1) && (s_count == 1);
 }
 
+/*
+ * Parse a size in bytes with an optional suffix K, M or G, e.g. "64M".
+ */
+static size_t lsp_parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size = strtoull(str, &end, 10);
+
+	switch (toupper((unsigned char)*end)) {
+	case 'G':
+		size *= 1024;
+		/* fallthrough */
+	case 'M':
+		size *= 1024;
+		/* fallthrough */
+	case 'K':
+		size *= 1024;
+		end++;
+		break;
+	}
+
+	if (end == str || *end != '\0')
+		lsp_error("Invalid size \"%s\", expected e.g. 64M!", str);
+
+	return size;
+}
+
 static void lsp_process_options(int argc, char *argv[])
 {
 	int opt;
@@ -6543,6 +10691,12 @@ static void lsp_process_options(int argc, char *argv[])
 		{"verify-command",	required_argument,	0, '2'},
 		{"verify-with-apropos", no_argument,		0, '3'},
 		{"keep-cr",		no_argument,		0, '4'},
+		{"follow",		no_argument,		0, '5'},
+		{"refs-cache",		no_argument,		0, '6'},
+		{"prefetch",		no_argument,		0, '7'},
+		{"max-mem",		required_argument,	0, '8'},
+		{"approx-status",	no_argument,		0, '9'},
+		{"dump-stats",		no_argument,		0, 'D'},
 		{0,			0,			0,  0 }
 	};
 
@@ -6578,6 +10732,30 @@ static void lsp_process_options(int argc, char *argv[])
 			/* --keep-cr */
 			lsp_keep_cr = true;
 			break;
+		case '5':
+			/* --follow */
+			lsp_follow = true;
+			break;
+		case '6':
+			/* --refs-cache */
+			lsp_refs_cache = true;
+			break;
+		case '7':
+			/* --prefetch */
+			lsp_prefetch = true;
+			break;
+		case '8':
+			/* --max-mem */
+			lsp_max_mem = lsp_parse_size(optarg);
+			break;
+		case '9':
+			/* --approx-status */
+			lsp_approx_status = true;
+			break;
+		case 'D':
+			/* --dump-stats */
+			lsp_dump_stats = true;
+			break;
 		case 'a':
 			lsp_load_apropos = true;
 			if (optarg)
@@ -6635,22 +10813,13 @@ static void lsp_process_options(int argc, char *argv[])
  */
 static void lsp_grefs_dtor()
 {
-	struct gref_t *next;
-
 	lsp_debug("%s: destroying grefs", __func__);
 
-	while (lsp_grefs != NULL) {
-		free(lsp_grefs->name);
-
-		/* Safe next ptr before freeing its container. */
-		next = lsp_grefs->next;
+	free(lsp_grefs.slots);
+	lsp_grefs.slots = NULL;
+	lsp_grefs.size = lsp_grefs.count = 0;
 
-		free(lsp_grefs);
-		lsp_grefs = next;
-	}
-
-	/* Destroy the corresponding hash table. */
-	hdestroy();
+	lsp_arena_dtor(&lsp_grefs.arena);
 }
 
 /*
@@ -6662,6 +10831,13 @@ static void lsp_finish()
 
 	lsp_file_ring_dtor();
 
+	while (lsp_prefetched != NULL) {
+		struct file_t *file = lsp_prefetched;
+
+		lsp_prefetched = file->next;
+		lsp_file_dtor(file);
+	}
+
 	if (lsp_refs_regex) {
 		regfree(lsp_refs_regex);
 		free(lsp_refs_regex);
@@ -6669,14 +10845,24 @@ static void lsp_finish()
 
 	lsp_grefs_dtor();
 
-	if (lsp_hwin != NULL)
-		delwin(lsp_hwin);
+	lsp_arena_dtor(&lsp_lines_arena);
+
+	free(lsp_search_literal);
+
+	free(lsp_page.rows);
+	free(lsp_page.bol);
+	free(lsp_page.last);
+
+	if (lsp_refs_cache_fd != -1)
+		close(lsp_refs_cache_fd);
 
 	if (isendwin() == FALSE)
 		endwin();
 
-	if (lsp_ofile > 0)
-		close(lsp_ofile);
+	lsp_ofile_finish();
+
+	if (lsp_dump_stats)
+		lsp_stats_print(stderr);
 
 	if (lsp_logfp && lsp_logfp != stderr)
 		fclose(lsp_logfp);
@@ -6761,13 +10947,27 @@ static void lsp_init()
 
 	lsp_keep_cr = false;
 
-	lsp_verify = true;
+	lsp_follow = false;
+
+	lsp_refs_cache = false;
+	lsp_refs_cache_fd = -1;
+
+	lsp_prefetch = false;
+	lsp_prefetched = NULL;
 
-	lsp_htable_entries = 100000;
-	lsp_grefs_count = 0;
+	lsp_max_mem = 0;
+	lsp_files_clock = 0;
 
-	lsp_hwin = NULL;
-	lsp_hwin_cols = -1;
+	lsp_approx_status = false;
+
+	lsp_page.file = NULL;
+	lsp_page.rows = NULL;
+	lsp_page.bol = NULL;
+	lsp_page.last = NULL;
+	lsp_page.size = 0;
+	lsp_page.n_rows = 0;
+
+	lsp_verify = true;
 
 	lsp_pinfo_ctor();
 }
@@ -6849,7 +11049,7 @@ static char *lsp_run_command2str(char *cmd)
 	 * Read command output and store it in the result string.
 	 */
 	while (!feof(fp)) {
-		size_t chunk = (buffer + nread) - (buffer + b_len);
+		size_t chunk = b_len - nread;
 
 		if (!chunk) {
 			b_len += r_len;
@@ -6870,6 +11070,11 @@ static char *lsp_run_command2str(char *cmd)
 
 	pclose(fp);
 
+	if (nread == b_len)
+		buffer = lsp_realloc(buffer, b_len + 1);
+
+	buffer[nread] = '\0';
+
 	/* Remove trailing newline. */
 	if (nread && buffer[nread - 1] == '\n')
 		buffer[nread - 1] = '\0';
@@ -6909,6 +11114,8 @@ static void lsp_pinfo_dtor()
 	lsp_pinfo = NULL;
 }
 
+/* The benchmarks in bench/ include this file and bring their own main(). */
+#ifndef LSP_NO_MAIN
 int main(int argc, char *argv[])
 {
 	lsp_init();
@@ -6921,6 +11128,11 @@ int main(int argc, char *argv[])
 
 	lsp_process_options(argc, argv);
 
+	lsp_ofile_start();
+
+	if (lsp_refs_cache && lsp_verify && !lsp_verify_with_apropos)
+		lsp_refs_cache_load();
+
 	lsp_file_init_ring();
 
 #if DEBUG
@@ -6931,6 +11143,9 @@ int main(int argc, char *argv[])
 		lsp_display_page();
 		lsp_search_direction = LSP_FW;
 		lsp_cmd_search(false);
+	} else if (lsp_follow) {
+		/* Start following at the end of the data. */
+		lsp_file_goto_data_end();
 	}
 
 	lsp_workhorse();
@@ -6940,3 +11155,4 @@ int main(int argc, char *argv[])
 	/* Usually, we should not reach this. */
 	exit(EXIT_SUCCESS);
 }
+#endif
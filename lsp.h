@@ -33,8 +33,17 @@
 #define LSP_STRN_EQ(a, b, l) (strncmp(a, b, l) == 0)
 #define LSP_STRN_NEQ(a, b, l) (strncmp(a, b, l) != 0)
 
+/* Exchange the values of two objects of the same type. */
+#define LSP_SWAP(a, b) do {					\
+		char lsp_swap_tmp[sizeof(a)];			\
+		memcpy(lsp_swap_tmp, &(a), sizeof(a));		\
+		memcpy(&(a), &(b), sizeof(a));			\
+		memcpy(&(b), lsp_swap_tmp, sizeof(a));		\
+	} while (0)
+
 /*
  * We store each file's content in a ring of buffers of size blksize.
+ * Mapped regular files have a single buffer: the mapping.
  */
 struct data_t {
 	off_t seek;	       // position of buffer inside the file
@@ -51,17 +60,41 @@ struct man_id {
 	char *name;
 };
 
+/*
+ * The offsets of lines are kept in chunks of LSP_LINES_CHUNK lines.  Each
+ * chunk stores the offset of its first line and delta-encodes the following
+ * ones as distance to their predecessor: 7 bits per byte, least significant
+ * first, the high bit set in all but the last byte.
+ */
+struct lsp_lines_chunk_t {
+	off_t first;		/* offset of the first line */
+	off_t last;		/* offset of the last line added so far */
+	unsigned char *deltas;
+	unsigned short len;	/* bytes used in deltas */
+	unsigned short size;	/* bytes allocated for deltas */
+};
+
 /*
  * TOC entries are pointers to lines with indentation levels 0,4,8
- * which are kept in a linked list:
+ * which are kept in an array sorted by position:
  */
 struct toc_node_t {
 	off_t pos;		/* Position in source file */
 
 	int level;		/* Indentation level 0-2 */
+};
 
-	struct toc_node_t *prev;
-	struct toc_node_t *next;
+/* Number of TOC levels */
+enum { LSP_TOC_LEVELS = 3 };
+
+/*
+ * The entries visible in a TOC level (indices into the TOC array), i.e.
+ * all entries with this or a lower level.
+ */
+struct toc_level_t {
+	size_t *entries;
+	size_t count;
+	size_t size;
 };
 
 /*
@@ -69,6 +102,14 @@ struct toc_node_t {
  */
 #define lindex (line->current - line->raw)
 
+/*
+ * Entry of the map from normalized to raw offsets in a line.
+ */
+struct lsp_nmap_t {
+	size_t noff;		/* offset in normalized */
+	size_t roff;		/* corresponding offset in raw */
+};
+
 /*
  * Structure for line operations.
  * The member .normalized is for data without formatting information,
@@ -98,21 +139,92 @@ struct lsp_line_t {
 
 	size_t nlen;		/* length of normalized */
 	char *normalized;	/* normalized content */
+	size_t n_nmap;		/* number of entries in nmap */
+	struct lsp_nmap_t *nmap;	/* where normalized and raw diverge */
 
 	size_t n_wlines;	/* number of window lines */
+	size_t wlines_size;	/* allocated entries in wlines */
 	off_t *wlines;   	/* pointers to offsets in raw that
 				 * correspond to lines in the window */
+	int wlines_cols;	/* window width wlines were computed for */
+
+	bool transient;		/* memory comes from lsp_lines_arena */
+
+	size_t refs;		/* references, the line cache holds one */
+	size_t lnum;		/* line number while in the line cache */
+	struct lsp_line_t *hnext;	/* next line in cache bucket */
+	struct lsp_line_t *lru_prev;	/* more recently used line */
+	struct lsp_line_t *lru_next;	/* less recently used line */
+};
+
+/*
+ * Chunk of an arena: memory that is handed out piecewise and only freed as
+ * a whole.
+ */
+struct lsp_arena_t {
+	struct lsp_arena_t *next;
+	size_t size;		/* size of data */
+	size_t used;		/* bytes of data handed out */
+	char data[];
+};
+
+/*
+ * Position in an arena to release later allocations to.
+ */
+struct lsp_arena_mark_t {
+	struct lsp_arena_t *chunk;
+	size_t used;
 };
 
+/*
+ * Arena for the memory of lines that are only needed for a little while, e.g.
+ * while looking for search matches.  Users take a mark and release the
+ * arena to it when they are done.
+ */
+struct lsp_arena_t *lsp_lines_arena;
+
 /*
  * Globally keep track of what references we validated.
  * No matter what file we are paging it came from.
  */
 struct gref_t {
 	char *name;
+	size_t len;		/* length of name */
+	size_t hash;		/* lsp_gref_hash() of name */
 	int valid;
-	struct gref_t *next;
-} *lsp_grefs;
+};
+
+/*
+ * Hash table of all grefs by name.
+ * Open addressing with linear probing, the grefs and their names are
+ * allocated from the arena of the table.
+ */
+struct lsp_grefs_t {
+	struct gref_t **slots;
+	size_t size;		/* number of slots, a power of 2 */
+	size_t count;		/* number of grefs */
+	struct lsp_arena_t *arena;
+} lsp_grefs;
+
+/*
+ * A child process searching one of the open files for lsp_cmd_search_files().
+ */
+struct lsp_search_worker_t {
+	struct file_t *file;
+	off_t end;		/* end of the data to search */
+	pid_t pid;
+	int fd;			/* read end of the pipe from the child or -1 */
+	off_t *hits;		/* starts of lines with a match */
+	size_t bytes;		/* bytes of hits read so far */
+	size_t size;		/* bytes allocated for hits */
+};
+
+/* How often something took how long (in seconds) for lsp_stats. */
+struct lsp_stats_time_t {
+	size_t count;
+	double total;
+	double max;
+};
 
 /* lsp modes of operation */
 enum lsp_mode {
@@ -152,7 +264,15 @@ struct lsp_parent_info {
 
 struct lsp_parent_info *lsp_pinfo;
 
-static void			lsp_apropos_create_grefs(void);
+static void			lsp_apropos_add_grefs(void);
+static bool			lsp_apropos_ingest(int);
+static struct file_t *		lsp_apropos_pending(void);
+static void			lsp_apropos_start(void);
+static void *			lsp_arena_alloc(struct lsp_arena_t **, size_t);
+static void			lsp_arena_dtor(struct lsp_arena_t **);
+static struct lsp_arena_mark_t	lsp_arena_mark(struct lsp_arena_t **);
+static void *			lsp_arena_realloc(struct lsp_arena_t **, void *, size_t, size_t);
+static void			lsp_arena_release(struct lsp_arena_t **, struct lsp_arena_mark_t);
 static void			lsp_argv_dtor(char **);
 static int			lsp_argv_size(char **);
 static size_t			lsp_buffer_free_size(void);
@@ -170,17 +290,20 @@ static void			lsp_cmd_reload(void);
 static void			lsp_cmd_resize(void);
 static void			lsp_cmd_search(bool);
 static void			lsp_cmd_search_bw(lsp_mode_t);
+static void			lsp_cmd_search_files(void);
 static void			lsp_cmd_search_fw(lsp_mode_t);
 static void			lsp_cmd_search_refs(void);
 static void			lsp_cmd_toggle_options(void);
 static void			lsp_cmd_visit_reference(void);
 static char *			lsp_cmd_select_file(void);
-static int			lsp_cmp_line_pos(size_t, off_t);
+static size_t			lsp_cmd_select_line(char *, size_t);
+static void			lsp_cmd_stats(void);
 static char**			lsp_create_man_argv(char *, char *);
 static void			lsp_create_status_line(void);
 static void			lsp_cursor_care(void);
 static int			lsp_debug(const char *, ...);
 static size_t			lsp_decode_sgr(const char *, attr_t *, short *);
+static size_t			lsp_decode_sgr_uncached(const char *, attr_t *, short *);
 static char *			lsp_detect_manpage(bool);
 static void			lsp_display_page(void);
 static char **			lsp_env2argv(char *);
@@ -192,44 +315,64 @@ static void			lsp_file_add_block(void);
 static ssize_t			lsp_file_add_line(const char *);
 static void			lsp_file_align_buffer(void);
 static void			lsp_file_backward(int);
+static void			lsp_file_blocks_add(struct data_t *);
+static bool			lsp_file_check_truncated(void);
 static void			lsp_file_close(void);
 static struct file_t *		lsp_file_ctor(void);
 static void			lsp_file_data_ctor(size_t);
-static void			lsp_file_data_dtor(struct data_t *);
+static off_t			lsp_file_data_end(void);
+static void			lsp_file_data_dtor(struct file_t *);
 static ssize_t			lsp_file_do_read(unsigned char *, size_t);
 static void			lsp_file_dtor(struct file_t *);
 static struct file_t *		lsp_file_find(char *);
+static bool			lsp_file_follow(void);
 static void			lsp_file_forward_empty_lines(size_t);
 static void			lsp_file_forward_words(size_t);
 static struct lsp_line_t *	lsp_file_get_prev_line(void);
 static int			lsp_file_getch(void);
+static void			lsp_file_goto_data_end(void);
+static void			lsp_file_index_lines(const unsigned char *, off_t, size_t);
 static void			lsp_file_init(void);
 static void			lsp_file_init_ring(void);
 static void			lsp_file_init_stdin(void);
+static void			lsp_file_evict(void);
+static bool			lsp_file_evictable(struct file_t *);
+static bool			lsp_file_ingest(int);
 static void			lsp_file_inject_line(const char *);
+static void			lsp_file_insert(struct file_t *, bool);
 static bool			lsp_file_is_regular(void);
 static bool			lsp_file_is_stdin(void);
 static void			lsp_file_kill(void);
+static size_t			lsp_file_lines_estimate(void);
+static bool			lsp_file_map(void);
+static ssize_t			lsp_file_map_block(size_t);
+static size_t			lsp_file_mem(struct file_t *);
 static void			lsp_file_move_here(struct file_t *);
 static int			lsp_file_peek_bw(void);
-static int			lsp_file_peek_fw(void);
 static size_t			lsp_file_pos2line(off_t);
-static void			lsp_file_read_all(void);
+static size_t			lsp_file_pos2line_estimate(off_t);
 static ssize_t			lsp_file_read_block(size_t);
 static void			lsp_file_read_to_pos(off_t);
-static void			lsp_file_reload(void);
+static void			lsp_file_reap(struct file_t *);
+static void			lsp_file_remap(off_t);
 static void			lsp_file_reread(void);
 static void			lsp_file_reset(void);
+static void			lsp_file_restore(void);
 static void			lsp_file_ring_dtor(void);
+static off_t			lsp_file_search_candidate(off_t);
+static off_t			lsp_file_search_candidate_bw(off_t);
 static regmatch_t		lsp_file_search_next(void);
+static off_t			lsp_file_search_window(off_t, off_t, bool);
 static void			lsp_file_set_blksize(void);
 static void			lsp_file_set_current_match(regmatch_t);
 static void			lsp_file_set_pos(off_t);
 static void			lsp_file_set_prev_line(void);
 static void			lsp_file_set_size(void);
+static void			lsp_file_swap_data(struct file_t *, struct file_t *);
 static void			lsp_file_toc_add(const struct lsp_line_t *, int);
-static void			lsp_file_ungetch(void);
+static void			lsp_files_evict(void);
 static void			lsp_files_list(void);
+static size_t			lsp_find_special(const char *, size_t);
 static void			lsp_finish(void) __attribute__ ((noreturn));
 static size_t			lsp_fread(void *, size_t, size_t, FILE *);
 static short			lsp_get_color_pair(short, short);
@@ -240,16 +383,19 @@ static struct lsp_line_t *	lsp_get_next_display_line(void);
 static char *			lsp_get_parent_cmd_line(pid_t);
 static size_t			lsp_get_sgr_len(const char *);
 static struct lsp_line_t *	lsp_get_this_line(void);
-static struct gref_t *		lsp_gref_find(char *);
-static int			lsp_gref_henter(struct gref_t *);
+static int			lsp_getch(void);
+static struct gref_t *		lsp_gref_find(const char *, size_t);
+static size_t			lsp_gref_hash(const char *, size_t);
+static bool			lsp_gref_is(const struct gref_t *, size_t, const char *, size_t);
 static void			lsp_goto_bol(void);
 static void			lsp_goto_last_wpage(void);
 static void			lsp_grefs_dtor(void);
-static struct gref_t *		lsp_gref_search(const char *);
+static struct gref_t *		lsp_gref_search(const char *, size_t);
+static void			lsp_grefs_grow(void);
+static void			lsp_grefs_verify(struct gref_t **, size_t);
 static bool			lsp_has_man_placeholders(const char *);
 static void			lsp_init(void);
 static void			lsp_init_cmd_input(void);
-static void			lsp_init_hwin(void);
 #if DEBUG
 static void			lsp_init_logfile(void);
 #endif
@@ -263,20 +409,57 @@ static bool			lsp_is_no_match(regmatch_t);
 static bool			lsp_is_readable(char *);
 static bool			lsp_is_sgr_sequence(const char *);
 static void			lsp_line_add_wlines(struct lsp_line_t *);
+static void			lsp_line_cache_add(struct lsp_line_t *, size_t);
+static void			lsp_line_cache_dtor(struct file_t *);
+static void			lsp_line_cache_evict(void);
+static struct lsp_line_t *	lsp_line_cache_get(size_t, off_t);
+static void			lsp_line_cache_push(struct lsp_line_t *);
+static void			lsp_line_cache_unlink(struct lsp_line_t *);
 static size_t			lsp_line_count_words(struct lsp_line_t *);
 static struct lsp_line_t *	lsp_line_ctor(void);
-static void			lsp_line_cut_tail(struct lsp_line_t *, off_t);
+static struct lsp_line_t *	lsp_line_ctor_transient(void);
+static struct lsp_line_t *	lsp_line_cut_tail(struct lsp_line_t *, off_t);
 static void			lsp_line_dtor(struct lsp_line_t *);
 static int			lsp_line_handle_leading_sgr(attr_t *, short *);
+static size_t			lsp_line_find_matches(const struct lsp_line_t *, regmatch_t **);
+static struct lsp_line_t *	lsp_line_from_data(off_t, off_t);
 static size_t			lsp_line_get_matches(const struct lsp_line_t *, regmatch_t **);
 static regmatch_t		lsp_line_get_last_match(struct lsp_line_t **);
+static void			lsp_line_init(struct lsp_line_t *);
+static size_t			lsp_line_n2raw(const struct lsp_line_t *, size_t);
+static void *			lsp_line_realloc(struct lsp_line_t *, void *, size_t, size_t);
 static void			lsp_lines_add(off_t);
+static void			lsp_lines_ctor(struct file_t *);
+static off_t			lsp_lines_decode(const unsigned char **);
+static void			lsp_lines_dtor(struct file_t *);
+static size_t			lsp_lines_find(off_t);
+static off_t			lsp_lines_get(size_t);
+static size_t			lsp_lines_mem(struct file_t *);
 static void *			lsp_malloc(size_t);
 static char *			lsp_man_get_section(off_t);
+static bool			lsp_matches_covers(const struct lsp_line_t *);
+static size_t			lsp_matches_find(off_t);
+static size_t			lsp_matches_get(const struct lsp_line_t *, regmatch_t **);
+static bool			lsp_matches_pending(void);
+static void			lsp_matches_reset(struct file_t *);
+static bool			lsp_matches_search_next(regmatch_t *);
+static bool			lsp_matches_search_prev(regmatch_t *);
+static void			lsp_matches_step(void);
+static bool			lsp_matches_sync(void);
 static int			lsp_man_goto_section(char *);
 static struct man_id		lsp_man_id_ctor(const char *);
 static void			lsp_man_id_dtor(struct man_id *);
+static bool			lsp_man_done(struct file_t *);
+static void			lsp_man_fork(void);
+static void			lsp_man_ingest(struct file_t *, int);
+static void			lsp_man_render_drop(struct file_t *);
+static struct file_t *		lsp_man_render_find(int);
+static void			lsp_man_render_start(void);
+static bool			lsp_man_render_step(int);
+static void			lsp_man_render_switch(struct file_t *);
+static void			lsp_man_render_update(void);
 static void			lsp_man_reposition(char *);
+static void			lsp_man_set_name(char *);
 static void			lsp_mark_regular_file(void);
 static uint			lsp_mblen(const char *, size_t);
 static size_t			lsp_mbtowc(wchar_t *, const char *, size_t);
@@ -294,14 +477,30 @@ static void			lsp_mode_toggle_highlight(void);
 static void			lsp_mode_unset_highlight(void);
 static void			lsp_mode_unset_search_or_refs(void);
 static void			lsp_mode_unset_toc(void);
-static char *			lsp_normalize(const char *, size_t, size_t*);
+static char *			lsp_normalize(const char *, size_t, size_t *, struct lsp_nmap_t **, size_t *, struct lsp_arena_t **);
 static char *			lsp_normalize2str(const char *, size_t);
-static size_t			lsp_normalize_count(const char *, size_t, size_t);
+static void			lsp_ofile_finish(void);
+static void			lsp_ofile_flush(int);
+static bool			lsp_ofile_full(void);
+static void			lsp_ofile_start(void);
+static void			lsp_ofile_wait(void);
+static void			lsp_ofile_write(const unsigned char *, size_t);
+static size_t			lsp_ofile_write_some(const unsigned char *, size_t);
+static void			lsp_ofile_writer(int, int);
 static void			lsp_open_cterm(void);
 static int			lsp_open_file(const char *);
 static void			lsp_open_manpage(char *);
+static int			lsp_page_count_rows(off_t, off_t, int);
+static void			lsp_page_invalidate(void);
+static bool			lsp_page_is_kept(int);
+static void			lsp_page_row(int, off_t, bool);
+static int			lsp_page_scroll(void);
+static size_t			lsp_parse_size(const char *);
 static void			lsp_pinfo_dtor(void);
 static void			lsp_pinfo_ctor(void);
+static struct file_t *		lsp_prefetch_pending(void);
+static void			lsp_prefetch_ref(void);
+static bool			lsp_prefetch_take(char *);
 #if DEBUG
 static void			lsp_print_file_ring(void);
 #endif
@@ -316,36 +515,64 @@ static void			lsp_print_argv(char **);
 static void			lsp_process_env_open(void);
 static char *			lsp_read_manpage_name(void);
 static void *			lsp_realloc(void *, size_t);
+static int			lsp_regexec(const regex_t *, const char *, size_t, regmatch_t *, int);
 static bool			lsp_ref_is_valid(struct gref_t *);
+static char *			lsp_ref_verify_command(struct gref_t *);
+static void			lsp_refs_cache_add(struct gref_t **, size_t);
+static void			lsp_refs_cache_load(void);
+static char *			lsp_refs_cache_path(void);
+static time_t			lsp_refs_cache_stamp(void);
+static void			lsp_refs_verify_around(off_t);
 static void			lsp_remove_bs_from_string(char *);
+static int			lsp_wc_column(wchar_t, int);
 static void			lsp_wline_bw(int);
 static void			lsp_wline_fw(int);
 static void			lsp_search_align_page_to_match(void);
 static void			lsp_search_align_toc_to_match(void);
 static void			lsp_search_align_to_match(int);
 static char *			lsp_search_compile_regex(lsp_mode_t);
+static void			lsp_search_files_add_hit(struct lsp_search_worker_t *, off_t);
+static bool			lsp_search_files_collect(struct lsp_search_worker_t *, size_t);
+static size_t			lsp_search_files_start(struct lsp_search_worker_t *);
+static void			lsp_search_files_worker(struct lsp_search_worker_t *, int);
+static void			lsp_search_files_write(int, const off_t *, size_t);
+static void			lsp_search_literal_ctor(const char *);
+static const char *		lsp_search_literal_find(const char *, size_t, bool);
+static const char *		lsp_search_literal_find_first(const char *, size_t);
 static regmatch_t		lsp_search_next(void);
+static bool			lsp_search_prepare(bool, char);
 static void			lsp_set_manpager(void);
 static void			lsp_set_no_current_match(void);
 static int			lsp_sgr_extract_enns(const char *, long *, size_t);
+static struct lsp_sgr_memo_t *	lsp_sgr_memo_slot(const char *, size_t, attr_t, short);
 static size_t			lsp_skip_bsp(const char *, size_t);
 static size_t			lsp_skip_sgr(const char *, size_t);
 static size_t			lsp_skip_to_payload(const char *, size_t);
+static void			lsp_stats_add(struct lsp_stats_time_t *, double);
+static double			lsp_stats_now(void);
+static void			lsp_stats_print(FILE *);
+static void			lsp_stats_print_time(FILE *, const char *, struct lsp_stats_time_t *);
 static char **			lsp_str2argv(const char *);
 static void			lsp_to_lower(char *);
-static struct toc_node_t *	lsp_pos_to_toc(off_t);
+static size_t			lsp_pos_to_toc(off_t);
 static void			lsp_toc_bw(size_t);
+static bool			lsp_toc_classify(void);
 static void			lsp_toc_ctor(void);
 static void			lsp_toc_dtor(struct file_t *);
+static size_t			lsp_toc_find(off_t);
 static void			lsp_toc_first_adjust(void);
 static void			lsp_toc_fw(size_t);
 static off_t			lsp_toc_get_offset_at_cursor(void);
 static int			lsp_toc_move_to_next(void);
 static int			lsp_toc_move_to_prev(void);
+static size_t			lsp_toc_next(size_t);
+static size_t			lsp_toc_rank(size_t);
 static void			lsp_toc_rewind(off_t);
+static size_t			lsp_toc_visible(size_t);
 static regmatch_t		lsp_toc_search_next(void);
 static void			lsp_usage(const char *);
 static bool			lsp_validate_ref_at_pos(regmatch_t);
+static bool			lsp_validate_ref_at_pos_wait(regmatch_t);
 static void			lsp_version(void);
 static void			lsp_workhorse(void);
 /*
@@ -372,24 +599,42 @@ struct file_t {
 	 */
 	FILE *fp;
 	int fd;
+	pid_t pid;	      // child feeding fd, reaped after closing it
 
 	off_t page_first;     // first byte in current page
 	off_t page_last;      // last byte in current page
 
 	size_t lines_count;   // number of lines in file -- so far
-	off_t *lines;	       // record the offsets of the lines in
-			      // the file.
-	size_t lines_size;    // current size of the above array
+	struct lsp_lines_chunk_t *lines; // record the offsets of the lines
+			      // in the file.
+	size_t lines_size;    // current size of the above array (chunks)
+	size_t apropos_lines; // apropos lines already turned into grefs
 
 	off_t seek;	      // current position in file
 	off_t size;	      // size of the file
 	blksize_t blksize;    // preferred blksize to use
 
 	struct data_t *data;  // content of the file that we already read
+	struct data_t **blocks;	// index of the buffers in data by seek
+	size_t blocks_count;  // number of buffers in the index
+	size_t blocks_size;   // current size of the above array
+
+	struct lsp_line_t **lcache;	// line cache buckets by line number
+	struct lsp_line_t *lcache_mru;	// most recently used cached line
+	struct lsp_line_t *lcache_lru;	// least recently used cached line
+	size_t lcache_count;  // number of lines in the cache
 
 	struct file_t *prev;
 	struct file_t *next;
 
+	int width;	      // terminal width a manual page is rendered for
+	char *man_pn;	      // MAN_PN of a manual page read in the background
+
+	unsigned long used;   // lsp_files_clock when the file was last shown
+	bool evicted;	      // data dropped to stay within --max-mem
+	char *evicted_section;	// section of a manual page shown at that time
+	struct file_t *renders;	// renderings of a manual page for other widths
+
 	char flags;
 	char ftype;
 	bool do_reload;
@@ -409,19 +654,36 @@ struct file_t {
 	   cmatch_x == -1 := no valid cursor position */
 	int cmatch_y, cmatch_x;
 
-	struct toc_node_t *toc;
+	struct toc_node_t *toc_entries;	// TOC entries found so far
+	struct toc_level_t toc_levels[LSP_TOC_LEVELS];	// entries per level
+	size_t toc_count;     // number of TOC entries
+	size_t toc_size;      // current size of the above array
+	off_t toc_seek;	      // next line to classify for the TOC
+	size_t toc;	      // current TOC entry
 	/*
 	 * The current active line in the TOC window.
 	 */
 	size_t toc_cursor;
 	/*
-	 * Remember the first and last toc entries (offsets in the file) in the
-	 * window for navigation.
+	 * Remember the first and last toc entries (indices in toc_entries) in
+	 * the window for navigation.
 	 */
-	struct toc_node_t *toc_first;
-	/* toc_last == NULL means: last TOC entry is on current page. */
-	struct toc_node_t *toc_last;
+	size_t toc_first;
+	/* toc_last == LSP_TOC_NONE means: last TOC entry is on current page. */
+	size_t toc_last;
 	int current_toc_level;
+
+	/*
+	 * Index of all matches of the search pattern, built while we wait
+	 * for input.  It covers the lines in front of matches_seek and
+	 * belongs to the pattern compiled as number matches_gen.
+	 */
+	regmatch_t *matches;  // absolute offsets of matches in file order
+	size_t matches_count; // number of matches found so far
+	size_t matches_size;  // current size of the above array
+	off_t matches_seek;   // next line to look at, (off_t)-1: no index
+	off_t matches_tail;   // indexed last line without newline or (off_t)-1
+	unsigned long matches_gen;
 } *cf;				/* cf == current_file */
 
 regmatch_t lsp_no_match;
@@ -430,8 +692,11 @@ WINDOW *lsp_win;		/* Global window all the paging happens in. */
 
 enum lsp_flag {
 	LSP_FLAG_POPEN = 1,	/* We need to use pclose() when this file is done. */
-	LSP_PRE_READ = 2	/* We read a single byte from a pipe that needs
+	LSP_PRE_READ = 2,	/* We read a single byte from a pipe that needs
 				 * to be consumed. */
+	LSP_FLAG_MMAP = 4,	/* Data is a read-only mapping of the file. */
+	LSP_FLAG_MAN_PN = 8,	/* Heading line with MAN_PN still to be read. */
+	LSP_FLAG_NO_TEE = 16	/* tee(2) doesn't work for the input. */
 };
 
 typedef enum lsp_flag lsp_flag_t;
@@ -440,7 +705,8 @@ enum lsp_ftype {
 	LSP_FTYPE_OTHER   = 0,
 	LSP_FTYPE_MANPAGE = 1,
 	LSP_FTYPE_STDIN   = 2,	/* We were started with data coming from stdin. */
-	LSP_FTYPE_REGULAR = 4
+	LSP_FTYPE_REGULAR = 4,
+	LSP_FTYPE_APROPOS = 8	/* Output of apropos(1), grefs get taken from it. */
 };
 
 typedef enum lsp_ftype lsp_ftype_t;
@@ -451,11 +717,96 @@ typedef enum lsp_ftype lsp_ftype_t;
  */
 #define current_file cf
 
+/* TOC entry i of the current file */
+#define LSP_TOC(i) (cf->toc_entries[i])
+
+/* No TOC entry */
+#define LSP_TOC_NONE ((size_t)-1)
+
 /* getch_pos is used everywhere, make it even shorter */
 #define lsp_pos (current_file->getch_pos)
 
-/* Initial size of array for recording offsets of lines */
-enum { LSP_LINES_INITIAL_SIZE = 1024 };
+/* Initial size of array for recording offsets of lines (in chunks) */
+enum { LSP_LINES_INITIAL_SIZE = 16 };
+
+/* Number of lines per chunk of the line index. */
+enum { LSP_LINES_CHUNK = 128 };
+
+/* Maximum bytes of an encoded distance between two lines. */
+enum { LSP_LINES_DELTA_MAX = (sizeof(off_t) * 8 + 6) / 7 };
+
+/* Initial size of the index of data buffers of a file */
+enum { LSP_BLOCKS_INITIAL_SIZE = 64 };
+
+/* Number of lines we keep in the line cache of a file and its buckets */
+enum { LSP_LINE_CACHE_SIZE = 128, LSP_LINE_CACHE_BUCKETS = 64 };
+
+/* Initial amount of data we look at at once when searching for literals. */
+enum { LSP_SEARCH_WINDOW = 4096 };
+
+/* Amount of data of mapped files we record lines for in one go. */
+enum { LSP_MMAP_CHUNK = 1024 * 1024 };
+
+/* Amount of data we read in between two looks at the keyboard. */
+enum { LSP_INGEST_SIZE = 4 * 1024 * 1024 };
+
+/* Milliseconds between two checks if a followed file grew. */
+enum { LSP_FOLLOW_INTERVAL = 200 };
+
+/* Milliseconds the terminal size has to stay the same before we start
+   rendering manual pages for it. */
+enum { LSP_RENDER_DELAY = 250 };
+
+/* Number of renderings for other widths we keep per manual page. */
+enum { LSP_MAN_RENDERS = 4 };
+
+/* Number of manual pages we prefetch for references at most. */
+enum { LSP_PREFETCH_MAX = 4 };
+
+/* Bytes of a manual page we read ahead before it gets visited. */
+enum { LSP_PREFETCH_SIZE = 1024 * 1024 };
+
+/* Longest reference we take from apropos output */
+enum { LSP_REF_MAX_LEN = 256 };
+
+/* Initial number of entries of a TOC */
+enum { LSP_TOC_INITIAL_SIZE = 256 };
+
+/* Initial number of slots of the grefs table */
+enum { LSP_GREFS_INITIAL_SIZE = 1024 };
+
+/* Minimum size of arena chunks */
+enum { LSP_ARENA_CHUNK_SIZE = 64 * 1024 };
+
+/* Initial number of entries of the index of search matches */
+enum { LSP_MATCHES_INITIAL_SIZE = 256 };
+
+/* Amount of data we look for search matches in between two looks at the
+   keyboard. */
+enum { LSP_MATCHES_STEP = 256 * 1024 };
+
+/* Number of line starts a search worker sends in one write(2). */
+enum { LSP_SEARCH_HITS_BATCH = 512 };
+
+/* Size we ask for the pipe to the writer of the -o file and the buffer the
+   writer uses without splice(2). */
+enum { LSP_OFILE_PIPE_SIZE = 1024 * 1024, LSP_OFILE_BUFFER_SIZE = 64 * 1024 };
+
+/* Most data for the -o file we keep while the writer is behind. */
+enum { LSP_OFILE_PENDING_MAX = 16 * 1024 * 1024 };
+
+/* Maximum number of verify commands we run in parallel. */
+enum { LSP_VERIFY_JOBS = 8 };
+
+/* Number of decoded SGR sequences we remember and their maximum length */
+enum { LSP_SGR_MEMO_SIZE = 256, LSP_SGR_MEMO_LEN = 32 };
+
+/* Number of colors we look up color pairs for in a table */
+enum { LSP_PAIR_COLORS = 256 };
+
+/* Directories whose changes invalidate the cache of verified references,
+   in addition to $MANPATH. */
+#define LSP_MANPATH_DEFAULT "/usr/share/man:/usr/local/share/man:/usr/local/man:/var/cache/man"
 
 enum { LSP_FSIZE_UNKNOWN = (off_t)-1 };
 #define LSP_EOF (cf->size != LSP_FSIZE_UNKNOWN && cf->size == cf->seek)
@@ -483,6 +834,13 @@ char lsp_search_string_old[256];
 regex_t *lsp_search_regex;
 regex_t *lsp_refs_regex;
 
+/* Counts compilations of lsp_search_regex to tell its indexes apart. */
+unsigned long lsp_search_gen;
+
+/* Literal string that all matches of lsp_search_regex contain (or NULL). */
+char *lsp_search_literal;
+size_t lsp_search_literal_len;
+
 /*
  * The following variable steers the positioning of search matches.
  * Matches can go to the first line or centerd in the window and this is toggled
@@ -500,6 +858,26 @@ short lsp_next_pair;
 short lsp_fg_color_default;
 short lsp_bg_color_default;
 
+/*
+ * Direct-mapped cache of decoded SGR sequences.
+ * The result of a sequence depends on the attribute and color pair that were
+ * active before it, so these are part of the key.
+ */
+struct lsp_sgr_memo_t {
+	char	seq[LSP_SGR_MEMO_LEN];
+	size_t	len;			/* 0 for unused slots */
+	attr_t	attr_in;
+	short	pair_in;
+	attr_t	attr;
+	short	pair;
+} lsp_sgr_memo[LSP_SGR_MEMO_SIZE];
+
+/*
+ * Color pairs by (fg + 1, bg + 1), so the default color -1 fits in.
+ * Entries hold the pair number + 1 and 0 if not yet looked up.
+ */
+short lsp_pairs[LSP_PAIR_COLORS + 1][LSP_PAIR_COLORS + 1];
+
 /* Coords of cursor, if in use. */
 int	lsp_cursor_y;
 int	lsp_cursor_x;
@@ -523,8 +901,18 @@ char	lsp_man_case_sensitivity;
 char	*lsp_logfile;
 FILE	*lsp_logfp;
 
-/* Output file to duplicate our input to. */
+/* Output file to duplicate our input to.
+   Once the writer process runs this is the pipe to it. */
 int	lsp_ofile;
+pid_t	lsp_ofile_pid;
+
+/* Data for the output file that didn't fit into the pipe yet. */
+struct lsp_ofile_pending_t {
+	unsigned char *data;
+	size_t done;		/* bytes at data already handed over */
+	size_t len;		/* bytes still pending after done */
+	size_t size;		/* allocated bytes */
+} lsp_ofile_pending;
 bool	lsp_do_line_numbers = false;
 
 /* Do colored output or not.
@@ -538,9 +926,48 @@ char	*lsp_verify_command;
 bool	lsp_verify_with_apropos;
 bool	lsp_verify;
 
+/* Keep verified references in a cache file (--refs-cache). */
+bool	lsp_refs_cache;
+int	lsp_refs_cache_fd;
+
 /* Keep CR (\r) as is (true) or translate to ^M (false) */
 bool	lsp_keep_cr;
 
+/* Follow growing files and keep showing their end (--follow, 'F'). */
+bool	lsp_follow;
+
+/* Format manual pages of selected references ahead of time (--prefetch).
+   They wait outside of the ring until they get visited. */
+bool	lsp_prefetch;
+struct file_t *lsp_prefetched;
+
+/* Memory budget for the data of all files (--max-mem), 0 is unlimited.
+   Files not shown for the longest time drop their data first. */
+size_t	lsp_max_mem;
+unsigned long lsp_files_clock;
+
+/* Show byte percentage and estimated line numbers in the status line
+   for files not read completely (--approx-status, '-%'). */
+bool	lsp_approx_status;
+
+/*
+ * Counters to find out where time goes, shown with 'i' and on exit with
+ * --dump-stats.
+ */
+struct lsp_stats_t {
+	size_t bytes_read;	/* read(2) from input */
+	size_t bytes_mapped;	/* recorded from mapped files */
+	size_t blocks;		/* data blocks allocated */
+	size_t lines;		/* line structures constructed */
+	size_t normalized;	/* lines normalized */
+	size_t normalized_bytes;
+	size_t regexec;		/* regexec(3) calls */
+	struct lsp_stats_time_t verify;		/* verify commands forked */
+	struct lsp_stats_time_t man;		/* manual pages started */
+	struct lsp_stats_time_t keys[KEY_MAX + 1];	/* commands by key */
+} lsp_stats;
+bool	lsp_dump_stats;
+
 /*
  * Further global variables.
  */
@@ -549,6 +976,7 @@ bool	lsp_utf_8;
 
 /* Temporary prompt to display in the center of the footer. */
 char	*lsp_prompt;
+char	*lsp_prompt_shown;	/* last prompt put into the status line */
 int	lsp_tab_width;
 
 /* Columns to horizontaly shift.
@@ -562,16 +990,6 @@ char    *lsp_reload_not_supported = "Reload not supported.";
 /* String from LSP_OPEN or LESSOPEN environment variable. */
 char *lsp_env_open;
 
-/*
- * Number of entries for grefs hash table.
- *
- * Searching for references e.g. in source code can produce many grefs
- * (invalid ones)!
- */
-size_t lsp_htable_entries;
-/* We count grefs -- just to be able to lookup that number. */
-size_t lsp_grefs_count;
-
 /*
  * Counter for words and empty lines for repositioning after reload of manual
  * pages.
@@ -588,8 +1006,31 @@ struct {
 	size_t elines;
 } lsp_reposition;
 
-/* Hidden window and its width for dividing physical lines into window lines. */
-WINDOW *lsp_hwin;
-int lsp_hwin_cols;
+/*
+ * The page last drawn into the window.
+ *
+ * For each window line we remember the file position it starts at, if that
+ * also is the beginning of a line and what page_last was after it.  Moves by
+ * just a few window lines can then scroll the window and only draw the window
+ * lines that became visible.
+ */
+struct {
+	struct file_t *file;	/* file shown, NULL if nothing can be kept */
+	off_t *rows;		/* start of window lines, -1 if inside a TAB or CR;
+				 * one more for the position after the page */
+	bool *bol;		/* window line starts a line */
+	off_t *last;		/* page_last after each window line */
+	int size;		/* allocated entries */
+	int n_rows;		/* window lines on the page */
+	int maxx;		/* window size the page was drawn for */
+	int maxy;
+	unsigned char shift;
+	lsp_mode_t mode;
+	regex_t *regex_p;
+	regmatch_t current_match;
+	int first;		/* first window line drawn this time */
+	int kept;		/* window lines kept below the drawn ones */
+	off_t dirty;		/* position of a new current match, or -1 */
+} lsp_page;
 
 #endif // _LSP_H_GUARD_
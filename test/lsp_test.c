@@ -0,0 +1,119 @@
+/*
+ * lsp_test - tests for internals of lsp
+ *
+ * Copyright (C) 2023-2024, Dirk Gouders
+ *
+ * This file is part of lsp.
+ *
+ * lsp is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * lsp is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * lsp. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Like the benchmarks, we include the source of lsp to get at its static
+ * functions.  No terminal is needed.
+ */
+#define LSP_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../lsp.c"
+
+static int lsp_test_failed;
+
+static void lsp_test_check(bool ok, const char *what, const char *pattern)
+{
+	if (ok)
+		return;
+
+	fprintf(stderr, "FAIL: %s: \"%s\"\n", what, pattern);
+	lsp_test_failed++;
+}
+
+/*
+ * The search literal must be something every match contains.
+ */
+static void lsp_test_literal(const char *pattern, const char *literal)
+{
+	lsp_search_literal_ctor(pattern);
+
+	if (literal == NULL)
+		lsp_test_check(lsp_search_literal == NULL, "no literal", pattern);
+	else
+		lsp_test_check(lsp_search_literal != NULL &&
+			       lsp_search_literal_len == strlen(literal) &&
+			       memcmp(lsp_search_literal, literal,
+				      lsp_search_literal_len) == 0,
+			       literal, pattern);
+}
+
+/*
+ * Search the current file for pattern forward from its start and backward
+ * from its end and tell if both found match_pos.
+ */
+static void lsp_test_search(const char *pattern, off_t match_pos)
+{
+	struct lsp_line_t *line;
+	regmatch_t match;
+
+	strcpy(lsp_search_string, pattern);
+
+	if (lsp_search_compile_regex(LSP_SEARCH_MODE) != NULL)
+		lsp_error("%s: cannot compile \"%s\"", __func__, pattern);
+
+	cf->regex_p = lsp_search_regex;
+	lsp_mode_set(LSP_SEARCH_MODE);
+
+	lsp_file_set_pos(0);
+	match = lsp_file_search_next();
+	lsp_test_check(match.rm_so == match_pos, "search forward", pattern);
+
+	lsp_file_set_pos(cf->size);
+	line = lsp_file_get_prev_line();
+	match = lsp_line_get_last_match(&line);
+	lsp_line_dtor(line);
+	lsp_test_check(match.rm_so == match_pos, "search backward", pattern);
+}
+
+int main()
+{
+	lsp_init();
+
+	lsp_test_literal("foo", "foo");
+	lsp_test_literal("a\\.b", "a.b");
+	lsp_test_literal("\\(x\\)", "(x)");
+	lsp_test_literal("\\<foo", "foo");
+	lsp_test_literal("bar\\>", "bar");
+	lsp_test_literal("\\`foo\\'", "foo");
+	lsp_test_literal("x\\bfoo", "foo");
+	lsp_test_literal("\\w", NULL);
+
+	lsp_file_add("lsp test", true);
+	lsp_file_add_line("some foo here\n");
+	lsp_file_add_line("bar baz\n");
+
+	lsp_test_search("foo", 5);
+	lsp_test_search("\\<foo", 5);
+	lsp_test_search("foo\\>", 5);
+	lsp_test_search("bar\\>", 14);
+	lsp_test_search("\\<bar\\>", 14);
+	lsp_test_search("o\\>", 7);
+	lsp_test_search("\\bhere", 9);
+	lsp_test_search("\\Boo", 6);
+	lsp_test_search("b\\w+z", 18);
+	lsp_test_search("\\<oo", -1);
+
+	lsp_file_kill();
+
+	if (lsp_test_failed)
+		fprintf(stderr, "%d tests failed.\n", lsp_test_failed);
+
+	return lsp_test_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}